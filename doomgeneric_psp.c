@@ -5,6 +5,7 @@
 
 #include "doomgeneric.h"
 #include "doomkeys.h"
+#include "psp_sound.h"
 
 #include <pspkernel.h>
 #include <pspdisplay.h>
@@ -56,6 +57,30 @@ static void dbg_logn(const char *msg, int val)
     }
 }
 
+/* Audio counters, so a session's music load and sound cache show up
+ * in the log */
+static void dbg_sound_stats(void)
+{
+    music_stats_t m;
+    sfx_stats_t   s;
+
+    if (!dbg_file)
+        return;
+
+    I_GetMusicStats(&m);
+    fprintf(dbg_file, "music: %u late blocks, %u sheds, %u restores, "
+                      "%u voices cut, worst block %u us\n",
+            (unsigned)m.late, (unsigned)m.sheds, (unsigned)m.restores,
+            (unsigned)m.voices_cut, (unsigned)m.worst_us);
+
+    I_GetSoundStats(&s);
+    fprintf(dbg_file, "sfx: %u hits, %u misses, %u dropped, %u evictions, "
+                      "%u bytes resident\n",
+            (unsigned)s.hits, (unsigned)s.misses, (unsigned)s.drops,
+            (unsigned)s.evictions, (unsigned)s.bytes);
+    fflush(dbg_file);
+}
+
 static void dbg_close(void)
 {
     if (dbg_file)
@@ -456,6 +481,7 @@ void DG_DrawFrame(void)
     if (!running)
     {
         dbg_log("DG_DrawFrame: exit requested");
+        dbg_sound_stats();
         dbg_close();
         sceKernelExitGame();
         return;
@@ -561,6 +587,7 @@ int main(int argc, char **argv)
         doomgeneric_Tick();
 
     dbg_log("Main loop ended, shutting down");
+    dbg_sound_stats();
     dbg_close();
     sceGuTerm();
     sceKernelExitGame();
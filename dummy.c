@@ -4,19 +4,13 @@
  */
 
 #include "doomgeneric.h"
+#include "doomtype.h"
+#include "d_event.h"
+#include "d_player.h"
+#include "w_wad.h"
+#include "psp_sound.h"
 
-typedef int boolean;
-typedef unsigned char byte;
-#define false 0
-#define true  1
-
-/* Event system */
-typedef enum { ev_keydown, ev_keyup, ev_mouse, ev_joystick } evtype_t;
-typedef struct { evtype_t type; int data1; int data2; int data3; } event_t;
-extern void D_PostEvent(event_t *ev);
-
-struct wbstartstruct_s;
-typedef struct wbstartstruct_s wbstartstruct_t;
+#include <stdio.h>
 
 /* Variabili globali config */
 int snd_musicdevice = 0;
@@ -55,5 +49,17 @@ void I_BindJoystickVariables(void) {}
 
 /* Misc */
 void I_Endoom(byte *endoom_data) { (void)endoom_data; }
-void StatCopy(wbstartstruct_t *stats) { (void)stats; }
+
+/*
+ * StatCopy: chiamata da G_DoCompleted subito prima di WI_Start.
+ * Prepara in background la musica della prossima mappa (d_eXmY, come
+ * S_Start per Chex/Doom 1) mentre si guarda l'intermissione.
+ */
+void StatCopy(wbstartstruct_t *stats)
+{
+    char name[9];
+
+    snprintf(name, sizeof(name), "d_e%dm%d", stats->epsd + 1, stats->next + 1);
+    I_PrefetchSong(W_CheckNumForName(name));
+}
 void StatDump(void) {}
@@ -5,14 +5,14 @@
 
 #include "doomtype.h"
 #include "i_sound.h"
+#include "psp_sound.h"
 #include "sounds.h"
 #include "w_wad.h"
 #include "z_zone.h"
-#include "memio.h"
-#include "mus2mid.h"
 
 #include <pspaudio.h>
 #include <pspthreadman.h>
+#include <stddef.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -30,12 +30,41 @@
 #define OPL_RATE            49716
 #define OPL_NUM_CHANNELS    9
 
+/*
+ * Synthesis modes:
+ *  RESAMPLED - clocks run at OPL_RATE, output is linearly interpolated
+ *              down to OUTPUT_RATE (reference path)
+ *  NATIVE    - phase, LFO and envelope clocks are scaled to run directly
+ *              at OUTPUT_RATE, no resampler
+ *  LOWPOWER  - as NATIVE at OUTPUT_RATE/2, each sample interpolated to two
+ */
+#define OPL_MODE_RESAMPLED  0
+#define OPL_MODE_NATIVE     1
+#define OPL_MODE_LOWPOWER   2
+
+#ifndef OPL_SYNTH_MODE
+#define OPL_SYNTH_MODE      OPL_MODE_NATIVE
+#endif
+
+/*
+ * Channels rendered side by side by the vector kernel (4 or 8), or 0 for
+ * the scalar channel-by-channel path; the output is identical. Every
+ * sample is table lookups done lane by lane, and on the hosts measured
+ * (tools/oplcmp) the lanes are slower than the scalar path, so they stay
+ * off unless asked for. The PSP has no integer SIMD.
+ */
+#ifndef OPL_VECTOR_LANES
+#define OPL_VECTOR_LANES    0
+#endif
+
 #define EG_ATTACK   0
 #define EG_DECAY    1
 #define EG_SUSTAIN  2
 #define EG_RELEASE  3
 #define EG_OFF      4
 
+#define EG_NEVER    0xFFFFFFFFu  /* eg_left: no envelope event pending */
+
 /* ==================== OPL2 Tables ==================== */
 
 /* Log-sin table: logsin[i] = round(-log2(sin((i+0.5)/256 * pi/2)) * 256) */
@@ -118,6 +147,21 @@ static const uint8_t mt[16] = {
 /* KSL table */
 static const int32_t ksl_tab[4] = { 0, 1, 2, 4 }; /* shift values for KSL */
 
+/*
+ * Tables built once by opl_init_tables():
+ * wave_table[ws][phase] - full-period log-sin for each waveform, bit 15
+ *                         set on the negative half, OPL_WAVE_SILENT where
+ *                         the waveform is zero
+ * lin_table[log]        - log attenuation to linear output, 0 from 3584 up
+ */
+#define OPL_WAVE_SILENT     0x0FFF
+#define OPL_LIN_SIZE        4096
+
+/* One spare entry each: the AVX2 gathers load 32 bits per entry */
+static uint16_t wave_table[4][1024 + 1];
+static int16_t  lin_table[OPL_LIN_SIZE + 1];
+static int      opl_tables_built = 0;
+
 /* F-Number table for each semitone (calculated for OPL2) */
 static const uint16_t fnumber_table[12] = {
     0x157, 0x16B, 0x181, 0x198, 0x1B0, 0x1CA,
@@ -152,11 +196,15 @@ typedef struct {
     uint8_t     key;
     int32_t     ksl_atten;
 
-    /* Envelope sub-counter for proper rate timing */
-    uint32_t    eg_counter;
-    uint32_t    eg_period;
+    /* Envelope timing: cached period of each stage, samples to next event */
+    uint32_t    eg_period[4];
+    uint32_t    eg_left;
+    uint32_t    eg_frac;
 } opl_op_t;
 
+/* The register fields lead opl_op_t, mult through ws */
+#define OPL_OP_REGS     offsetof(opl_op_t, phase)
+
 typedef struct {
     opl_op_t    op[2];        /* [0]=modulator [1]=carrier */
     uint16_t    fnum;
@@ -168,22 +216,69 @@ typedef struct {
     int32_t     vol_atten;    /* volume attenuation from MIDI velocity */
 } opl_channel_t;
 
+/* A note rendered once through the synth (see Note Cache) */
+typedef struct note_entry_s {
+    struct note_entry_s *next;      /* hash chain */
+    struct note_entry_s *retired;   /* out of the hash, to be freed */
+    uint32_t    retired_at;         /* note_quiet when taken out */
+    uint32_t    key;
+    volatile int state;
+    int         refs;               /* music job voices playing it */
+    uint32_t    last_used;
+    uint32_t    bytes;
+
+    /* Attack, sustain loop and release back to back */
+    int16_t    *pcm;
+    uint16_t   *env;                /* envelope per NOTE_ENV_STEP of attack,
+                                     * then of release */
+    uint32_t    attack_len;
+    uint32_t    loop_len;           /* 0 = one-shot, ends with the attack */
+    uint32_t    release_len;
+} note_entry_t;
+
+/* An OPL channel replaced by a cached note */
+typedef struct {
+    note_entry_t   *note;           /* NULL while the channel plays FM */
+    uint32_t        pos;
+    uint32_t        fade_pos;       /* position faded out after a jump */
+    int             fade;           /* samples left of the crossfade */
+    int             released;
+} note_voice_t;
+
+/* OPL samples needed for one mix block, plus slack for the resampler */
+#define OPL_BLOCK_SAMPLES   ((MIX_SAMPLES * OPL_RATE) / OUTPUT_RATE + 2)
+
 typedef struct {
     opl_channel_t   chan[OPL_NUM_CHANNELS];
+    note_voice_t    note[OPL_NUM_CHANNELS];
     uint8_t         trem_depth;
     uint8_t         vib_depth;
-    uint32_t        trem_counter;
-    uint32_t        vib_counter;
+    uint32_t        trem_counter;  /* 16.16, in OPL samples */
+    uint32_t        vib_counter;   /* 16.16, in OPL samples */
     uint32_t        eg_timer;
     uint32_t        sample_count;
 
+    /* Synthesis clock (see OPL_MODE_*) */
+    int             mode;
+    int             rate_shift;    /* native modes: OUTPUT_RATE >> rate_shift */
+    uint32_t        rate;          /* synthesis rate in Hz */
+    uint32_t        clock_scale;   /* 16.16 OPL samples per synthesis sample */
+    uint32_t        eg_scale;      /* 16.16 synthesis samples per OPL sample */
+
     /* Resampling */
     uint32_t        resamp_frac;
     int32_t         prev_sample;
     int32_t         cur_sample;
+
+    /* Synthesis scratch for one mix block */
+    int32_t         buf[OPL_BLOCK_SAMPLES];
 } opl_chip_t;
 
-static opl_chip_t opl;
+static int opl_synth_mode = OPL_SYNTH_MODE;
+
+static void note_voice_stop(opl_chip_t *chip, int ch);
+static void note_voice_release(opl_chip_t *chip, int ch);
+static void note_mix(opl_chip_t *chip, int32_t *out, int n);
 
 /* ==================== GENMIDI ==================== */
 
@@ -325,6 +420,19 @@ typedef struct {
 static genmidi_instr_t *genmidi_instrs = NULL;
 static int genmidi_loaded = 0;
 
+/* An instrument's first voice, decoded once by load_genmidi() */
+typedef struct {
+    uint8_t     op[2][OPL_OP_REGS];     /* copied over opl_op_t */
+    uint8_t     fb;
+    uint8_t     cnt;
+    uint8_t     fixed;                  /* always plays fixed_note */
+    uint8_t     fixed_note;
+    int16_t     note_offset;            /* base_note_offset + fine tuning */
+    int16_t     base_note_offset;
+} opl_patch_t;
+
+static opl_patch_t genmidi_patches[GENMIDI_NUM_INSTRS];
+
 /* ==================== MIDI Sequencer ==================== */
 
 #define MIDI_CHANNELS       16
@@ -338,6 +446,7 @@ static int genmidi_loaded = 0;
 #define MIDI_EV_PITCHBEND   0xE0
 #define MIDI_EV_TEMPO       0x01  /* internal marker */
 
+/* Parse-time form; playback reads the packed stream, see MIDI Parser */
 typedef struct {
     uint32_t    tick;
     uint8_t     type;
@@ -361,51 +470,88 @@ typedef struct {
     int         midi_ch;
     int         note;
     int         opl_ch;
-    int         velocity;
-    uint32_t    age;
-    int16_t     note_offset;  /* from GENMIDI base_note_offset */
+
+    /* Links as voice + 1, 0 for none (see MIDI Voice Allocation) */
+    uint8_t     next_same;    /* next higher voice on this channel and note */
+    uint8_t     older;
+    uint8_t     newer;
 } voice_t;
 
 typedef struct {
-    midi_event_t   *events;
+    uint8_t        *stream;         /* packed events */
+    int             stream_len;
+    int             stream_pos;
     int             num_events;
-    int             current_event;
+    uint32_t        next_tick;      /* of the record at stream_pos */
     uint16_t        ticks_per_beat;
     uint32_t        us_per_beat;
+    uint32_t        start_us_per_beat;  /* first tempo at tick 0, or 0 */
 
-    /* Fixed-point timing: accumulator counts in units of
-     * (us_per_beat / ticks_per_beat) microseconds per tick
-     * We track microsecond fractions using 64-bit math */
-    double          samples_per_tick;
-    double          tick_accum;
+    /* Exact integer timing, in units of 1/(1000000 * ticks_per_beat)
+     * of a sample: a sample is 1000000 * ticks_per_beat units and a
+     * tick us_per_beat * OUTPUT_RATE, so nothing is rounded or drifts */
+    uint64_t        tick_len;
+    uint64_t        tick_accum;
 
     uint32_t        current_tick;
-    uint32_t        voice_age;
 
     midi_channel_t  chan[MIDI_CHANNELS];
     voice_t         voices[MAX_VOICES];
 
+    /* Active voice indexes, all empty when zeroed */
+    uint16_t        voices_used;                    /* mask */
+    uint16_t        chan_voices[MIDI_CHANNELS];     /* mask per channel */
+    uint8_t         note_voice[MIDI_CHANNELS][128]; /* lowest voice + 1 */
+    uint8_t         oldest;                         /* voice + 1 */
+    uint8_t         newest;                         /* voice + 1 */
+    int             voice_cap;      /* voices allowed, 0 for all (see
+                                     * Voice Shedding) */
+
     int             playing;
     int             looping;
+    int             loops;   /* times the song has wrapped */
     int             volume;  /* 0-127 */
 
-    void           *midi_data;
-    int             midi_data_len;
+    opl_chip_t      opl;
 } midi_state_t;
 
 static midi_state_t midi;
 
 /* ==================== SFX ==================== */
 
+#ifndef SFX_ADPCM
+#define SFX_ADPCM           0       /* 1 keeps sounds as IMA ADPCM */
+#endif
+
+#define SFX_ADPCM_BLOCK     256     /* samples per ADPCM block */
+#define SFX_ADPCM_BYTES     (4 + SFX_ADPCM_BLOCK / 2)
+
+/* A sound lump decoded for the mixer (see SFX Clips) */
+typedef struct sfx_clip_s {
+    int16_t            *pcm;    /* signed, at the lump's rate */
+    const uint8_t      *adpcm;  /* or SFX_ADPCM_BYTES blocks, pcm NULL */
+    int                 length;
+    uint32_t            step;   /* 16.16 source samples per output sample */
+    int                 lump;   /* LRU order in the cache (see SFX Cache) */
+    struct sfx_clip_s  *older;
+    struct sfx_clip_s  *newer;
+} sfx_clip_t;
+
 typedef struct {
-    const uint8_t  *data;
+    const int16_t  *data;
+    const uint8_t  *adpcm;  /* instead of data */
     int             length;
+    int             offset; /* sample 'pos' counts from */
     uint32_t        pos;    /* 16.16 fixed point */
     uint32_t        step;   /* 16.16 fixed point */
     int             vol;
     int             sep;
     int             handle;
     int             active;
+    int32_t         gain_l;     /* 16.16, as mixed at the end of the block */
+    int32_t         gain_r;
+    int             block;      /* ADPCM block in 'dec', -1 for none */
+    int16_t         dec[SFX_ADPCM_BLOCK];
 } sfx_channel_t;
 
 static sfx_channel_t sfx_channels[SND_CHANNELS];
@@ -415,41 +561,113 @@ static SceUID        snd_thread_id = -1;
 static int           next_handle   = 1;
 static int           sfx_volume    = 127;
 
-static void         *sfx_cache[2048];
+/* Music worker (see Music Cache), the semaphore that wakes it and the
+ * one it holds while it works (see Music Worker) */
+static SceUID        mcache_sema      = -1;
+static SceUID        mcache_lock      = -1;
+static SceUID        mcache_thread_id = -1;
+
+/* Music job thread (see Music Thread) */
+static SceUID        music_thread_id  = -1;
+
+static sfx_clip_t   *sfx_cache[2048];
 static int           sfx_cache_init = 0;
+static sfx_stats_t   sfx_stats;         /* see SFX Cache */
+
+static void sfx_precache_run(void);     /* music worker, see SFX Precache */
+static void sfx_cache_store(int lump, sfx_clip_t *clip);
 
 static int16_t __attribute__((aligned(64))) mix_buffer[MIX_SAMPLES * 2];
+static int32_t music_buffer[MIX_SAMPLES];  /* music job */
+static int16_t music_mix[MIX_SAMPLES];     /* audio thread, from the ring */
+static int32_t mix_acc[MIX_SAMPLES * 2];   /* audio thread, stereo sums */
 
-static SceUID sfx_sema = -1;
+/* ==================== OPL2 Implementation ==================== */
 
-static void sfx_lock(void)
+/* Build the waveform and log-to-linear tables */
+static void opl_init_tables(void)
 {
-    if (sfx_sema >= 0)
-        sceKernelWaitSema(sfx_sema, 1, NULL);
+    int i, ws;
+
+    if (opl_tables_built)
+        return;
+
+    for (i = 0; i < 1024; i++)
+    {
+        uint16_t ls;
+
+        /* Quarter-wave table mirrored over the half period */
+        if (i & 0x100)
+            ls = logsin_table[(~i) & 0xFF];
+        else
+            ls = logsin_table[i & 0xFF];
+
+        /* Sine */
+        wave_table[0][i] = (i & 0x200) ? (ls | 0x8000) : ls;
+        /* Half sine */
+        wave_table[1][i] = (i & 0x200) ? OPL_WAVE_SILENT : ls;
+        /* Abs sine */
+        wave_table[2][i] = ls;
+        /* Quarter sine */
+        wave_table[3][i] = (i & 0x100) ? OPL_WAVE_SILENT
+                                       : logsin_table[i & 0xFF];
+    }
+
+    for (i = 0; i < OPL_LIN_SIZE; i++)
+    {
+        ws = i >> 8;
+        lin_table[i] = (ws > 13) ? 0 : (int16_t)((exp_table[i & 0xFF] << 1) >> ws);
+    }
+
+    opl_tables_built = 1;
 }
 
-static void sfx_unlock(void)
+/* Set up the synthesis clock for the current opl_synth_mode */
+static void opl_set_clock(opl_chip_t *chip)
 {
-    if (sfx_sema >= 0)
-        sceKernelSignalSema(sfx_sema, 1);
-}
+    chip->mode       = opl_synth_mode;
+    chip->rate_shift = 0;
 
-/* ==================== OPL2 Implementation ==================== */
+    switch (chip->mode)
+    {
+    case OPL_MODE_NATIVE:
+        chip->rate = OUTPUT_RATE;
+        break;
+    case OPL_MODE_LOWPOWER:
+        chip->rate_shift = 1;
+        chip->rate = OUTPUT_RATE >> 1;
+        break;
+    case OPL_MODE_RESAMPLED:
+    default:
+        chip->mode = OPL_MODE_RESAMPLED;
+        chip->rate = OPL_RATE;
+        break;
+    }
 
-static void opl_reset(void)
+    chip->clock_scale = (uint32_t)(((uint64_t)OPL_RATE << 16) / chip->rate);
+    chip->eg_scale    = (uint32_t)(((uint64_t)chip->rate << 16) / OPL_RATE);
+}
+
+static void opl_reset(opl_chip_t *chip)
 {
     int i, j;
-    memset(&opl, 0, sizeof(opl));
-    opl.trem_depth = 0;
-    opl.vib_depth  = 0;
+
+    for (i = 0; i < OPL_NUM_CHANNELS; i++)
+        note_voice_stop(chip, i);
+
+    memset(chip, 0, sizeof(*chip));
+    chip->trem_depth = 0;
+    chip->vib_depth  = 0;
+    opl_init_tables();
+    opl_set_clock(chip);
 
     for (i = 0; i < OPL_NUM_CHANNELS; i++)
     {
         for (j = 0; j < 2; j++)
         {
-            opl.chan[i].op[j].env      = 511;
-            opl.chan[i].op[j].eg_state = EG_OFF;
-            opl.chan[i].op[j].eg_counter = 0;
+            chip->chan[i].op[j].env      = 511;
+            chip->chan[i].op[j].eg_state = EG_OFF;
+            chip->chan[i].op[j].eg_left  = EG_NEVER;
         }
     }
 }
@@ -457,8 +675,12 @@ static void opl_reset(void)
 /*
  * Envelope calculation.
  * The OPL2 envelope operates at OPL_RATE/4 (about 12429 Hz).
- * We use a counter-based approach: every N OPL samples, the envelope steps.
- * The effective rate determines N.
+ * Every N OPL samples the envelope steps; the effective rate determines N.
+ * N only depends on the operator's rates, KSR and the channel frequency,
+ * so it is cached per stage in eg_period[] whenever those change, and
+ * eg_left counts down the samples until the next envelope event.
+ * Periods are kept in 16.16 synthesis samples so the native modes can
+ * scale them; eg_frac carries the fraction between events.
  */
 
 static int eg_effective_rate(int rate, int ksr, int block, int fnum)
@@ -474,41 +696,98 @@ static int eg_effective_rate(int rate, int ksr, int block, int fnum)
     return eff;
 }
 
-/* Process envelope for one OPL sample */
-static void opl_env_step(opl_op_t *op, int block, int fnum)
+/* Samples between two envelope steps at a non-zero rate */
+static uint32_t eg_rate_period(int rate, int ksr, int block, int fnum)
+{
+    int eff, shift;
+
+    eff   = eg_effective_rate(rate, ksr, block, fnum);
+    shift = 13 - (eff >> 2);
+    if (shift < 0) shift = 0;
+    return 1u << shift;
+}
+
+/* Schedule the next envelope event for the current stage.
+ * A key on/off lands between samples, so the next sample already
+ * counts towards the period. */
+static void opl_env_schedule(opl_op_t *op, int key_event)
+{
+    uint32_t period = 0;
+    int32_t  t;
+
+    if (op->eg_state < EG_OFF)
+        period = op->eg_period[op->eg_state];
+
+    if (period == 0)
+    {
+        op->eg_left = EG_NEVER;
+        return;
+    }
+
+    if (key_event)
+        op->eg_frac = 0;
+
+    t = (int32_t)(op->eg_frac + period) - (key_event ? 0x10000 : 0);
+    if (t < 0) t = 0;
+
+    op->eg_left = (uint32_t)t >> 16;
+    op->eg_frac = (uint32_t)t & 0xFFFF;
+}
+
+/* Cache the per-stage envelope periods; 0 = the stage never steps */
+static void opl_env_calc_periods(const opl_chip_t *chip, opl_op_t *op,
+                                 int block, int fnum)
 {
-    int eff, shift, period;
+    uint32_t *p = op->eg_period;
+    int       i;
+
+    /* AR 15 jumps straight to full volume, AR 0 never attacks */
+    if (op->ar >= 15)
+        p[EG_ATTACK] = 1;
+    else
+        p[EG_ATTACK] = op->ar ? eg_rate_period(op->ar, op->ksr, block, fnum) : 0;
+
+    /* DR 0 drops to the sustain level on the next sample */
+    p[EG_DECAY] = op->dr ? eg_rate_period(op->dr, op->ksr, block, fnum) : 1;
+
+    /* Sustained tones hold, others decay to silence using RR */
+    if (op->egt || op->rr == 0)
+        p[EG_SUSTAIN] = 0;
+    else
+        p[EG_SUSTAIN] = eg_rate_period(op->rr, op->ksr, block, fnum);
+
+    /* Always release eventually */
+    p[EG_RELEASE] = eg_rate_period(op->rr ? op->rr : 1, op->ksr, block, fnum);
+
+    /* OPL samples to synthesis samples */
+    for (i = EG_ATTACK; i <= EG_RELEASE; i++)
+        p[i] *= chip->eg_scale;
+
+    /* Keep a pending event within the new period */
+    if (op->eg_left != EG_NEVER && op->eg_state < EG_OFF &&
+        p[op->eg_state] && op->eg_left > (p[op->eg_state] >> 16))
+        op->eg_left = p[op->eg_state] >> 16;
+}
 
+/* Apply the envelope event that is due and schedule the next one */
+static void opl_env_event(opl_op_t *op)
+{
     switch (op->eg_state)
     {
     case EG_ATTACK:
-        if (op->ar == 0) return;
         if (op->ar >= 15)
         {
             op->env = 0;
             op->eg_state = EG_DECAY;
-            return;
+            break;
         }
 
-        eff = eg_effective_rate(op->ar, op->ksr, block, fnum);
-
-        /* Attack: exponential curve
-         * Period between steps depends on effective rate */
-        shift = 13 - (eff >> 2);
-        if (shift < 0) shift = 0;
-        period = 1 << shift;
-
-        op->eg_counter++;
-        if (op->eg_counter >= (uint32_t)period)
+        /* Exponential attack: subtract proportional to current level */
+        op->env -= ((op->env >> 3) + 1);
+        if (op->env <= 0)
         {
-            op->eg_counter = 0;
-            /* Exponential attack: subtract proportional to current level */
-            op->env -= ((op->env >> 3) + 1);
-            if (op->env <= 0)
-            {
-                op->env = 0;
-                op->eg_state = EG_DECAY;
-            }
+            op->env = 0;
+            op->eg_state = EG_DECAY;
         }
         break;
 
@@ -517,73 +796,32 @@ static void opl_env_step(opl_op_t *op, int block, int fnum)
         {
             op->env = (int32_t)op->sl << 5;  /* sl * 32: 0-480 in steps of 32 */
             op->eg_state = EG_SUSTAIN;
-            return;
+            break;
         }
 
-        eff = eg_effective_rate(op->dr, op->ksr, block, fnum);
-        shift = 13 - (eff >> 2);
-        if (shift < 0) shift = 0;
-        period = 1 << shift;
-
-        op->eg_counter++;
-        if (op->eg_counter >= (uint32_t)period)
+        op->env += 1;
+        if (op->env >= (int32_t)(op->sl << 5))
         {
-            op->eg_counter = 0;
-            op->env += 1;
-            if (op->env >= (int32_t)(op->sl << 5))
-            {
-                op->env = (int32_t)op->sl << 5;
-                op->eg_state = EG_SUSTAIN;
-            }
+            op->env = (int32_t)op->sl << 5;
+            op->eg_state = EG_SUSTAIN;
         }
         break;
 
     case EG_SUSTAIN:
-        if (op->egt) return;  /* Sustained: hold level */
-
-        /* Not sustained: decay to silence using RR */
-        if (op->rr == 0) return;
-
-        eff = eg_effective_rate(op->rr, op->ksr, block, fnum);
-        shift = 13 - (eff >> 2);
-        if (shift < 0) shift = 0;
-        period = 1 << shift;
-
-        op->eg_counter++;
-        if (op->eg_counter >= (uint32_t)period)
+        op->env += 1;
+        if (op->env >= 511)
         {
-            op->eg_counter = 0;
-            op->env += 1;
-            if (op->env >= 511)
-            {
-                op->env = 511;
-                op->eg_state = EG_OFF;
-            }
+            op->env = 511;
+            op->eg_state = EG_OFF;
         }
         break;
 
     case EG_RELEASE:
+        op->env += 2;  /* Slightly faster release */
+        if (op->env >= 511)
         {
-            /* Release rate: use rr*4 for faster release to sound natural */
-            int rel_rate = op->rr;
-            if (rel_rate == 0) rel_rate = 1;  /* Always release eventually */
-
-            eff = eg_effective_rate(rel_rate, op->ksr, block, fnum);
-            shift = 13 - (eff >> 2);
-            if (shift < 0) shift = 0;
-            period = 1 << shift;
-
-            op->eg_counter++;
-            if (op->eg_counter >= (uint32_t)period)
-            {
-                op->eg_counter = 0;
-                op->env += 2;  /* Slightly faster release */
-                if (op->env >= 511)
-                {
-                    op->env = 511;
-                    op->eg_state = EG_OFF;
-                }
-            }
+            op->env = 511;
+            op->eg_state = EG_OFF;
         }
         break;
 
@@ -592,87 +830,39 @@ static void opl_env_step(opl_op_t *op, int block, int fnum)
         op->env = 511;
         break;
     }
+
+    opl_env_schedule(op, 0);
 }
 
-/* Calculate operator output */
-static int32_t opl_calc_op(opl_op_t *op, int32_t phase_mod,
-                            int32_t trem_val, int32_t vol_atten)
+/* Calculate operator output.
+ * 'atten' is the total attenuation (envelope + TL + KSL + volume + tremolo)
+ * already summed by the caller; it is never negative. */
+static inline int32_t opl_calc_op(uint32_t op_phase, int32_t phase_mod,
+                                  int32_t atten, const uint16_t *wave)
 {
-    uint32_t phase;
-    int32_t  atten, output;
-    uint16_t log_val;
-    int      neg, exp_idx, exp_sh;
+    uint32_t w, log_val;
+    int32_t  output, neg;
 
     /* 10-bit phase from accumulator (bits 19..10) */
-    phase = ((op->phase >> 10) + (uint32_t)(phase_mod >> 10)) & 0x3FF;
-
-    /* Total attenuation */
-    atten = op->env + (op->tl << 3) + op->ksl_atten + vol_atten;
-    if (op->am)
-        atten += trem_val;
-
-    if (atten >= 511)
-        return 0;
-    if (atten < 0)
-        atten = 0;
-
-    /* Waveform lookup */
-    neg = 0;
-
-    switch (op->ws & 3)
-    {
-    case 0: /* Sine */
-        neg = (phase & 0x200) ? 1 : 0;
-        if (phase & 0x100)
-            log_val = logsin_table[(~phase) & 0xFF];
-        else
-            log_val = logsin_table[phase & 0xFF];
-        break;
-
-    case 1: /* Half sine */
-        if (phase & 0x200)
-            return 0;
-        if (phase & 0x100)
-            log_val = logsin_table[(~phase) & 0xFF];
-        else
-            log_val = logsin_table[phase & 0xFF];
-        break;
-
-    case 2: /* Abs sine */
-        if (phase & 0x100)
-            log_val = logsin_table[(~phase) & 0xFF];
-        else
-            log_val = logsin_table[phase & 0xFF];
-        break;
-
-    case 3: /* Quarter sine */
-    default:
-        if (phase & 0x100)
-            return 0;
-        log_val = logsin_table[phase & 0xFF];
-        break;
-    }
+    w = wave[((op_phase >> 10) + (uint32_t)(phase_mod >> 10)) & 0x3FF];
 
-    /* Add attenuation in log domain */
-    log_val += (uint16_t)(atten << 3);
+    /* Add attenuation in log domain; anything from 511 up is silent */
+    log_val = (w & 0x7FFF) + ((uint32_t)atten << 3);
+    if (log_val > OPL_LIN_SIZE - 1)
+        log_val = OPL_LIN_SIZE - 1;
 
-    /* Convert log to linear */
-    exp_idx = log_val & 0xFF;
-    exp_sh  = log_val >> 8;
-
-    if (exp_sh > 13)
-        return 0;
-
-    output = (exp_table[exp_idx] << 1) >> exp_sh;
-
-    return neg ? -output : output;
+    /* Convert log to linear and apply the sign */
+    output = lin_table[log_val];
+    neg    = -(int32_t)(w >> 15);
+    return (output ^ neg) - neg;
 }
 
-/* Update phase accumulator */
-static void opl_calc_phase(opl_op_t *op, int fnum, int block, int32_t vib_val)
+/* Phase increment of one operator; constant while the vibrato LFO holds */
+static uint32_t opl_calc_phase_inc(const opl_chip_t *chip, const opl_op_t *op,
+                                   int fnum, int block, int32_t vib_val)
 {
-    int fn = fnum;
-    uint32_t freq;
+    int      fn = fnum;
+    uint32_t inc;
 
     if (op->vib)
         fn += vib_val;
@@ -682,222 +872,682 @@ static void opl_calc_phase(opl_op_t *op, int fnum, int block, int32_t vib_val)
 
     /* phase_inc = fnum * 2^block * mult_factor
      * mt[] already contains multiplier * 2 */
-    freq = (uint32_t)fn << block;
-    op->phase_inc = freq * mt[op->mult];
-    op->phase += op->phase_inc;
+    inc = ((uint32_t)fn << block) * mt[op->mult];
+
+    /* Scale from OPL samples to synthesis samples */
+    if (chip->mode != OPL_MODE_RESAMPLED)
+        inc = (uint32_t)(((uint64_t)inc * chip->clock_scale) >> 16);
+    return inc;
 }
 
-/* Generate one OPL sample */
-static int32_t opl_gen_sample(void)
+/*
+ * Advance both LFOs over the next run of samples and return its length
+ * (at most 'max'). The tremolo and vibrato values are constant for the
+ * whole run, so callers can hoist them out of the per-sample loop.
+ * The counters advance by clock_scale per synthesis sample.
+ */
+static int opl_lfo_run(opl_chip_t *chip, int max,
+                       int32_t *trem_val, int32_t *vib_val)
 {
-    int     ch;
-    int32_t out = 0;
-    int32_t trem_val, vib_val;
-    uint32_t tv;
+    uint32_t step = chip->clock_scale;
+    uint32_t trem = chip->trem_counter + step;
+    uint32_t vib  = chip->vib_counter + step;
+    uint32_t run, left, tv;
 
     /* Tremolo LFO: ~3.7 Hz triangle, 0 to max_depth */
-    opl.trem_counter++;
-    tv = (opl.trem_counter >> 6) & 0x7F;
+    tv = (trem >> 22) & 0x7F;
     if (tv > 63) tv = 127 - tv;
-    trem_val = opl.trem_depth ? (tv >> 1) : (tv >> 3);
+    *trem_val = chip->trem_depth ? (tv >> 1) : (tv >> 3);
 
     /* Vibrato LFO: ~6.1 Hz */
-    opl.vib_counter++;
-    tv = (opl.vib_counter >> 5) & 0x3F;
+    tv = (vib >> 21) & 0x3F;
     if (tv > 31) tv = 63 - tv;
-    vib_val = (int32_t)tv - 16;
-    if (!opl.vib_depth)
-        vib_val >>= 1;
+    *vib_val = (int32_t)tv - 16;
+    if (!chip->vib_depth)
+        *vib_val >>= 1;
+
+    /* Samples until either LFO moves on */
+    run  = ((((trem >> 22) + 1) << 22) - trem + step - 1) / step;
+    left = ((((vib  >> 21) + 1) << 21) - vib  + step - 1) / step;
+    if (left < run)          run = left;
+    if ((uint32_t)max < run) run = (uint32_t)max;
+
+    chip->trem_counter += run * step;
+    chip->vib_counter  += run * step;
+    return (int)run;
+}
 
-    for (ch = 0; ch < OPL_NUM_CHANNELS; ch++)
+/*
+ * Render 'n' OPL samples of one channel, adding the unscaled channel
+ * output into 'acc'. Operator state lives in locals for the whole run;
+ * between envelope events the attenuation is constant, so the inner loop
+ * only advances phases. The channel retires as soon as both operators
+ * reach EG_OFF.
+ */
+static void opl_render_channel(const opl_chip_t *chip, opl_channel_t *c,
+                               int32_t *acc, int n,
+                               int32_t trem_val, int32_t vib_val)
+{
+    opl_op_t *mod = &c->op[0];
+    opl_op_t *car = &c->op[1];
+    uint32_t  mod_phase = mod->phase;
+    uint32_t  car_phase = car->phase;
+    uint32_t  mod_inc, car_inc;
+    int32_t   mod_atten, car_atten;
+    int32_t   fb0 = c->fb_out[0];
+    int32_t   fb1 = c->fb_out[1];
+    int       fb_shift = 9 - c->fb;
+    const uint16_t *mod_wave = wave_table[mod->ws & 3];
+    const uint16_t *car_wave = wave_table[car->ws & 3];
+    int       i, end;
+
+    mod_inc = opl_calc_phase_inc(chip, mod, c->fnum, c->block, vib_val);
+    car_inc = opl_calc_phase_inc(chip, car, c->fnum, c->block, vib_val);
+
+    /* Attenuation without the envelope */
+    mod_atten = (mod->tl << 3) + mod->ksl_atten;
+    car_atten = (car->tl << 3) + car->ksl_atten + c->vol_atten;
+    if (mod->am) mod_atten += trem_val;
+    if (car->am) car_atten += trem_val;
+
+    for (i = 0; i < n; i = end)
     {
-        opl_channel_t *c   = &opl.chan[ch];
-        opl_op_t      *mod = &c->op[0];
-        opl_op_t      *car = &c->op[1];
-        int32_t mod_out, car_out, fb;
+        uint32_t run;
+        int32_t  mod_tot, car_tot;
 
-        /* Skip silent channels */
+        /* Envelope events due on this sample (the native modes can
+         * step more than once per sample at the fastest rates) */
+        while (mod->eg_left == 0) opl_env_event(mod);
+        while (car->eg_left == 0) opl_env_event(car);
+
+        /* Retire silent channels (their output would be zero anyway) */
         if (mod->eg_state == EG_OFF && car->eg_state == EG_OFF)
-            continue;
+            break;
 
-        /* Envelope step */
-        opl_env_step(mod, c->block, c->fnum);
-        opl_env_step(car, c->block, c->fnum);
+        /* Samples until the next envelope event */
+        run = (uint32_t)(n - i);
+        if (mod->eg_left < run) run = mod->eg_left;
+        if (car->eg_left < run) run = car->eg_left;
+        if (mod->eg_left != EG_NEVER) mod->eg_left -= run;
+        if (car->eg_left != EG_NEVER) car->eg_left -= run;
 
-        /* Phase step */
-        opl_calc_phase(mod, c->fnum, c->block, vib_val);
-        opl_calc_phase(car, c->fnum, c->block, vib_val);
+        mod_tot = mod->env + mod_atten;
+        car_tot = car->env + car_atten;
 
-        /* Feedback */
-        if (c->fb > 0)
-            fb = (c->fb_out[0] + c->fb_out[1]) >> (9 - c->fb);
-        else
-            fb = 0;
+        for (end = i + (int)run; i < end; i++)
+        {
+            int32_t mod_out, car_out, fb;
 
-        /* Modulator output */
-        mod_out = opl_calc_op(mod, fb << 10, trem_val, 0);
+            /* Phase step */
+            mod_phase += mod_inc;
+            car_phase += car_inc;
 
-        c->fb_out[1] = c->fb_out[0];
-        c->fb_out[0] = mod_out;
+            /* Feedback */
+            fb = c->fb ? (fb0 + fb1) >> fb_shift : 0;
 
-        /* Carrier output (FM or additive) */
-        if (c->cnt == 0)
-        {
-            /* FM synthesis */
-            car_out = opl_calc_op(car, mod_out << 1, trem_val, c->vol_atten);
-            out += car_out;
-        }
-        else
-        {
-            /* Additive */
-            car_out = opl_calc_op(car, 0, trem_val, c->vol_atten);
-            out += mod_out + car_out;
+            /* Modulator output */
+            mod_out = opl_calc_op(mod_phase, fb << 10, mod_tot, mod_wave);
+            fb1 = fb0;
+            fb0 = mod_out;
+
+            /* Carrier output (FM or additive) */
+            if (c->cnt == 0)
+            {
+                car_out = opl_calc_op(car_phase, mod_out << 1, car_tot, car_wave);
+                acc[i] += car_out;
+            }
+            else
+            {
+                car_out = opl_calc_op(car_phase, 0, car_tot, car_wave);
+                acc[i] += mod_out + car_out;
+            }
         }
     }
 
-    /* Scale output */
-    out >>= 1;
-    if (out >  32767) out =  32767;
-    if (out < -32768) out = -32768;
-    return out;
+    mod->phase     = mod_phase;
+    car->phase     = car_phase;
+    mod->phase_inc = mod_inc;
+    car->phase_inc = car_inc;
+    c->fb_out[0]   = fb0;
+    c->fb_out[1]   = fb1;
 }
 
-/* Generate one output sample at OUTPUT_RATE via resampling */
-static int32_t opl_gen_resampled(void)
+/* Accumulate 'n' unscaled OPL samples, channel by channel */
+static void opl_gen_block_scalar(opl_chip_t *chip, int32_t *out, int n)
 {
-    int32_t s0, s1, frac, sample;
+    int pos, ch;
 
-    /* We need OPL_RATE/OUTPUT_RATE = ~1.127 OPL samples per output sample */
-    opl.resamp_frac += OPL_RATE;
-    while (opl.resamp_frac >= OUTPUT_RATE)
+    memset(out, 0, n * sizeof(*out));
+
+    for (pos = 0; pos < n; )
     {
-        opl.resamp_frac -= OUTPUT_RATE;
-        opl.prev_sample = opl.cur_sample;
-        opl.cur_sample  = opl_gen_sample();
-    }
+        int32_t trem_val, vib_val;
+        int     run = opl_lfo_run(chip, n - pos, &trem_val, &vib_val);
+
+        for (ch = 0; ch < OPL_NUM_CHANNELS; ch++)
+        {
+            opl_channel_t *c = &chip->chan[ch];
 
-    /* Linear interpolation */
-    frac = (opl.resamp_frac * 256) / OUTPUT_RATE;
-    s0 = opl.prev_sample;
-    s1 = opl.cur_sample;
-    sample = s0 + (((s1 - s0) * frac) >> 8);
+            /* Skip silent channels */
+            if (c->op[0].eg_state == EG_OFF && c->op[1].eg_state == EG_OFF)
+                continue;
 
-    /* Apply music volume */
-    sample = (sample * midi.volume) >> 7;
-    return sample;
+            opl_render_channel(chip, c, out + pos, run, trem_val, vib_val);
+        }
+        pos += run;
+    }
 }
 
-/* ==================== OPL Key On/Off ==================== */
+#if OPL_VECTOR_LANES
+
+#define OPL_VECS        ((OPL_NUM_CHANNELS + OPL_VECTOR_LANES - 1) / OPL_VECTOR_LANES)
+#define OPL_MAX_LANES   (OPL_VECS * OPL_VECTOR_LANES)
+#define OPL_VEC_RUN     32      /* samples per kernel call (vibrato steps every 32) */
+
+typedef int32_t  opl_vec_t  __attribute__((vector_size(OPL_VECTOR_LANES * 4)));
+typedef uint32_t opl_uvec_t __attribute__((vector_size(OPL_VECTOR_LANES * 4)));
+
+/* Lane 'j' of an array of vectors */
+#define LANE(v, j)      ((v)[(j) / OPL_VECTOR_LANES][(j) % OPL_VECTOR_LANES])
 
-static void opl_key_on(int ch)
+/*
+ * Structure-of-arrays copy of the channels being rendered, one channel
+ * per lane. Masks stand in for the scalar path's branches on the
+ * connection, and feedback is computed as '(x << fb) >> 9' (equal to
+ * 'x >> (9 - fb)') to avoid per-lane shift counts. Envelopes don't depend
+ * on the output, so the attenuation of every sample in the run is worked
+ * out up front; 'act' clears a lane from the sample its channel retires.
+ */
+typedef struct {
+    opl_uvec_t  mod_phase[OPL_VECS], car_phase[OPL_VECS];
+    opl_uvec_t  mod_inc[OPL_VECS],   car_inc[OPL_VECS];
+    opl_vec_t   mod_wave[OPL_VECS],  car_wave[OPL_VECS];  /* wave_table offset */
+    opl_vec_t   fb0[OPL_VECS], fb1[OPL_VECS];
+    opl_vec_t   fb_mul[OPL_VECS];   /* 1 << fb, or 0 without feedback */
+    opl_vec_t   fm_mask[OPL_VECS], add_mask[OPL_VECS];
+
+    /* Per sample: attenuation << 3, and -1 while the channel plays */
+    opl_vec_t   mod_tot[OPL_VEC_RUN][OPL_VECS];
+    opl_vec_t   car_tot[OPL_VEC_RUN][OPL_VECS];
+    opl_vec_t   act[OPL_VEC_RUN][OPL_VECS];
+} opl_lanes_t;
+
+/* opl_calc_op() for a vector of lanes */
+static inline opl_vec_t opl_calc_op_vec(opl_uvec_t phase, opl_vec_t phase_mod,
+                                        opl_vec_t tot, opl_vec_t wave_ofs)
 {
-    opl_channel_t *c = &opl.chan[ch];
-    int j;
+    const uint16_t *wave = &wave_table[0][0];
+    opl_uvec_t      idx;
+    opl_vec_t       w, log_val, out, neg;
+    int             l;
 
-    c->key_on = 1;
-    for (j = 0; j < 2; j++)
-    {
-        c->op[j].phase      = 0;
-        c->op[j].env        = 511;
-        c->op[j].eg_state   = EG_ATTACK;
-        c->op[j].eg_counter = 0;
-        c->op[j].key        = 1;
-    }
-    c->fb_out[0] = 0;
-    c->fb_out[1] = 0;
+    idx = (((phase >> 10) + (opl_uvec_t)phase_mod) & 0x3FF) + (opl_uvec_t)wave_ofs;
+#pragma GCC unroll 8
+    for (l = 0; l < OPL_VECTOR_LANES; l++)
+        w[l] = wave[idx[l]];
+
+    log_val = (w & 0x7FFF) + tot;
+    log_val -= (log_val - (OPL_LIN_SIZE - 1)) & (log_val > OPL_LIN_SIZE - 1);
+
+#pragma GCC unroll 8
+    for (l = 0; l < OPL_VECTOR_LANES; l++)
+        out[l] = lin_table[log_val[l]];
+
+    neg = -(w >> 15);
+    return (out ^ neg) - neg;
 }
 
-static void opl_key_off(int ch)
+/* Render 'n' samples of every lane, adding the lane sum into 'acc' */
+static void opl_lanes_run(opl_lanes_t *L, int nvec, int32_t *acc, int n)
 {
-    opl_channel_t *c = &opl.chan[ch];
-    int j;
+    opl_vec_t sum[OPL_VEC_RUN];
+    int       i, v, l;
 
-    c->key_on = 0;
-    for (j = 0; j < 2; j++)
+    memset(sum, 0, n * sizeof(sum[0]));
+
+    /* One vector of channels at a time, its state in registers */
+    for (v = 0; v < nvec; v++)
     {
-        if (c->op[j].eg_state != EG_OFF)
+        opl_uvec_t mod_phase = L->mod_phase[v], car_phase = L->car_phase[v];
+        opl_uvec_t mod_inc   = L->mod_inc[v],   car_inc   = L->car_inc[v];
+        opl_vec_t  mod_wave  = L->mod_wave[v],  car_wave  = L->car_wave[v];
+        opl_vec_t  fb0       = L->fb0[v],       fb1       = L->fb1[v];
+        opl_vec_t  fb_mul    = L->fb_mul[v];
+        opl_vec_t  fm_mask   = L->fm_mask[v],   add_mask  = L->add_mask[v];
+
+        for (i = 0; i < n; i++)
         {
-            c->op[j].eg_state   = EG_RELEASE;
-            c->op[j].eg_counter = 0;
+            opl_vec_t act = L->act[i][v];
+            opl_vec_t fb, mod_out, car_out;
+
+            /* Retired lanes hold their phase and feedback */
+            mod_phase += mod_inc & (opl_uvec_t)act;
+            car_phase += car_inc & (opl_uvec_t)act;
+
+            fb = ((fb0 + fb1) * fb_mul) >> 9;
+
+            mod_out = opl_calc_op_vec(mod_phase, fb, L->mod_tot[i][v], mod_wave);
+            fb1 = (fb0 & act) | (fb1 & ~act);
+            fb0 = (mod_out & act) | (fb0 & ~act);
+
+            car_out = opl_calc_op_vec(car_phase, ((mod_out << 1) >> 10) & fm_mask,
+                                      L->car_tot[i][v], car_wave);
+
+            sum[i] += (car_out + (mod_out & add_mask)) & act;
         }
-        c->op[j].key = 0;
-    }
-}
 
-/* Set channel frequency */
-static void opl_set_freq(int ch, int fnum, int block)
-{
-    opl_channel_t *c = &opl.chan[ch];
-    c->fnum  = fnum;
-    c->block = block;
+        L->mod_phase[v] = mod_phase;
+        L->car_phase[v] = car_phase;
+        L->fb0[v]       = fb0;
+        L->fb1[v]       = fb1;
+    }
 
-    /* KSL attenuation: depends on fnum top bits and block */
-    /* Simplified: higher notes get more attenuation with KSL enabled */
+    for (i = 0; i < n; i++)
     {
-        int ksl_base = ((block << 4) | (fnum >> 6));
-        if (ksl_base > 112) ksl_base = 112;
+        int32_t total = 0;
 
-        c->op[0].ksl_atten = (c->op[0].ksl > 0) ?
-            (ksl_base >> (3 - c->op[0].ksl)) : 0;
-        c->op[1].ksl_atten = (c->op[1].ksl > 0) ?
-            (ksl_base >> (3 - c->op[1].ksl)) : 0;
+        for (l = 0; l < OPL_VECTOR_LANES; l++)
+            total += sum[i][l];
+        acc[i] += total;
     }
 }
 
-/* Program an OPL operator from GENMIDI operator data */
-static void opl_prog_op(opl_op_t *op, const genmidi_op_t *g)
+/*
+ * Step the envelopes of the channel in lane 'j' through the next 'n'
+ * samples, exactly as opl_render_channel() would, recording each
+ * sample's attenuation.
+ */
+static void opl_lane_envelope(opl_lanes_t *L, int j, opl_channel_t *c,
+                              int32_t mod_base, int32_t car_base, int n)
 {
-    /* tremolo byte = register 0x20:
-     * bit 7: AM
-     * bit 6: VIB
-     * bit 5: EGT (sustaining)
-     * bit 4: KSR
-     * bit 3-0: MULT */
-    op->am   = (g->tremolo >> 7) & 1;
-    op->vib  = (g->tremolo >> 6) & 1;
-    op->egt  = (g->tremolo >> 5) & 1;
-    op->ksr  = (g->tremolo >> 4) & 1;
-    op->mult = (g->tremolo)      & 0x0F;
+    opl_op_t *mod = &c->op[0];
+    opl_op_t *car = &c->op[1];
+    int       i = 0, end;
 
-    /* attack byte = register 0x60:
-     * bits 7-4: AR
-     * bits 3-0: DR */
-    op->ar = (g->attack >> 4) & 0x0F;
-    op->dr = (g->attack)      & 0x0F;
+    while (i < n)
+    {
+        uint32_t run;
+        int32_t  mod_tot, car_tot;
 
-    /* sustain byte = register 0x80:
-     * bits 7-4: SL
-     * bits 3-0: RR */
-    op->sl = (g->sustain >> 4) & 0x0F;
-    op->rr = (g->sustain)      & 0x0F;
+        while (mod->eg_left == 0) opl_env_event(mod);
+        while (car->eg_left == 0) opl_env_event(car);
 
-    /* waveform = register 0xE0 */
-    op->ws = g->waveform & 0x03;
+        if (mod->eg_state == EG_OFF && car->eg_state == EG_OFF)
+            break;
 
-    /* scale byte = register 0x40:
-     * bits 7-6: KSL
-     * bits 5-0: TL */
-    op->ksl = (g->scale >> 6) & 0x03;
-    op->tl  = (g->scale)      & 0x3F;
+        run = (uint32_t)(n - i);
+        if (mod->eg_left < run) run = mod->eg_left;
+        if (car->eg_left < run) run = car->eg_left;
+        if (mod->eg_left != EG_NEVER) mod->eg_left -= run;
+        if (car->eg_left != EG_NEVER) car->eg_left -= run;
+
+        mod_tot = (mod->env + mod_base) << 3;
+        car_tot = (car->env + car_base) << 3;
+
+        for (end = i + (int)run; i < end; i++)
+        {
+            LANE(L->mod_tot[i], j) = mod_tot;
+            LANE(L->car_tot[i], j) = car_tot;
+            LANE(L->act[i], j)     = -1;
+        }
+    }
+
+    /* Retired */
+    for (; i < n; i++)
+    {
+        LANE(L->mod_tot[i], j) = OPL_LIN_SIZE;
+        LANE(L->car_tot[i], j) = OPL_LIN_SIZE;
+        LANE(L->act[i], j)     = 0;
+    }
 }
 
-/* Program OPL channel from GENMIDI voice */
-static void opl_prog_voice(int ch, const genmidi_voice_t *v)
+/* opl_gen_block_scalar() with the live channels side by side in lanes */
+static void opl_gen_block_vector(opl_chip_t *chip, int32_t *out, int n)
 {
-    opl_channel_t *c = &opl.chan[ch];
+    opl_lanes_t     L;
+    opl_channel_t  *lane_ch[OPL_MAX_LANES];
+    int             pos;
 
-    opl_prog_op(&c->op[0], &v->modulator);
-    opl_prog_op(&c->op[1], &v->carrier);
+    memset(out, 0, n * sizeof(*out));
+    memset(&L, 0, sizeof(L));
 
-    /* feedback byte = register 0xC0:
+    for (pos = 0; pos < n; )
+    {
+        int32_t trem_val, vib_val;
+        int     max = n - pos < OPL_VEC_RUN ? n - pos : OPL_VEC_RUN;
+        int     run = opl_lfo_run(chip, max, &trem_val, &vib_val);
+        int     lanes = 0, nvec, ch, i, j;
+
+        for (ch = 0; ch < OPL_NUM_CHANNELS; ch++)
+        {
+            opl_channel_t *c   = &chip->chan[ch];
+            opl_op_t      *mod = &c->op[0];
+            opl_op_t      *car = &c->op[1];
+            int32_t        mod_base, car_base;
+
+            if (mod->eg_state == EG_OFF && car->eg_state == EG_OFF)
+                continue;
+
+            j = lanes++;
+            lane_ch[j] = c;
+
+            mod_base = (mod->tl << 3) + mod->ksl_atten;
+            car_base = (car->tl << 3) + car->ksl_atten + c->vol_atten;
+            if (mod->am) mod_base += trem_val;
+            if (car->am) car_base += trem_val;
+            opl_lane_envelope(&L, j, c, mod_base, car_base, run);
+
+            LANE(L.mod_phase, j) = mod->phase;
+            LANE(L.car_phase, j) = car->phase;
+            LANE(L.mod_inc, j)   = opl_calc_phase_inc(chip, mod, c->fnum, c->block, vib_val);
+            LANE(L.car_inc, j)   = opl_calc_phase_inc(chip, car, c->fnum, c->block, vib_val);
+            LANE(L.mod_wave, j)  = (mod->ws & 3) * (int)(wave_table[1] - wave_table[0]);
+            LANE(L.car_wave, j)  = (car->ws & 3) * (int)(wave_table[1] - wave_table[0]);
+            LANE(L.fb0, j)       = c->fb_out[0];
+            LANE(L.fb1, j)       = c->fb_out[1];
+            LANE(L.fb_mul, j)    = c->fb ? 1 << c->fb : 0;
+            LANE(L.fm_mask, j)   = c->cnt == 0 ? -1 : 0;
+            LANE(L.add_mask, j)  = c->cnt == 0 ? 0 : -1;
+        }
+
+        if (lanes == 0)
+        {
+            pos += run;
+            continue;
+        }
+
+        /* Pad the last vector with silent lanes */
+        nvec = (lanes + OPL_VECTOR_LANES - 1) / OPL_VECTOR_LANES;
+        for (j = lanes; j < nvec * OPL_VECTOR_LANES; j++)
+        {
+            LANE(L.mod_inc, j) = 0;
+            LANE(L.car_inc, j) = 0;
+            LANE(L.fb_mul, j)  = 0;
+            for (i = 0; i < run; i++)
+            {
+                LANE(L.mod_tot[i], j) = OPL_LIN_SIZE;
+                LANE(L.car_tot[i], j) = OPL_LIN_SIZE;
+                LANE(L.act[i], j)     = 0;
+            }
+        }
+
+        opl_lanes_run(&L, nvec, out + pos, run);
+
+        for (j = 0; j < lanes; j++)
+        {
+            opl_channel_t *c = lane_ch[j];
+
+            c->op[0].phase     = LANE(L.mod_phase, j);
+            c->op[1].phase     = LANE(L.car_phase, j);
+            c->op[0].phase_inc = LANE(L.mod_inc, j);
+            c->op[1].phase_inc = LANE(L.car_inc, j);
+            c->fb_out[0]       = LANE(L.fb0, j);
+            c->fb_out[1]       = LANE(L.fb1, j);
+        }
+        pos += run;
+    }
+}
+
+#endif /* OPL_VECTOR_LANES */
+
+/* Generate 'n' OPL samples */
+static void opl_gen_block(opl_chip_t *chip, int32_t *out, int n)
+{
+    int i;
+
+#if OPL_VECTOR_LANES
+    opl_gen_block_vector(chip, out, n);
+#else
+    opl_gen_block_scalar(chip, out, n);
+#endif
+    note_mix(chip, out, n);
+
+    /* Scale output */
+    for (i = 0; i < n; i++)
+    {
+        int32_t s = out[i] >> 1;
+        if (s >  32767) s =  32767;
+        if (s < -32768) s = -32768;
+        out[i] = s;
+    }
+}
+
+/* Generate 'n' output samples at OUTPUT_RATE via resampling */
+static void opl_gen_resampled(opl_chip_t *chip, int32_t *out, int n)
+{
+    int32_t  s0, s1, frac;
+    uint32_t rf;
+    int      need, i, j;
+
+    /* We need OPL_RATE/OUTPUT_RATE = ~1.127 OPL samples per output sample */
+    need = (int)((chip->resamp_frac + (uint32_t)n * OPL_RATE) / OUTPUT_RATE);
+    opl_gen_block(chip, chip->buf, need);
+
+    rf = chip->resamp_frac;
+    for (i = 0, j = 0; i < n; i++)
+    {
+        rf += OPL_RATE;
+        while (rf >= OUTPUT_RATE)
+        {
+            rf -= OUTPUT_RATE;
+            chip->prev_sample = chip->cur_sample;
+            chip->cur_sample  = chip->buf[j++];
+        }
+
+        /* Linear interpolation */
+        frac = (rf * 256) / OUTPUT_RATE;
+        s0 = chip->prev_sample;
+        s1 = chip->cur_sample;
+        out[i] = s0 + (((s1 - s0) * frac) >> 8);
+    }
+    chip->resamp_frac = rf;
+}
+
+/* Generate 'n' output samples with the clocks running at chip->rate */
+static void opl_gen_native(opl_chip_t *chip, int32_t *out, int n)
+{
+    int     shift = chip->rate_shift;
+    int     i, j;
+    int32_t s0, s1;
+
+    opl_gen_block(chip, chip->buf, n >> shift);
+
+    /* Interpolate up to OUTPUT_RATE */
+    s0 = chip->cur_sample;
+    for (i = 0; i < (n >> shift); i++)
+    {
+        s1 = chip->buf[i];
+        for (j = 1; j <= (1 << shift); j++)
+        {
+            *out++ = s0 + (((s1 - s0) * j) >> shift);
+        }
+        s0 = s1;
+    }
+    chip->cur_sample = s0;
+}
+
+/* Generate 'n' music samples at OUTPUT_RATE, before music volume */
+static void opl_gen_music(opl_chip_t *chip, int32_t *out, int n)
+{
+    if (chip->mode == OPL_MODE_RESAMPLED)
+        opl_gen_resampled(chip, out, n);
+    else
+        opl_gen_native(chip, out, n);
+}
+
+/* ==================== OPL Key On/Off ==================== */
+
+static void opl_key_on(opl_chip_t *chip, int ch)
+{
+    opl_channel_t *c = &chip->chan[ch];
+    int j;
+
+    note_voice_stop(chip, ch);
+
+    c->key_on = 1;
+    for (j = 0; j < 2; j++)
+    {
+        c->op[j].phase      = 0;
+        c->op[j].env        = 511;
+        c->op[j].eg_state   = EG_ATTACK;
+        c->op[j].key        = 1;
+        opl_env_schedule(&c->op[j], 1);
+    }
+    c->fb_out[0] = 0;
+    c->fb_out[1] = 0;
+}
+
+static void opl_key_off(opl_chip_t *chip, int ch)
+{
+    opl_channel_t *c = &chip->chan[ch];
+    int j;
+
+    note_voice_release(chip, ch);
+
+    c->key_on = 0;
+    for (j = 0; j < 2; j++)
+    {
+        if (c->op[j].eg_state != EG_OFF)
+        {
+            c->op[j].eg_state   = EG_RELEASE;
+            opl_env_schedule(&c->op[j], 1);
+        }
+        c->op[j].key = 0;
+    }
+}
+
+/* Cut a channel off at once, without a release */
+static void opl_silence(opl_chip_t *chip, int ch)
+{
+    opl_channel_t *c = &chip->chan[ch];
+    int j;
+
+    note_voice_stop(chip, ch);
+
+    for (j = 0; j < 2; j++)
+    {
+        c->op[j].env      = 511;
+        c->op[j].eg_state = EG_OFF;
+        c->op[j].eg_left  = EG_NEVER;
+        c->op[j].key      = 0;
+    }
+    c->key_on = 0;
+}
+
+/* Set channel frequency */
+static void opl_set_freq(opl_chip_t *chip, int ch, int fnum, int block)
+{
+    opl_channel_t *c = &chip->chan[ch];
+    c->fnum  = fnum;
+    c->block = block;
+
+    /* KSL attenuation: depends on fnum top bits and block */
+    /* Simplified: higher notes get more attenuation with KSL enabled */
+    {
+        int ksl_base = ((block << 4) | (fnum >> 6));
+        if (ksl_base > 112) ksl_base = 112;
+
+        c->op[0].ksl_atten = (c->op[0].ksl > 0) ?
+            (ksl_base >> (3 - c->op[0].ksl)) : 0;
+        c->op[1].ksl_atten = (c->op[1].ksl > 0) ?
+            (ksl_base >> (3 - c->op[1].ksl)) : 0;
+    }
+
+    opl_env_calc_periods(chip, &c->op[0], block, fnum);
+    opl_env_calc_periods(chip, &c->op[1], block, fnum);
+}
+
+/* Program an OPL operator from GENMIDI operator data */
+static void opl_prog_op(opl_op_t *op, const genmidi_op_t *g)
+{
+    /* tremolo byte = register 0x20:
+     * bit 7: AM
+     * bit 6: VIB
+     * bit 5: EGT (sustaining)
+     * bit 4: KSR
+     * bit 3-0: MULT */
+    op->am   = (g->tremolo >> 7) & 1;
+    op->vib  = (g->tremolo >> 6) & 1;
+    op->egt  = (g->tremolo >> 5) & 1;
+    op->ksr  = (g->tremolo >> 4) & 1;
+    op->mult = (g->tremolo)      & 0x0F;
+
+    /* attack byte = register 0x60:
+     * bits 7-4: AR
+     * bits 3-0: DR */
+    op->ar = (g->attack >> 4) & 0x0F;
+    op->dr = (g->attack)      & 0x0F;
+
+    /* sustain byte = register 0x80:
+     * bits 7-4: SL
+     * bits 3-0: RR */
+    op->sl = (g->sustain >> 4) & 0x0F;
+    op->rr = (g->sustain)      & 0x0F;
+
+    /* waveform = register 0xE0 */
+    op->ws = g->waveform & 0x03;
+
+    /* scale byte = register 0x40:
+     * bits 7-6: KSL
+     * bits 5-0: TL */
+    op->ksl = (g->scale >> 6) & 0x03;
+    op->tl  = (g->scale)      & 0x3F;
+}
+
+/* Decode a GENMIDI voice's registers */
+static void opl_patch_voice(opl_patch_t *p, const genmidi_voice_t *v)
+{
+    opl_op_t op;
+
+    memset(&op, 0, sizeof(op));
+    opl_prog_op(&op, &v->modulator);
+    memcpy(p->op[0], &op, OPL_OP_REGS);
+    opl_prog_op(&op, &v->carrier);
+    memcpy(p->op[1], &op, OPL_OP_REGS);
+
+    /* feedback byte = register 0xC0:
      * bits 3-1: FB
      * bit 0: CNT */
-    c->fb  = (v->feedback >> 1) & 7;
-    c->cnt = v->feedback & 1;
+    p->fb  = (v->feedback >> 1) & 7;
+    p->cnt = v->feedback & 1;
+}
+
+/* Program OPL channel from a decoded patch; opl_set_freq() must follow */
+static void opl_prog_patch(opl_chip_t *chip, int ch, const opl_patch_t *p)
+{
+    opl_channel_t *c = &chip->chan[ch];
+
+    memcpy(&c->op[0], p->op[0], OPL_OP_REGS);
+    memcpy(&c->op[1], p->op[1], OPL_OP_REGS);
+    c->fb  = p->fb;
+    c->cnt = p->cnt;
 }
 
 /* ==================== GENMIDI Loading ==================== */
 
+/* Decode the first voice of every instrument into genmidi_patches */
+static void genmidi_decode(void)
+{
+    int i;
+
+    for (i = 0; i < GENMIDI_NUM_INSTRS; i++)
+    {
+        const genmidi_instr_t *instr = &genmidi_instrs[i];
+        const genmidi_voice_t *v     = &instr->voices[0];
+        opl_patch_t           *p     = &genmidi_patches[i];
+
+        opl_patch_voice(p, v);
+        p->fixed            = (instr->flags & GENMIDI_FLAG_FIXED) ? 1 : 0;
+        p->fixed_note       = instr->fixed_note;
+        p->base_note_offset = v->base_note_offset;
+        p->note_offset      = v->base_note_offset;
+
+        /* Fine tuning, center = 128 */
+        if (instr->fine_tuning != 128)
+            p->note_offset += ((int)instr->fine_tuning - 128) / 64;
+    }
+}
+
 static void load_genmidi(void)
 {
     int             lumpnum, len;
@@ -933,566 +1583,3555 @@ static void load_genmidi(void)
     /* Point directly at the instrument data
      * The data is packed exactly as our struct with __attribute__((packed)) */
     genmidi_instrs = (genmidi_instr_t *)(data + 8);
+    genmidi_decode();
 
     genmidi_loaded = 1;
 }
 
-/* ==================== MIDI Voice Allocation ==================== */
+/* ==================== Note Cache ==================== */
 
-static void midi_note_off(int ch, int note);
+/*
+ * Music only ever plays a limited set of (instrument, note, velocity)
+ * combinations, and a note's sound depends on nothing else once keyed
+ * on. With NOTE_CACHE_MAX_BYTES set, each combination is rendered once
+ * through the synth by the music worker, and later notes play those
+ * samples on the channel instead of running FM:
+ *
+ *   attack     key on up to the sustain point (one-shot notes: to silence)
+ *   loop       a stretch of the held tone whose phases line up again
+ *   release    key off at the attack peak, down to silence
+ *
+ * A note off jumps to where the release tail matches the current
+ * envelope level, with a short crossfade. The first play of a note is
+ * live FM while the worker renders it. Operators using the LFOs never
+ * repeat exactly, so those notes always play live. Samples are kept
+ * at the synthesis rate, before the output scaling, so they mix with
+ * the FM channels. Unused notes are dropped in LRU order to stay within
+ * the budget. 0 (the default) keeps every note on FM.
+ *
+ * The music job takes no lock and makes no syscall for the cache. Only
+ * the worker changes the hash: the job looks notes up as it stands,
+ * posts the keys it doesn't find to note_reqs, and counts the voices
+ * playing each note in 'refs'; the game thread wakes the worker for the
+ * requests (see note_cache_poll()). A note is published by its state,
+ * once rendered. A dropped note leaves the hash at once but is freed
+ * only after the job has finished a block since (note_quiet moved on),
+ * so no lookup still holds it, and once no voice plays it. The worker's
+ * own sequencer (see Music Cache) plays notes from the same thread as
+ * it changes the hash, so its voices are checked directly.
+ */
 
-static int alloc_voice(int midi_ch, int note)
-{
-    int      i, steal = -1, rel_voice = -1;
-    uint32_t oldest_age;
-    (void)note;
+#ifndef NOTE_CACHE_MAX_BYTES
+#define NOTE_CACHE_MAX_BYTES    0       /* e.g. (2 * 1024 * 1024) */
+#endif
 
-    /* Find free voice */
-    for (i = 0; i < MAX_VOICES; i++)
-        if (!midi.voices[i].active)
-            return i;
+#define NOTE_HASH_SIZE          256
+#define NOTE_ENV_STEP           64      /* samples per envelope entry */
+#define NOTE_FADE               64      /* crossfade samples on a jump */
+#define NOTE_LOOP_MIN           1024
+#define NOTE_LOOP_MAX           4096
+#define NOTE_ATTACK_SECS        2       /* longer attacks stay live */
+#define NOTE_RELEASE_SECS       2       /* longer tails are cut */
+#define NOTE_MAX_SAMPLES        ((NOTE_ATTACK_SECS + NOTE_RELEASE_SECS) * OPL_RATE \
+                                 + NOTE_LOOP_MAX + 2 * NOTE_ENV_STEP)
 
-    /* Find voice in release on same channel */
-    for (i = 0; i < MAX_VOICES; i++)
-    {
-        if (midi.voices[i].active && midi.voices[i].midi_ch == midi_ch)
-        {
-            opl_channel_t *c = &opl.chan[i];
-            if (c->op[1].eg_state == EG_RELEASE ||
-                c->op[1].eg_state == EG_OFF)
-            {
-                rel_voice = i;
-                break;
-            }
-        }
-    }
-    if (rel_voice >= 0)
-    {
-        opl_key_off(rel_voice);
-        midi.voices[rel_voice].active = 0;
-        return rel_voice;
-    }
+#define NOTE_DONE               0xFFFFFFFFu
 
-    /* Steal oldest voice */
-    oldest_age = 0xFFFFFFFF;
-    for (i = 0; i < MAX_VOICES; i++)
-    {
-        if (midi.voices[i].age < oldest_age)
-        {
-            oldest_age = midi.voices[i].age;
-            steal      = i;
-        }
-    }
+#define NOTE_PENDING            0       /* queued for the worker */
+#define NOTE_READY              1
+#define NOTE_LIVE               2       /* can't be cached, play FM */
 
-    if (steal >= 0)
-    {
-        opl_key_off(steal);
-        midi.voices[steal].active = 0;
-    }
+#define NOTE_REQ_SLOTS          32
 
-    return steal;
-}
+static note_entry_t *note_hash[NOTE_HASH_SIZE];
+static note_entry_t *note_retired = NULL;   /* worker */
+static int           note_cache_on = 0;
+static uint32_t      note_bytes   = 0;      /* worker, retired excluded */
+static int           note_pending = 0;      /* worker */
 
-/* ==================== MIDI Note Handling ==================== */
+/* Keys the music job didn't find, for the worker */
+static uint32_t          note_reqs[NOTE_REQ_SLOTS];
+static volatile uint32_t note_req_head  = 0;    /* music job */
+static volatile uint32_t note_req_tail  = 0;    /* worker */
+static uint32_t          note_req_woken = 0;    /* game thread */
+
+/* Blocks the music job has finished (see music_produce()) */
+static volatile uint32_t note_quiet = 0;
+
+/* Worker-owned render state */
+static opl_chip_t    note_chip, note_snap;
+static int16_t      *note_scratch = NULL;
+static int32_t       note_block[NOTE_ENV_STEP];
+static uint16_t      note_env[NOTE_MAX_SAMPLES / NOTE_ENV_STEP];
+
+static int note_is_worker(const opl_chip_t *chip);
+
+/* ---- Playback ---- */
 
-static void midi_note_on(int ch, int note, int velocity)
+/* Next sample of a cached note */
+static uint32_t note_advance(const note_entry_t *e, uint32_t pos)
 {
-    int                      slot, instr_idx, real_note, block, fn_idx;
-    int                      combined_vol, vol_atten;
-    uint16_t                 fnum;
-    const genmidi_instr_t   *instr;
-    const genmidi_voice_t   *voice;
+    uint32_t rel = e->attack_len + e->loop_len;
 
-    if (velocity == 0)
-    {
-        midi_note_off(ch, note);
-        return;
-    }
+    if (++pos == rel)
+        return e->loop_len ? e->attack_len : NOTE_DONE;
+    if (pos >= rel + e->release_len)
+        return NOTE_DONE;
+    return pos;
+}
+
+/* Give channel 'ch' back to FM */
+static void note_voice_stop(opl_chip_t *chip, int ch)
+{
+    note_voice_t *v = &chip->note[ch];
 
-    if (genmidi_loaded != 1 || !genmidi_instrs)
+    if (!v->note)
         return;
 
-    /* Select instrument */
-    if (midi.chan[ch].is_drum)
-    {
-        instr_idx = 128 + (note - 35);
-        if (instr_idx < 128 || instr_idx >= GENMIDI_NUM_INSTRS)
-            return;
-    }
-    else
-    {
-        instr_idx = midi.chan[ch].program;
-        if (instr_idx >= 128) instr_idx = 0;
-    }
+    if (!note_is_worker(chip))
+        v->note->refs--;
+    v->note = NULL;
+}
 
-    instr = &genmidi_instrs[instr_idx];
-    voice = &instr->voices[0];
+/* Key off: continue from the point of the release tail at the current
+ * envelope level (the loop holds the level the attack ended on), fading
+ * out what was playing */
+static void note_voice_release(opl_chip_t *chip, int ch)
+{
+    note_voice_t       *v = &chip->note[ch];
+    const note_entry_t *e = v->note;
+    const uint16_t     *renv;
+    uint32_t            frames, pos, k;
+    uint16_t            level;
 
-    /* Allocate OPL channel */
-    slot = alloc_voice(ch, note);
-    if (slot < 0)
+    if (!e || v->released)
         return;
 
-    /* Program OPL */
-    opl_prog_voice(slot, voice);
-
-    /* Calculate note */
-    if (instr->flags & GENMIDI_FLAG_FIXED)
-        real_note = instr->fixed_note;
-    else
-        real_note = note;
+    renv   = e->env + e->attack_len / NOTE_ENV_STEP;
+    frames = e->release_len / NOTE_ENV_STEP;
+    pos    = (v->pos < e->attack_len) ? v->pos : e->attack_len - 1;
+    level  = e->env[pos / NOTE_ENV_STEP];
+
+    for (k = 0; k < frames && renv[k] < level; k++)
+        ;
+    if (k > 0 && (k == frames || level - renv[k - 1] < renv[k] - level))
+        k--;
+
+    v->fade_pos = v->pos;
+    v->fade     = NOTE_FADE;
+    v->pos      = frames ? e->attack_len + e->loop_len + k * NOTE_ENV_STEP
+                         : NOTE_DONE;
+    v->released = 1;
+}
 
-    /* Apply base note offset from GENMIDI voice */
-    real_note += voice->base_note_offset;
+/* Add the cached notes to 'n' unscaled synthesis samples */
+static void note_mix(opl_chip_t *chip, int32_t *out, int n)
+{
+    int ch, i;
 
-    /* Apply fine tuning (center = 128) */
-    if (instr->fine_tuning != 128)
+    for (ch = 0; ch < OPL_NUM_CHANNELS; ch++)
     {
-        int ft = (int)instr->fine_tuning - 128;
-        real_note += ft / 64;
-    }
+        note_voice_t       *v = &chip->note[ch];
+        const note_entry_t *e = v->note;
 
-    if (real_note < 0)   real_note = 0;
-    if (real_note > 127) real_note = 127;
+        if (!e)
+            continue;
 
-    /* Calculate block (octave) and F-number */
-    fn_idx = real_note % 12;
-    block  = real_note / 12;
+        for (i = 0; i < n; i++)
+        {
+            int32_t s = (v->pos != NOTE_DONE) ? e->pcm[v->pos] : 0;
 
-    /* OPL2 block range is 0-7 */
-    if (block > 7) block = 7;
-    if (block < 0) block = 0;
+            if (v->fade)
+            {
+                s += ((e->pcm[v->fade_pos] - s) * v->fade) / NOTE_FADE;
+                v->fade_pos = note_advance(e, v->fade_pos);
+                v->fade     = (v->fade_pos != NOTE_DONE) ? v->fade - 1 : 0;
+            }
+            out[i] += s;
+
+            if (v->pos != NOTE_DONE)
+                v->pos = note_advance(e, v->pos);
+            if (v->pos == NOTE_DONE && !v->fade)
+            {
+                note_voice_stop(chip, ch);
+                break;
+            }
+        }
+    }
+}
 
-    fnum = fnumber_table[fn_idx];
+/* ---- Lookup ---- */
 
-    /* Calculate volume attenuation */
-    combined_vol = (velocity * midi.chan[ch].volume * midi.chan[ch].expression)
-                   / (127 * 127);
-    if (combined_vol > 127) combined_vol = 127;
-    if (combined_vol < 0)   combined_vol = 0;
+static note_entry_t *note_find(uint32_t key)
+{
+    note_entry_t *e;
 
-    /* Map to OPL attenuation: 0=loud, ~48=quiet */
-    vol_atten = ((127 - combined_vol) * 48) / 127;
+    for (e = note_hash[key % NOTE_HASH_SIZE]; e; e = e->next)
+        if (e->key == key)
+            return e;
+    return NULL;
+}
+
+/* Worker: whether a voice of either sequencer plays 'e' */
+static int note_in_use(const note_entry_t *e);
 
-    opl.chan[slot].vol_atten = vol_atten;
+/* Worker: take 'e' out of the hash; the job may still be reading it */
+static void note_unlink(note_entry_t *e)
+{
+    note_entry_t **p = &note_hash[e->key % NOTE_HASH_SIZE];
 
-    opl_set_freq(slot, fnum, block);
-    opl_key_on(slot);
+    while (*p != e)
+        p = &(*p)->next;
+    *p = e->next;
 
-    /* Record voice info */
-    midi.voices[slot].active      = 1;
-    midi.voices[slot].midi_ch     = ch;
-    midi.voices[slot].note        = note;
-    midi.voices[slot].opl_ch      = slot;
-    midi.voices[slot].velocity    = velocity;
-    midi.voices[slot].age         = midi.voice_age++;
-    midi.voices[slot].note_offset = voice->base_note_offset;
+    note_bytes -= e->bytes;
+    e->retired_at = note_quiet;
+    e->retired    = note_retired;
+    note_retired  = e;
 }
 
-static void midi_note_off(int ch, int note)
+/* Worker: free the dropped notes nothing can reach any more */
+static void note_reap(void)
 {
-    int i;
-    for (i = 0; i < MAX_VOICES; i++)
+    note_entry_t **p = &note_retired;
+
+    __sync_synchronize();
+    while (*p)
     {
-        if (midi.voices[i].active &&
-            midi.voices[i].midi_ch == ch &&
-            midi.voices[i].note == note)
+        note_entry_t *e = *p;
+
+        if (e->retired_at != note_quiet && !note_in_use(e))
         {
-            opl_key_off(midi.voices[i].opl_ch);
-            midi.voices[i].active = 0;
-            break;
+            *p = e->retired;
+            free(e->pcm);
+            free(e);
         }
+        else
+            p = &e->retired;
     }
 }
 
-static void midi_control_change(int ch, int cc, int val)
+/* Worker: drop least recently used notes until 'bytes' more fit; 0 if
+ * they can't */
+static int note_make_room(uint32_t bytes)
 {
-    int i;
-    switch (cc)
+    while (note_bytes + bytes > NOTE_CACHE_MAX_BYTES)
     {
-    case 7:  midi.chan[ch].volume = val; break;
-    case 10: midi.chan[ch].pan = val; break;
-    case 11: midi.chan[ch].expression = val; break;
-    case 64: break; /* sustain pedal - ignore */
-    case 121:
-        midi.chan[ch].volume     = 100;
-        midi.chan[ch].pan        = 64;
-        midi.chan[ch].expression = 127;
-        midi.chan[ch].pitch_bend = 0;
-        break;
-    case 120:
-    case 123:
-        for (i = 0; i < MAX_VOICES; i++)
+        note_entry_t *e, *victim = NULL;
+        int           i;
+
+        __sync_synchronize();
+        for (i = 0; i < NOTE_HASH_SIZE; i++)
         {
-            if (midi.voices[i].active && midi.voices[i].midi_ch == ch)
+            for (e = note_hash[i]; e; e = e->next)
             {
-                opl_key_off(midi.voices[i].opl_ch);
-                midi.voices[i].active = 0;
+                if (e->state != NOTE_PENDING && !note_in_use(e) &&
+                    (!victim || e->last_used < victim->last_used))
+                    victim = e;
             }
         }
-        break;
+        if (!victim)
+            return 0;
+        note_unlink(victim);
     }
+    return 1;
 }
 
-static void midi_program_change(int ch, int prog)
+/* Worker: add a note for note_cache_fill() to render */
+static void note_insert(uint32_t key)
 {
-    midi.chan[ch].program = prog & 0x7F;
+    note_entry_t *e;
+
+    if (note_find(key) || !note_make_room(sizeof(*e)) ||
+        !(e = calloc(1, sizeof(*e))))
+        return;
+
+    e->key       = key;
+    e->state     = NOTE_PENDING;
+    e->bytes     = sizeof(*e);
+    e->last_used = note_quiet;
+    e->next      = note_hash[key % NOTE_HASH_SIZE];
+    __sync_synchronize();
+    note_hash[key % NOTE_HASH_SIZE] = e;
+    note_bytes += e->bytes;
+    note_pending++;
 }
 
-/* ==================== MIDI Timing ==================== */
+/*
+ * Play a note on channel 'ch' from the cache, after opl_set_freq().
+ * Returns 0 if the channel has to be keyed on as FM; a note not seen
+ * before is queued for the worker (or, on the worker, added).
+ */
+static int note_cache_play(opl_chip_t *chip, int ch, int instr)
+{
+    opl_channel_t *c = &chip->chan[ch];
+    note_voice_t  *v = &chip->note[ch];
+    note_entry_t  *e;
+    uint32_t       key;
+    int            worker;
+
+    if (!note_cache_on)
+        return 0;
+
+    key = ((uint32_t)instr << 20) | ((uint32_t)c->block << 17) |
+          ((uint32_t)c->fnum << 7) | (uint32_t)c->vol_atten;
+
+    worker = note_is_worker(chip);
+    e      = note_find(key);
+    if (!e)
+    {
+        if (worker)
+            note_insert(key);
+        else if (note_req_head - note_req_tail < NOTE_REQ_SLOTS)
+        {
+            /* A full queue drops the request; the note comes up again */
+            note_reqs[note_req_head % NOTE_REQ_SLOTS] = key;
+            __sync_synchronize();
+            note_req_head++;
+        }
+        return 0;
+    }
+
+    /* An LRU hint, which either side may write */
+    e->last_used = note_quiet;
+    if (e->state != NOTE_READY)
+        return 0;
+    __sync_synchronize();
+    if (!worker)
+        e->refs++;
+
+    /* Silence the FM side of the channel */
+    opl_silence(chip, ch);
+
+    v->note     = e;
+    v->pos      = 0;
+    v->fade     = 0;
+    v->released = 0;
+    return 1;
+}
+
+/* ---- Rendering (music worker) ---- */
 
-static void midi_calc_timing(void)
+/* Sustaining at a fixed level, or finished */
+static int note_op_stable(const opl_op_t *op)
 {
-    if (midi.ticks_per_beat == 0)
-        midi.ticks_per_beat = 140;
-    if (midi.us_per_beat == 0)
-        midi.us_per_beat = 500000;
+    return op->eg_state == EG_OFF ||
+           (op->eg_state == EG_SUSTAIN && op->eg_period[EG_SUSTAIN] == 0);
+}
 
-    midi.samples_per_tick = ((double)midi.us_per_beat / 1000000.0)
-                          * (double)OUTPUT_RATE
-                          / (double)midi.ticks_per_beat;
+/* Envelope of the louder audible operator */
+static uint16_t note_level(const opl_channel_t *c)
+{
+    if (c->cnt && c->op[0].env < c->op[1].env)
+        return (uint16_t)c->op[0].env;
+    return (uint16_t)c->op[1].env;
+}
 
-    if (midi.samples_per_tick < 1.0)
-        midi.samples_per_tick = 1.0;
+static int note_silent(const opl_channel_t *c)
+{
+    return c->op[1].eg_state == EG_OFF &&
+           (c->cnt == 0 || c->op[0].eg_state == EG_OFF);
 }
 
-/* ==================== MIDI Parser ==================== */
+/* Render 'n' (at most NOTE_ENV_STEP) samples of note_chip channel 0 */
+static void note_gen(int16_t *dst, int n)
+{
+    int i;
 
-static uint32_t read_var_len(const uint8_t *data, int *pos, int end)
+    opl_gen_block_scalar(&note_chip, note_block, n);
+    for (i = 0; i < n; i++)
+    {
+        int32_t s = note_block[i];
+        if (s >  32767) s =  32767;
+        if (s < -32768) s = -32768;
+        dst[i] = (int16_t)s;
+    }
+}
+
+/* Loop length after which both operator phases come closest to where
+ * they started (only bits 19..10 of the phase are audible) */
+static uint32_t note_loop_len(const opl_channel_t *c)
 {
-    uint32_t val = 0;
-    uint8_t  b;
-    int      i;
+    uint32_t n, best = NOTE_LOOP_MIN, best_err = 0xFFFFFFFFu;
+    int      j;
 
-    for (i = 0; i < 4; i++)
+    for (n = NOTE_LOOP_MIN; n <= NOTE_LOOP_MAX; n++)
     {
-        if (*pos >= end) break;
-        b   = data[(*pos)++];
-        val = (val << 7) | (b & 0x7F);
-        if (!(b & 0x80)) break;
+        uint32_t err = 0;
+
+        for (j = 0; j < 2; j++)
+        {
+            uint32_t d = (n * c->op[j].phase_inc) & 0xFFFFF;
+            if (d > 0x80000)
+                d = 0x100000 - d;
+            if (d > err)
+                err = d;
+        }
+        if (err < best_err)
+        {
+            best_err = err;
+            best     = n;
+        }
     }
-    return val;
+    return best;
 }
 
-static int parse_midi(const uint8_t *data, int len)
+/* Render the note keyed by 'e'; 0 if it has to stay live */
+static int note_render(note_entry_t *e)
 {
-    int      pos, ntracks, track;
-    uint16_t division;
+    opl_channel_t *c = &note_chip.chan[0];
+    uint32_t       max_attack, max_release;
+    uint32_t       a = 0, l = 0, r = 0, i, total, frames;
+    uint16_t      *env = note_env;
+    int16_t       *pcm = note_scratch;
+    int            hold, snap = 0;
+
+    if (!pcm && !(pcm = note_scratch = malloc(NOTE_MAX_SAMPLES * sizeof(int16_t))))
+        return 0;
 
-    midi.num_events     = 0;
-    midi.ticks_per_beat = 120;
-    midi.us_per_beat    = 500000;
+    opl_reset(&note_chip);
+    opl_prog_patch(&note_chip, 0, &genmidi_patches[e->key >> 20]);
+    c->vol_atten = e->key & 0x7F;
+    opl_set_freq(&note_chip, 0, (e->key >> 7) & 0x3FF, (e->key >> 17) & 7);
+    opl_key_on(&note_chip, 0);
 
-    if (len < 14 || memcmp(data, "MThd", 4) != 0)
+    if (c->op[0].am || c->op[0].vib || c->op[1].am || c->op[1].vib)
         return 0;
 
-    pos = 8;
-    pos += 2;  /* skip format */
+    max_attack  = NOTE_ATTACK_SECS * note_chip.rate / NOTE_ENV_STEP * NOTE_ENV_STEP;
+    max_release = NOTE_RELEASE_SECS * note_chip.rate / NOTE_ENV_STEP * NOTE_ENV_STEP;
+    hold        = c->op[1].eg_period[EG_SUSTAIN] == 0;
 
-    ntracks  = (data[pos] << 8) | data[pos+1]; pos += 2;
-    division = (data[pos] << 8) | data[pos+1]; pos += 2;
+    /* Attack: held notes up to where both operators settle, one-shots
+     * to silence. The release is keyed off at the peak, so it passes
+     * through every level a key off can find the note at. */
+    for (;;)
+    {
+        if (!snap && c->op[1].eg_state >= EG_DECAY)
+        {
+            note_snap = note_chip;
+            snap = 1;
+        }
+        if (hold ? (c->op[1].eg_state == EG_SUSTAIN && note_op_stable(&c->op[0]))
+                 : note_silent(c))
+            break;
+        if (a >= max_attack)
+            return 0;
 
-    if (division & 0x8000)
-        midi.ticks_per_beat = 120;
-    else if (division > 0)
-        midi.ticks_per_beat = division;
-    else
-        midi.ticks_per_beat = 120;
+        env[a / NOTE_ENV_STEP] = note_level(c);
+        note_gen(pcm + a, NOTE_ENV_STEP);
+        a += NOTE_ENV_STEP;
+    }
 
-    if (!midi.events)
+    /* Sustain loop */
+    if (hold)
     {
-        midi.events = (midi_event_t *)malloc(MAX_MIDI_EVENTS * sizeof(midi_event_t));
-        if (!midi.events) return 0;
+        l = note_loop_len(c);
+        for (i = 0; i < l; i += NOTE_ENV_STEP)
+            note_gen(pcm + a + i, (l - i < NOTE_ENV_STEP) ? l - i : NOTE_ENV_STEP);
     }
 
-    for (track = 0; track < ntracks && pos + 8 <= len; track++)
+    /* Release */
+    if (snap)
     {
-        int      trk_len, trk_end;
-        uint32_t abs_tick = 0;
-        uint8_t  running  = 0;
+        note_chip = note_snap;
+        opl_key_off(&note_chip, 0);
 
-        if (memcmp(&data[pos], "MTrk", 4) != 0)
+        while (!note_silent(c) && r < max_release)
         {
-            /* Skip unknown chunk */
-            int clen = (data[pos+4]<<24)|(data[pos+5]<<16)|
-                       (data[pos+6]<<8)|data[pos+7];
-            pos += 8 + clen;
-            continue;
+            env[(a + r) / NOTE_ENV_STEP] = note_level(c);
+            note_gen(pcm + a + l + r, NOTE_ENV_STEP);
+            r += NOTE_ENV_STEP;
         }
 
-        trk_len = (data[pos+4]<<24)|(data[pos+5]<<16)|
-                  (data[pos+6]<<8)|data[pos+7];
-        pos += 8;
-        trk_end = pos + trk_len;
-        if (trk_end > len) trk_end = len;
+        /* Fade out a tail that was cut short */
+        if (!note_silent(c))
+        {
+            for (i = 0; i < NOTE_ENV_STEP; i++)
+            {
+                int16_t *s = &pcm[a + l + r - NOTE_ENV_STEP + i];
+                *s = (int16_t)((*s * (int32_t)(NOTE_ENV_STEP - 1 - i)) / NOTE_ENV_STEP);
+            }
+        }
+    }
+
+    total  = a + l + r;
+    frames = (a + r) / NOTE_ENV_STEP;
+    if (total == 0)
+        return 0;
 
-        while (pos < trk_end && midi.num_events < MAX_MIDI_EVENTS - 1)
+    e->pcm = malloc(total * sizeof(int16_t) + frames * sizeof(uint16_t));
+    if (!e->pcm)
+        return 0;
+    memcpy(e->pcm, pcm, total * sizeof(int16_t));
+    e->env = (uint16_t *)(e->pcm + total);
+    memcpy(e->env, env, frames * sizeof(uint16_t));
+
+    e->attack_len  = a;
+    e->loop_len    = l;
+    e->release_len = r;
+    e->bytes      += total * sizeof(int16_t) + frames * sizeof(uint16_t);
+    return 1;
+}
+
+/* Worker: add the notes the music job asked for, render every pending
+ * one and free what was dropped */
+static void note_cache_fill(void)
+{
+    while (note_req_tail != note_req_head)
+    {
+        __sync_synchronize();
+        note_insert(note_reqs[note_req_tail % NOTE_REQ_SLOTS]);
+        __sync_synchronize();
+        note_req_tail++;
+    }
+
+    while (note_pending > 0)
+    {
+        note_entry_t *e = NULL;
+        uint32_t      bytes;
+        int           i, ok;
+
+        for (i = 0; i < NOTE_HASH_SIZE && !e; i++)
+            for (e = note_hash[i]; e && e->state != NOTE_PENDING; e = e->next)
+                ;
+        if (!e)
+            break;
+
+        bytes = e->bytes;
+        ok    = note_render(e);
+        if (ok && !note_make_room(e->bytes - bytes))
         {
-            uint32_t     delta;
-            uint8_t      st, type, ch_n;
-            midi_event_t *ev;
+            free(e->pcm);
+            e->pcm   = NULL;
+            e->bytes = bytes;
+            ok = 0;
+        }
+        note_bytes += e->bytes - bytes;
 
-            delta     = read_var_len(data, &pos, trk_end);
-            abs_tick += delta;
+        /* Publish the samples before the state */
+        __sync_synchronize();
+        e->state = ok ? NOTE_READY : NOTE_LIVE;
+        note_pending--;
+    }
 
-            if (pos >= trk_end) break;
+    note_reap();
+}
 
-            st = data[pos];
-            if (st & 0x80)
-            {
-                running = st;
-                pos++;
-            }
-            else
-            {
-                st = running;
-            }
+/* Game thread: wake the worker for what the music job asked for */
+static void note_cache_poll(void)
+{
+    uint32_t head = note_req_head;
 
-            if (st == 0) break;
+    if (note_cache_on && head != note_req_woken)
+    {
+        note_req_woken = head;
+        sceKernelSignalSema(mcache_sema, 1);
+    }
+}
 
-            type = st & 0xF0;
-            ch_n = st & 0x0F;
+/* Drop every note; all channels must be back on FM */
+static void note_cache_free(void)
+{
+    int i;
 
-            switch (type)
-            {
-            case 0x80: /* Note off */
-                if (pos + 1 < trk_end)
-                {
-                    ev = &midi.events[midi.num_events++];
-                    ev->tick    = abs_tick;
-                    ev->type    = MIDI_EV_NOTEOFF;
-                    ev->channel = ch_n;
-                    ev->data1   = data[pos++];
-                    ev->data2   = data[pos++];
-                    ev->tempo   = 0;
-                }
-                break;
+    for (i = 0; i < NOTE_HASH_SIZE; i++)
+        while (note_hash[i])
+            note_unlink(note_hash[i]);
 
-            case 0x90: /* Note on */
-                if (pos + 1 < trk_end)
-                {
-                    ev = &midi.events[midi.num_events++];
-                    ev->tick    = abs_tick;
-                    ev->type    = MIDI_EV_NOTEON;
-                    ev->channel = ch_n;
-                    ev->data1   = data[pos++];
-                    ev->data2   = data[pos++];
-                    ev->tempo   = 0;
-                }
-                break;
+    while (note_retired)
+    {
+        note_entry_t *e = note_retired;
 
-            case 0xA0: /* Poly aftertouch */
-                pos += 2;
-                break;
+        note_retired = e->retired;
+        free(e->pcm);
+        free(e);
+    }
 
-            case 0xB0: /* Control change */
-                if (pos + 1 < trk_end)
-                {
-                    ev = &midi.events[midi.num_events++];
-                    ev->tick    = abs_tick;
-                    ev->type    = MIDI_EV_CONTROL;
-                    ev->channel = ch_n;
-                    ev->data1   = data[pos++];
-                    ev->data2   = data[pos++];
-                    ev->tempo   = 0;
-                }
-                break;
+    free(note_scratch);
+    note_scratch  = NULL;
+    note_pending  = 0;
+    note_req_tail = note_req_head;
+}
 
-            case 0xC0: /* Program change */
-                if (pos < trk_end)
-                {
-                    ev = &midi.events[midi.num_events++];
-                    ev->tick    = abs_tick;
-                    ev->type    = MIDI_EV_PROGRAM;
-                    ev->channel = ch_n;
-                    ev->data1   = data[pos++];
-                    ev->data2   = 0;
-                    ev->tempo   = 0;
-                }
-                break;
+/* ==================== MIDI Voice Allocation ==================== */
 
-            case 0xD0: /* Channel pressure */
-                pos += 1;
-                break;
+/*
+ * Active voices are indexed so no event scans them: a mask of the voices
+ * in use and one per MIDI channel, the lowest voice playing each
+ * (channel, note) with the others chained in voice order, and a list in
+ * age order for stealing the oldest.
+ */
 
-            case 0xE0: /* Pitch bend */
-                if (pos + 1 < trk_end)
-                {
-                    ev = &midi.events[midi.num_events++];
-                    ev->tick    = abs_tick;
-                    ev->type    = MIDI_EV_PITCHBEND;
-                    ev->channel = ch_n;
-                    ev->data1   = data[pos++];
-                    ev->data2   = data[pos++];
-                    ev->tempo   = 0;
-                }
-                break;
+#define VOICES_ALL  ((1u << MAX_VOICES) - 1)
 
-            case 0xF0: /* System / Meta */
-                if (st == 0xFF)
-                {
-                    uint8_t  meta;
-                    uint32_t mlen;
+static int voice_limit(const midi_state_t *m)
+{
+    return m->voice_cap ? m->voice_cap : MAX_VOICES;
+}
 
-                    if (pos >= trk_end) goto trk_done;
-                    meta = data[pos++];
-                    mlen = read_var_len(data, &pos, trk_end);
+static void voice_link(midi_state_t *m, int slot)
+{
+    voice_t *v = &m->voices[slot];
+    uint8_t *p = &m->note_voice[v->midi_ch][v->note];
+
+    while (*p && *p - 1 < slot)
+        p = &m->voices[*p - 1].next_same;
+    v->next_same = *p;
+    *p = slot + 1;
+
+    v->older = m->newest;
+    v->newer = 0;
+    if (m->newest)
+        m->voices[m->newest - 1].newer = slot + 1;
+    else
+        m->oldest = slot + 1;
+    m->newest = slot + 1;
 
-                    if (meta == 0x51 && mlen == 3 && pos + 3 <= trk_end)
-                    {
-                        uint32_t t = ((uint32_t)data[pos]<<16)|
-                                     ((uint32_t)data[pos+1]<<8)|
-                                      (uint32_t)data[pos+2];
-                        if (t == 0) t = 500000;
+    m->voices_used             |= 1u << slot;
+    m->chan_voices[v->midi_ch] |= 1u << slot;
+    v->active = 1;
+}
 
-                        ev = &midi.events[midi.num_events++];
-                        ev->tick    = abs_tick;
-                        ev->type    = MIDI_EV_TEMPO;
-                        ev->channel = 0;
-                        ev->data1   = 0;
-                        ev->data2   = 0;
-                        ev->tempo   = t;
-                    }
-                    else if (meta == 0x2F)
-                    {
-                        pos += mlen;
-                        goto trk_done;
-                    }
+static void voice_unlink(midi_state_t *m, int slot)
+{
+    voice_t *v = &m->voices[slot];
+    uint8_t *p = &m->note_voice[v->midi_ch][v->note];
 
-                    pos += mlen;
-                    running = 0;
-                }
-                else if (st == 0xF0 || st == 0xF7)
-                {
-                    uint32_t slen = read_var_len(data, &pos, trk_end);
-                    pos += slen;
-                    running = 0;
-                }
-                else
-                {
-                    pos++;
-                }
-                break;
+    while (*p != slot + 1)
+        p = &m->voices[*p - 1].next_same;
+    *p = v->next_same;
 
-            default:
-                pos++;
-                break;
-            }
+    if (v->older)
+        m->voices[v->older - 1].newer = v->newer;
+    else
+        m->oldest = v->newer;
+    if (v->newer)
+        m->voices[v->newer - 1].older = v->older;
+    else
+        m->newest = v->older;
+
+    m->voices_used             &= ~(1u << slot);
+    m->chan_voices[v->midi_ch] &= ~(1u << slot);
+    v->active = 0;
+}
+
+/* Key off an active voice and free it */
+static void voice_stop(midi_state_t *m, int slot)
+{
+    opl_key_off(&m->opl, m->voices[slot].opl_ch);
+    voice_unlink(m, slot);
+}
+
+static void voice_stop_all(midi_state_t *m)
+{
+    while (m->oldest)
+        voice_stop(m, m->oldest - 1);
+}
+
+/* Forget the active voices without keying them off, before opl_reset() */
+static void voice_clear(midi_state_t *m)
+{
+    int i;
+
+    for (i = 0; i < MAX_VOICES; i++)
+        m->voices[i].active = 0;
+
+    m->voices_used = 0;
+    m->oldest      = 0;
+    m->newest      = 0;
+    memset(m->chan_voices, 0, sizeof(m->chan_voices));
+    memset(m->note_voice, 0, sizeof(m->note_voice));
+}
+
+/* A free voice within the cap, else the lowest one of the channel
+ * already releasing, else the oldest */
+static int alloc_voice(midi_state_t *m, int midi_ch)
+{
+    unsigned mask;
+    int      i;
+
+    if (__builtin_popcount(m->voices_used) < voice_limit(m))
+        return __builtin_ctz(~m->voices_used & VOICES_ALL);
+
+    for (mask = m->chan_voices[midi_ch]; mask; mask &= mask - 1)
+    {
+        opl_channel_t *c;
+        note_voice_t  *v;
+
+        i = __builtin_ctz(mask);
+        c = &m->opl.chan[i];
+        v = &m->opl.note[i];
+        if (v->note ? v->released :
+            (c->op[1].eg_state == EG_RELEASE ||
+             c->op[1].eg_state == EG_OFF))
+        {
+            voice_stop(m, i);
+            return i;
         }
+    }
 
-trk_done:
-        pos = trk_end;
+    i = m->oldest - 1;
+    voice_stop(m, i);
+    return i;
+}
+
+/* ==================== Voice Shedding ==================== */
+
+/*
+ * The live synth's render time is measured against the real time a mix
+ * block lasts. A block over SHED_BUDGET_PCT of it lowers the voice cap
+ * by one below the voices playing, cutting the quietest (by envelope
+ * plus velocity attenuation) at once rather than letting them release.
+ * After SHED_RESTORE_BLOCKS blocks in a row under SHED_RESTORE_PCT the
+ * cap goes back up by one. The music worker renders off the clock and
+ * never sheds. Every step is counted in music_stats, which
+ * I_GetMusicStats() hands out.
+ */
+
+#ifndef SHED_BUDGET_PCT
+#define SHED_BUDGET_PCT     60      /* 0 disables shedding */
+#endif
+
+#define SHED_RESTORE_PCT    30
+#define SHED_RESTORE_BLOCKS 64      /* ~0.75 s */
+#define SHED_MIN_VOICES     3
+
+#define BLOCK_US            ((MIX_SAMPLES * 1000000) / OUTPUT_RATE)
+
+static music_stats_t music_stats;
+
+/* 0 turns shedding off; music job only, like the state below */
+static uint32_t      shed_budget_us = (BLOCK_US * SHED_BUDGET_PCT) / 100;
+static int           shed_calm      = 0;    /* blocks under restore */
+
+/* How far below full volume a voice currently plays */
+static int voice_atten(const midi_state_t *m, int slot)
+{
+    const opl_channel_t *c = &m->opl.chan[slot];
+    const note_voice_t  *v = &m->opl.note[slot];
+    const note_entry_t  *e = v->note;
+    uint32_t             pos, rel;
+    int                  level;
+
+    if (!e)
+        level = note_level(c);
+    else if (v->pos == NOTE_DONE)
+        level = 511;
+    else
+    {
+        rel = e->attack_len + e->loop_len;
+        pos = v->pos;
+        if (pos >= rel)
+            pos = e->attack_len + (pos - rel);
+        else if (pos >= e->attack_len)
+            pos = e->attack_len - 1;
+        level = e->env[pos / NOTE_ENV_STEP];
+    }
+
+    return level + c->vol_atten;
+}
+
+/* Cut voices, quietest first, down to the cap */
+static void shed_voices(midi_state_t *m)
+{
+    while (__builtin_popcount(m->voices_used) > voice_limit(m))
+    {
+        unsigned mask;
+        int      i, atten, quiet = -1, quiet_atten = -1;
+
+        for (mask = m->voices_used; mask; mask &= mask - 1)
+        {
+            i     = __builtin_ctz(mask);
+            atten = voice_atten(m, i);
+            if (atten > quiet_atten)
+            {
+                quiet       = i;
+                quiet_atten = atten;
+            }
+        }
+
+        voice_unlink(m, quiet);
+        opl_silence(&m->opl, quiet);
+        music_stats.voices_cut++;
+    }
+}
+
+/* Adapt the voice cap to the time the last block took to render */
+static void shed_update(midi_state_t *m, uint32_t us)
+{
+    int cap;
+
+    if (us > music_stats.worst_us)
+        music_stats.worst_us = us;
+    if (!shed_budget_us)
+        return;
+
+    if (us > shed_budget_us)
+    {
+        music_stats.late++;
+        shed_calm = 0;
+
+        cap = __builtin_popcount(m->voices_used);
+        if (cap > voice_limit(m))
+            cap = voice_limit(m);
+        if (--cap < SHED_MIN_VOICES)
+            return;
+
+        m->voice_cap = cap;
+        music_stats.sheds++;
+        shed_voices(m);
+    }
+    else if (m->voice_cap &&
+             us * 100 < (uint32_t)BLOCK_US * SHED_RESTORE_PCT)
+    {
+        if (++shed_calm < SHED_RESTORE_BLOCKS)
+            return;
+
+        shed_calm = 0;
+        m->voice_cap = (m->voice_cap + 1 < MAX_VOICES) ? m->voice_cap + 1 : 0;
+        music_stats.restores++;
+    }
+    else
+    {
+        shed_calm = 0;
+    }
+}
+
+/* ==================== MIDI Note Handling ==================== */
+
+static void midi_note_off(midi_state_t *m, int ch, int note);
+
+static void midi_note_on(midi_state_t *m, int ch, int note, int velocity)
+{
+    int                slot, instr_idx, real_note, block;
+    int                combined_vol, vol_atten;
+    const opl_patch_t *patch;
+
+    note &= 0x7F;
+    if (velocity == 0)
+    {
+        midi_note_off(m, ch, note);
+        return;
+    }
+
+    if (genmidi_loaded != 1)
+        return;
+
+    /* Select instrument */
+    if (m->chan[ch].is_drum)
+    {
+        instr_idx = 128 + (note - 35);
+        if (instr_idx < 128 || instr_idx >= GENMIDI_NUM_INSTRS)
+            return;
+    }
+    else
+    {
+        instr_idx = m->chan[ch].program;
+        if (instr_idx >= 128) instr_idx = 0;
+    }
+
+    patch = &genmidi_patches[instr_idx];
+
+    /* Allocate OPL channel */
+    slot = alloc_voice(m, ch);
+
+    /* Program OPL */
+    opl_prog_patch(&m->opl, slot, patch);
+
+    /* Calculate note, with the base note offset and fine tuning */
+    real_note  = patch->fixed ? patch->fixed_note : note;
+    real_note += patch->note_offset;
+
+    if (real_note < 0)   real_note = 0;
+    if (real_note > 127) real_note = 127;
+
+    /* Calculate block (octave), OPL2 range 0-7 */
+    block = real_note / 12;
+    if (block > 7) block = 7;
+
+    /* Calculate volume attenuation */
+    combined_vol = (velocity * m->chan[ch].volume * m->chan[ch].expression)
+                   / (127 * 127);
+    if (combined_vol > 127) combined_vol = 127;
+    if (combined_vol < 0)   combined_vol = 0;
+
+    /* Map to OPL attenuation: 0=loud, ~48=quiet */
+    vol_atten = ((127 - combined_vol) * 48) / 127;
+
+    m->opl.chan[slot].vol_atten = vol_atten;
+
+    opl_set_freq(&m->opl, slot, fnumber_table[real_note % 12], block);
+    if (!note_cache_play(&m->opl, slot, instr_idx))
+        opl_key_on(&m->opl, slot);
+
+    /* Record voice info */
+    m->voices[slot].midi_ch     = ch;
+    m->voices[slot].note        = note;
+    m->voices[slot].opl_ch      = slot;
+    voice_link(m, slot);
+}
+
+/* Releases the lowest voice playing the note */
+static void midi_note_off(midi_state_t *m, int ch, int note)
+{
+    int slot = m->note_voice[ch][note & 0x7F];
+
+    if (slot)
+        voice_stop(m, slot - 1);
+}
+
+static void midi_control_change(midi_state_t *m, int ch, int cc, int val)
+{
+    switch (cc)
+    {
+    case 7:  m->chan[ch].volume = val; break;
+    case 10: m->chan[ch].pan = val; break;
+    case 11: m->chan[ch].expression = val; break;
+    case 64: break; /* sustain pedal - ignore */
+    case 121:
+        m->chan[ch].volume     = 100;
+        m->chan[ch].pan        = 64;
+        m->chan[ch].expression = 127;
+        m->chan[ch].pitch_bend = 0;
+        break;
+    case 120:
+    case 123:
+        while (m->chan_voices[ch])
+            voice_stop(m, __builtin_ctz(m->chan_voices[ch]));
+        break;
+    }
+}
+
+static void midi_program_change(midi_state_t *m, int ch, int prog)
+{
+    m->chan[ch].program = prog & 0x7F;
+}
+
+/* ==================== MIDI Timing ==================== */
+
+static void midi_calc_timing(midi_state_t *m)
+{
+    uint64_t sample_len;
+
+    if (m->ticks_per_beat == 0)
+        m->ticks_per_beat = 140;
+    if (m->us_per_beat == 0)
+        m->us_per_beat = 500000;
+
+    /* At least a sample per tick */
+    sample_len  = 1000000ull * m->ticks_per_beat;
+    m->tick_len = (uint64_t)m->us_per_beat * OUTPUT_RATE;
+    if (m->tick_len < sample_len)
+        m->tick_len = sample_len;
+}
+
+/* ==================== Song Cache ==================== */
+
+/*
+ * Restarting a level or reloading a save registers the same song again.
+ * Parsed songs are kept here, keyed by a hash of the lump, so that
+ * I_RegisterSong() only has to point 'midi' back at the stream. Songs
+ * not registered right now are dropped in LRU order to stay within
+ * SONG_CACHE_MAX_BYTES; 0 parses every song again.
+ */
+
+#ifndef SONG_CACHE_MAX_BYTES
+#define SONG_CACHE_MAX_BYTES    (128 * 1024)
+#endif
+
+#define SONG_CACHE_SLOTS        16
+
+/* A parsed song, cached or not */
+typedef struct {
+    uint8_t    *stream;             /* NULL for a free slot */
+    int         stream_len;
+    int         num_events;
+    uint16_t    ticks_per_beat;
+    uint32_t    start_us_per_beat;
+    uint32_t    hash;               /* of the lump */
+    int         lump_len;
+    uint32_t    last_used;
+} song_t;
+
+static song_t        song_cache[SONG_CACHE_SLOTS];
+static song_t       *song_current = NULL;   /* owns midi.stream */
+static uint32_t      song_bytes   = 0;
+static uint32_t      song_clock   = 0;
+
+static void song_free(song_t *e)
+{
+    song_bytes -= e->stream_len;
+    free(e->stream);
+    e->stream = NULL;
+}
+
+/* Let go of midi.stream, freeing it unless the cache holds it */
+static void song_release(void)
+{
+    if (!song_current)
+        free(midi.stream);
+    song_current    = NULL;
+    midi.stream     = NULL;
+    midi.stream_len = 0;
+    midi.num_events = 0;
+}
+
+/* Point 'midi' at a song; 'midi' owns it unless it's a cache entry */
+static void song_load(song_t *e)
+{
+    song_release();
+    if (e >= song_cache && e < song_cache + SONG_CACHE_SLOTS)
+    {
+        song_current = e;
+        e->last_used = ++song_clock;
+    }
+    midi.stream            = e->stream;
+    midi.stream_len        = e->stream_len;
+    midi.num_events        = e->num_events;
+    midi.ticks_per_beat    = e->ticks_per_beat;
+    midi.start_us_per_beat = e->start_us_per_beat;
+    midi.us_per_beat       = 500000;
+    midi_calc_timing(&midi);
+}
+
+static song_t *song_find(uint32_t hash, int len)
+{
+    int i;
+
+    for (i = 0; i < SONG_CACHE_SLOTS; i++)
+    {
+        song_t *e = &song_cache[i];
+
+        if (e->stream && e->hash == hash && e->lump_len == len)
+            return e;
+    }
+    return NULL;
+}
+
+/* Move a parsed song into the cache; NULL if it doesn't fit, and then
+ * 'song' keeps it */
+static song_t *song_store(song_t *song)
+{
+    song_t *e;
+    int     i;
+
+    if (song->stream_len > SONG_CACHE_MAX_BYTES)
+        return NULL;
+
+    for (;;)
+    {
+        song_t *lru  = NULL;
+        song_t *slot = NULL;
+
+        for (i = 0; i < SONG_CACHE_SLOTS; i++)
+        {
+            e = &song_cache[i];
+            if (!e->stream)
+                slot = e;
+            else if (e != song_current &&
+                     (!lru || e->last_used < lru->last_used))
+                lru = e;
+        }
+
+        if (slot && song_bytes + song->stream_len <= SONG_CACHE_MAX_BYTES)
+        {
+            e = slot;
+            break;
+        }
+        if (!lru)
+            return NULL;
+        song_free(lru);
+    }
+
+    *e           = *song;
+    e->last_used = ++song_clock;
+    song_bytes  += e->stream_len;
+    song->stream = NULL;
+    return e;
+}
+
+static void song_cache_free(void)
+{
+    int i;
+
+    song_release();
+    for (i = 0; i < SONG_CACHE_SLOTS; i++)
+        if (song_cache[i].stream)
+            song_free(&song_cache[i]);
+}
+
+/* ==================== MIDI Parser ==================== */
+
+/*
+ * parse_midi() and parse_mus() collect events in parse-time form, then
+ * merge them into song->stream, a packed byte stream sized to the song.
+ * Records are:
+ *
+ *   MIDI_PK_WAIT  var-len       advance this many ticks
+ *   MIDI_PK_TEMPO 3 bytes       microseconds per beat, big-endian
+ *   0x8n note                   note off (and note on at velocity 0)
+ *   0x9n note velocity          note on
+ *   0xBn controller value       control change
+ *   0xCn program                program change
+ *   0xEn lsb msb                pitch bend
+ *
+ * Events the sequencer ignores are dropped here. The song still ends at
+ * the tick of the last event in the file, padded with a final wait if
+ * that event was dropped.
+ */
+
+#define MIDI_PK_WAIT        0xF0
+#define MIDI_PK_TEMPO       0xF1
+
+static midi_event_t *parse_events   = NULL;
+static int           parse_count    = 0;
+static int           parse_cap      = 0;
+static uint32_t      parse_end_tick = 0;
+
+static uint32_t read_var_len(const uint8_t *data, int *pos, int end)
+{
+    uint32_t val = 0;
+    uint8_t  b;
+    int      i;
+
+    for (i = 0; i < 4; i++)
+    {
+        if (*pos >= end) break;
+        b   = data[(*pos)++];
+        val = (val << 7) | (b & 0x7F);
+        if (!(b & 0x80)) break;
+    }
+    return val;
+}
+
+static uint8_t *write_var_len(uint8_t *p, uint32_t val)
+{
+    int shift;
+
+    for (shift = 21; shift > 0 && !(val >> shift); shift -= 7)
+        ;
+    for (; shift > 0; shift -= 7)
+        *p++ = 0x80 | ((val >> shift) & 0x7F);
+    *p++ = val & 0x7F;
+    return p;
+}
+
+/*
+ * A var-len holds 28 bits, so longer waits go out as several records.
+ * Ticks are 32-bit, which bounds the extra records per song at
+ * MIDI_WAIT_SPLITS.
+ */
+#define MIDI_WAIT_MAX       0x0FFFFFFF
+#define MIDI_WAIT_SPLITS    16
+
+static uint8_t *write_wait(uint8_t *p, uint32_t ticks)
+{
+    for (; ticks > MIDI_WAIT_MAX; ticks -= MIDI_WAIT_MAX)
+    {
+        *p++ = MIDI_PK_WAIT;
+        p = write_var_len(p, MIDI_WAIT_MAX);
+    }
+    *p++ = MIDI_PK_WAIT;
+    return write_var_len(p, ticks);
+}
+
+/* Controllers midi_control_change() acts on */
+static int midi_cc_used(int cc)
+{
+    return cc == 7 || cc == 10 || cc == 11 ||
+           cc == 120 || cc == 121 || cc == 123;
+}
+
+/* Every event read, kept or not, takes the song at least to its tick */
+static void parse_extend(uint32_t tick)
+{
+    if (tick > parse_end_tick)
+        parse_end_tick = tick;
+}
+
+/* Append a parse-time event; NULL once the song is too long */
+static midi_event_t *parse_add(uint32_t tick, int type, int ch)
+{
+    midi_event_t *ev;
+
+    if (parse_count >= parse_cap)
+    {
+        int cap = parse_cap ? parse_cap * 2 : 1024;
+
+        if (parse_cap >= MAX_MIDI_EVENTS)
+            return NULL;
+        if (cap > MAX_MIDI_EVENTS)
+            cap = MAX_MIDI_EVENTS;
+        ev = (midi_event_t *)realloc(parse_events, cap * sizeof(midi_event_t));
+        if (!ev)
+            return NULL;
+        parse_events = ev;
+        parse_cap    = cap;
+    }
+
+    ev = &parse_events[parse_count++];
+    ev->tick    = tick;
+    ev->type    = type;
+    ev->channel = ch;
+    ev->data1   = 0;
+    ev->data2   = 0;
+    ev->tempo   = 0;
+    return ev;
+}
+
+/* Append a control change, unless it's ignored */
+static int parse_add_control(uint32_t tick, int ch, int cc, int val)
+{
+    midi_event_t *ev;
+
+    if (!midi_cc_used(cc))
+        return 1;
+
+    ev = parse_add(tick, MIDI_EV_CONTROL, ch);
+    if (!ev)
+        return 0;
+    ev->data1 = cc;
+    ev->data2 = val;
+    return 1;
+}
+
+/* Each MTrk is already in tick order, so the tracks are merged rather
+ * than sorted. The heap holds one run per track that still has events,
+ * keyed by the tick of its next event; ties go to the earlier track so
+ * simultaneous events keep their file order. */
+typedef struct {
+    int     pos;        /* next event of the run */
+    int     end;
+} midi_run_t;
+
+static int run_before(const midi_run_t *runs, int a, int b)
+{
+    uint32_t ta = parse_events[runs[a].pos].tick;
+    uint32_t tb = parse_events[runs[b].pos].tick;
+
+    return ta < tb || (ta == tb && a < b);
+}
+
+static void run_sift_down(const midi_run_t *runs, int *heap, int n, int i)
+{
+    for (;;)
+    {
+        int l = 2 * i + 1, best = i, t;
+
+        if (l < n && run_before(runs, heap[l], heap[best]))
+            best = l;
+        if (l + 1 < n && run_before(runs, heap[l + 1], heap[best]))
+            best = l + 1;
+        if (best == i)
+            break;
+
+        t = heap[i]; heap[i] = heap[best]; heap[best] = t;
+        i = best;
+    }
+}
+
+static uint8_t *pack_event(uint8_t *p, const midi_event_t *ev, uint32_t *tick)
+{
+    if (ev->tick != *tick)
+    {
+        p = write_wait(p, ev->tick - *tick);
+        *tick = ev->tick;
+    }
+
+    switch (ev->type)
+    {
+    case MIDI_EV_TEMPO:
+        *p++ = MIDI_PK_TEMPO;
+        *p++ = ev->tempo >> 16;
+        *p++ = ev->tempo >> 8;
+        *p++ = ev->tempo;
+        break;
+    case MIDI_EV_NOTEOFF:
+    case MIDI_EV_PROGRAM:
+        *p++ = ev->type | ev->channel;
+        *p++ = ev->data1;
+        break;
+    default:
+        *p++ = ev->type | ev->channel;
+        *p++ = ev->data1;
+        *p++ = ev->data2;
+        break;
+    }
+    return p;
+}
+
+/* Merge the runs into song->stream */
+static int merge_tracks(song_t *song, midi_run_t *runs, int nruns)
+{
+    uint8_t  *out, *p;
+    int      *heap;
+    int       i, n;
+    uint32_t  tick = 0;
+
+    /* A wait record takes at most 5 bytes and an event at most 4 */
+    out  = (uint8_t *)malloc(parse_count * 9 + 5 + MIDI_WAIT_SPLITS * 5);
+    heap = (int *)malloc((nruns > 0 ? nruns : 1) * sizeof(int));
+    if (!out || !heap)
+    {
+        free(out);
+        free(heap);
+        return 0;
+    }
+
+    n = 0;
+    for (i = 0; i < nruns; i++)
+        if (runs[i].pos < runs[i].end)
+            heap[n++] = i;
+    for (i = n / 2 - 1; i >= 0; i--)
+        run_sift_down(runs, heap, n, i);
+
+    p = out;
+    while (n > 0)
+    {
+        midi_run_t         *r  = &runs[heap[0]];
+        const midi_event_t *ev = &parse_events[r->pos++];
+
+        if (ev->type == MIDI_EV_TEMPO && ev->tick == 0 &&
+            song->start_us_per_beat == 0)
+            song->start_us_per_beat = ev->tempo;
+
+        p = pack_event(p, ev, &tick);
+        if (r->pos == r->end)
+            heap[0] = heap[--n];
+        run_sift_down(runs, heap, n, 0);
+    }
+
+    if (parse_end_tick > tick)
+    {
+        p = write_wait(p, parse_end_tick - tick);
+    }
+
+    free(heap);
+
+    song->stream_len = (int)(p - out);
+    song->stream     = (uint8_t *)realloc(out, song->stream_len ? song->stream_len : 1);
+    if (!song->stream)
+        song->stream = out;
+    return 1;
+}
+
+static void parse_begin(song_t *song)
+{
+    memset(song, 0, sizeof(*song));
+    song->ticks_per_beat = 120;
+
+    parse_count    = 0;
+    parse_end_tick = 0;
+}
+
+/* Merge the collected runs into song->stream and drop the parse-time
+ * events; a song without events is freed */
+static int parse_end(song_t *song, midi_run_t *runs, int nruns)
+{
+    song->num_events = parse_count;
+    if (!merge_tracks(song, runs, nruns))
+        song->num_events = 0;
+
+    free(parse_events);
+    parse_events = NULL;
+    parse_count  = 0;
+    parse_cap    = 0;
+
+    if (song->num_events == 0)
+    {
+        free(song->stream);
+        song->stream     = NULL;
+        song->stream_len = 0;
+    }
+    return song->num_events;
+}
+
+static int parse_midi(song_t *song, const uint8_t *data, int len)
+{
+    int         pos, ntracks, track, nruns, n;
+    uint16_t    division;
+    midi_run_t *runs;
+
+    parse_begin(song);
+
+    if (len < 14 || memcmp(data, "MThd", 4) != 0)
+        return 0;
+
+    pos = 8;
+    pos += 2;  /* skip format */
+
+    ntracks  = (data[pos] << 8) | data[pos+1]; pos += 2;
+    division = (data[pos] << 8) | data[pos+1]; pos += 2;
+
+    if (division & 0x8000)
+        song->ticks_per_beat = 120;
+    else if (division > 0)
+        song->ticks_per_beat = division;
+    else
+        song->ticks_per_beat = 120;
+
+    runs = (midi_run_t *)malloc((ntracks > 0 ? ntracks : 1) * sizeof(midi_run_t));
+    if (!runs) return 0;
+    nruns = 0;
+
+    for (track = 0; track < ntracks && pos + 8 <= len; track++)
+    {
+        int      trk_len, trk_end;
+        uint32_t abs_tick = 0;
+        uint8_t  running  = 0;
+        int      first    = parse_count;
+
+        if (memcmp(&data[pos], "MTrk", 4) != 0)
+        {
+            /* Skip unknown chunk */
+            int clen = (data[pos+4]<<24)|(data[pos+5]<<16)|
+                       (data[pos+6]<<8)|data[pos+7];
+            pos += 8 + clen;
+            continue;
+        }
+
+        trk_len = (data[pos+4]<<24)|(data[pos+5]<<16)|
+                  (data[pos+6]<<8)|data[pos+7];
+        pos += 8;
+        trk_end = pos + trk_len;
+        if (trk_end > len) trk_end = len;
+
+        while (pos < trk_end)
+        {
+            uint32_t     delta;
+            uint8_t      st, type, ch_n;
+            midi_event_t *ev;
+
+            delta     = read_var_len(data, &pos, trk_end);
+            abs_tick += delta;
+
+            if (pos >= trk_end) break;
+
+            st = data[pos];
+            if (st & 0x80)
+            {
+                running = st;
+                pos++;
+            }
+            else
+            {
+                st = running;
+            }
+
+            if (st == 0) break;
+
+            parse_extend(abs_tick);
+            type = st & 0xF0;
+            ch_n = st & 0x0F;
+
+            switch (type)
+            {
+            case 0x80: /* Note off */
+            case 0x90: /* Note on */
+                if (pos + 1 < trk_end)
+                {
+                    int note = data[pos++];
+                    int vel  = data[pos++];
+
+                    if (type == 0x90 && vel > 0)
+                    {
+                        ev = parse_add(abs_tick, MIDI_EV_NOTEON, ch_n);
+                        if (!ev) goto trk_done;
+                        ev->data2 = vel;
+                    }
+                    else
+                    {
+                        ev = parse_add(abs_tick, MIDI_EV_NOTEOFF, ch_n);
+                        if (!ev) goto trk_done;
+                    }
+                    ev->data1 = note;
+                }
+                break;
+
+            case 0xA0: /* Poly aftertouch */
+                pos += 2;
+                break;
+
+            case 0xB0: /* Control change */
+                if (pos + 1 < trk_end)
+                {
+                    int cc  = data[pos++];
+                    int val = data[pos++];
+
+                    if (!parse_add_control(abs_tick, ch_n, cc, val))
+                        goto trk_done;
+                }
+                break;
+
+            case 0xC0: /* Program change */
+                if (pos < trk_end)
+                {
+                    ev = parse_add(abs_tick, MIDI_EV_PROGRAM, ch_n);
+                    if (!ev) goto trk_done;
+                    ev->data1 = data[pos++];
+                }
+                break;
+
+            case 0xD0: /* Channel pressure */
+                pos += 1;
+                break;
+
+            case 0xE0: /* Pitch bend */
+                if (pos + 1 < trk_end)
+                {
+                    ev = parse_add(abs_tick, MIDI_EV_PITCHBEND, ch_n);
+                    if (!ev) goto trk_done;
+                    ev->data1 = data[pos++];
+                    ev->data2 = data[pos++];
+                }
+                break;
+
+            case 0xF0: /* System / Meta */
+                if (st == 0xFF)
+                {
+                    uint8_t  meta;
+                    uint32_t mlen;
+
+                    if (pos >= trk_end) goto trk_done;
+                    meta = data[pos++];
+                    mlen = read_var_len(data, &pos, trk_end);
+
+                    if (meta == 0x51 && mlen == 3 && pos + 3 <= trk_end)
+                    {
+                        uint32_t t = ((uint32_t)data[pos]<<16)|
+                                     ((uint32_t)data[pos+1]<<8)|
+                                      (uint32_t)data[pos+2];
+                        if (t == 0) t = 500000;
+
+                        ev = parse_add(abs_tick, MIDI_EV_TEMPO, 0);
+                        if (!ev) goto trk_done;
+                        ev->tempo = t;
+                    }
+                    else if (meta == 0x2F)
+                    {
+                        pos += mlen;
+                        goto trk_done;
+                    }
+
+                    pos += mlen;
+                    running = 0;
+                }
+                else if (st == 0xF0 || st == 0xF7)
+                {
+                    uint32_t slen = read_var_len(data, &pos, trk_end);
+                    pos += slen;
+                    running = 0;
+                }
+                else
+                {
+                    pos++;
+                }
+                break;
+
+            default:
+                pos++;
+                break;
+            }
+        }
+
+trk_done:
+        pos = trk_end;
+
+        runs[nruns].pos = first;
+        runs[nruns].end = parse_count;
+        nruns++;
+    }
+
+    n = parse_end(song, runs, nruns);
+    free(runs);
+    return n;
+}
+
+/*
+ * MUS lumps are decoded straight from the WAD into the same events
+ * mus2mid and parse_midi() would make of them: 70 ticks per beat at the
+ * default tempo (140 Hz), MUS channel 15 on the MIDI drum channel and
+ * the others on MIDI channels in order of first use, skipping 9.
+ */
+
+#define MUS_HEADER_SIZE     16
+#define MUS_PERCUSSION      15
+
+static const uint8_t mus_controllers[15] = {
+    0x00, 0x20, 0x01, 0x07, 0x0A, 0x0B, 0x5B, 0x5D,
+    0x40, 0x43, 0x78, 0x7B, 0x7E, 0x7F, 0x79
+};
+
+static int parse_mus(song_t *song, const uint8_t *data, int len)
+{
+    int8_t        chan_map[16];
+    uint8_t       velocity[16];
+    int           pos, i, next_ch = 0;
+    uint32_t      tick = 0;
+    midi_run_t    run;
+    midi_event_t *ev;
+
+    parse_begin(song);
+    song->ticks_per_beat = 70;
+
+    if (len < MUS_HEADER_SIZE || memcmp(data, "MUS\x1A", 4) != 0)
+        return 0;
+
+    for (i = 0; i < 16; i++)
+    {
+        chan_map[i] = -1;
+        velocity[i] = 127;
+    }
+
+    pos = data[6] | (data[7] << 8);     /* score start */
+
+    while (pos < len)
+    {
+        int desc = data[pos++];
+        int mus  = desc & 0x0F;
+        int ch, a, b;
+
+        parse_extend(tick);
+        if (mus == MUS_PERCUSSION)
+        {
+            ch = 9;
+        }
+        else
+        {
+            if (chan_map[mus] < 0)
+            {
+                if (next_ch == 9)
+                    next_ch++;
+                chan_map[mus] = next_ch++;
+            }
+            ch = chan_map[mus];
+        }
+
+        switch ((desc >> 4) & 7)
+        {
+        case 0: /* Release note */
+            if (pos >= len) goto score_end;
+            ev = parse_add(tick, MIDI_EV_NOTEOFF, ch);
+            if (!ev) goto score_end;
+            ev->data1 = data[pos++] & 0x7F;
+            break;
+
+        case 1: /* Play note, with a new velocity if bit 7 is set */
+            if (pos >= len) goto score_end;
+            a = data[pos++];
+            if (a & 0x80)
+            {
+                if (pos >= len) goto score_end;
+                velocity[mus] = data[pos++] & 0x7F;
+            }
+            ev = parse_add(tick, velocity[mus] ? MIDI_EV_NOTEON
+                                               : MIDI_EV_NOTEOFF, ch);
+            if (!ev) goto score_end;
+            ev->data1 = a & 0x7F;
+            ev->data2 = velocity[mus];
+            break;
+
+        case 2: /* Pitch wheel, 8 bits centred on 128 */
+            if (pos >= len) goto score_end;
+            a = data[pos++];
+            ev = parse_add(tick, MIDI_EV_PITCHBEND, ch);
+            if (!ev) goto score_end;
+            ev->data1 = (a & 1) << 6;
+            ev->data2 = a >> 1;
+            break;
+
+        case 3: /* System event: a valueless controller */
+            if (pos >= len) goto score_end;
+            a = data[pos++];
+            if (a >= 10 && a <= 14 &&
+                !parse_add_control(tick, ch, mus_controllers[a], 0))
+                goto score_end;
+            break;
+
+        case 4: /* Controller; 0 is the instrument */
+            if (pos + 1 >= len) goto score_end;
+            a = data[pos++];
+            b = data[pos++];
+            if (a == 0)
+            {
+                ev = parse_add(tick, MIDI_EV_PROGRAM, ch);
+                if (!ev) goto score_end;
+                ev->data1 = b;
+            }
+            else if (a <= 9 &&
+                     !parse_add_control(tick, ch, mus_controllers[a],
+                                        b & 0x80 ? 0x7F : b))
+            {
+                goto score_end;
+            }
+            break;
+
+        default: /* Score end, or an event mus2mid rejects */
+            goto score_end;
+        }
+
+        if (desc & 0x80)
+        {
+            uint32_t delay = 0;
+
+            do
+            {
+                if (pos >= len) goto score_end;
+                a = data[pos++];
+                delay = (delay << 7) | (a & 0x7F);
+            } while (a & 0x80);
+            tick += delay;
+        }
+    }
+
+score_end:
+    run.pos = 0;
+    run.end = parse_count;
+    return parse_end(song, &run, 1);
+}
+
+/* ==================== Song Preparation ==================== */
+
+/*
+ * With the worker running, I_RegisterSong() hands the lump to it and
+ * returns at once, and I_PlaySong() on a song still being prepared
+ * starts it as soon as it's ready. I_PrefetchSong() uses the same job to
+ * parse the next map's music during the intermission, so registering it
+ * at level start is a song cache hit. One song is prepared at a time:
+ * the game thread fills in the job, the worker owns it while queued,
+ * and the game thread picks up the result (see song_poll()).
+ */
+
+#define PREP_IDLE           0
+#define PREP_QUEUED         1
+#define PREP_DONE           2
+
+typedef struct {
+    volatile int    state;
+    const uint8_t  *data;
+    int             len;
+    uint32_t        hash;
+    int             lump;       /* locked by a prefetch, else -1 */
+    int             events;     /* parsed, 0 if not a song */
+    song_t          song;
+} song_prep_t;
+
+static song_prep_t song_prep = { PREP_IDLE, NULL, 0, 0, -1 };
+
+/* Parse a MUS or MIDI lump in place */
+static int song_parse(song_t *song, const uint8_t *data, int len)
+{
+    if (len >= 4 && memcmp(data, "MThd", 4) == 0)
+        return parse_midi(song, data, len);
+    return parse_mus(song, data, len);
+}
+
+/* Worker only */
+static void song_prep_run(void)
+{
+    if (song_prep.state != PREP_QUEUED)
+        return;
+
+    song_prep.events = song_parse(&song_prep.song, song_prep.data,
+                                  song_prep.len);
+    __sync_synchronize();
+    song_prep.state = PREP_DONE;
+}
+
+/* Process the stream record at the read position */
+static void process_event(midi_state_t *m)
+{
+    const uint8_t *p  = m->stream + m->stream_pos;
+    int            st = p[0];
+    int            ch = st & 0x0F;
+
+    switch (st & 0xF0)
+    {
+    case MIDI_EV_NOTEON:
+        midi_note_on(m, ch, p[1], p[2]);
+        m->stream_pos += 3;
+        break;
+    case MIDI_EV_NOTEOFF:
+        midi_note_off(m, ch, p[1]);
+        m->stream_pos += 2;
+        break;
+    case MIDI_EV_CONTROL:
+        midi_control_change(m, ch, p[1], p[2]);
+        m->stream_pos += 3;
+        break;
+    case MIDI_EV_PROGRAM:
+        midi_program_change(m, ch, p[1]);
+        m->stream_pos += 2;
+        break;
+    case MIDI_EV_PITCHBEND:
+        m->chan[ch].pitch_bend = (int16_t)(((p[2] << 7) | p[1]) - 8192);
+        m->stream_pos += 3;
+        break;
+    default:
+        if (st == MIDI_PK_TEMPO)
+        {
+            m->us_per_beat = ((uint32_t)p[1] << 16) | (p[2] << 8) | p[3];
+            midi_calc_timing(m);
+            m->stream_pos += 4;
+        }
+        else
+        {
+            m->stream_pos++;
+            m->next_tick += read_var_len(m->stream, &m->stream_pos,
+                                         m->stream_len);
+        }
+        break;
+    }
+}
+
+/* Advance MIDI sequencer by 'samples' output samples */
+static void midi_advance(midi_state_t *m, int samples)
+{
+    int i;
+
+    if (!m->playing || m->num_events == 0)
+        return;
+
+    m->tick_accum += (uint64_t)samples * 1000000u * m->ticks_per_beat;
+
+    while (m->tick_accum >= m->tick_len)
+    {
+        m->tick_accum -= m->tick_len;
+        m->current_tick++;
+
+        /* Process all events at this tick */
+        while (m->next_tick <= m->current_tick &&
+               m->stream_pos < m->stream_len)
+            process_event(m);
+
+        /* End of song? */
+        if (m->next_tick <= m->current_tick &&
+            m->stream_pos >= m->stream_len)
+        {
+            if (m->looping)
+            {
+                m->stream_pos    = 0;
+                m->next_tick     = 0;
+                m->current_tick  = 0;
+                m->tick_accum    = 0;
+                m->loops++;
+
+                /* Silence all voices */
+                voice_stop_all(m);
+
+                /* Reset channel state */
+                for (i = 0; i < MIDI_CHANNELS; i++)
+                {
+                    m->chan[i].volume     = 100;
+                    m->chan[i].expression = 127;
+                }
+
+                /* Reset tempo */
+                m->us_per_beat = 500000;
+                midi_calc_timing(m);
+            }
+            else
+            {
+                m->playing = 0;
+            }
+            break;
+        }
+    }
+}
+
+/* Rewind the sequencer and its OPL chip to the start of the song */
+static void midi_start(midi_state_t *m, int looping)
+{
+    int i;
+
+    m->stream_pos    = 0;
+    m->next_tick     = 0;
+    m->current_tick  = 0;
+    m->tick_accum    = 0;
+    m->looping       = looping ? 1 : 0;
+    m->loops         = 0;
+
+    m->us_per_beat = m->start_us_per_beat ? m->start_us_per_beat : 500000;
+    midi_calc_timing(m);
+
+    /* Reset voices */
+    voice_clear(m);
+    opl_reset(&m->opl);
+
+    /* Reset MIDI channels */
+    for (i = 0; i < MIDI_CHANNELS; i++)
+    {
+        m->chan[i].volume     = 100;
+        m->chan[i].pan        = 64;
+        m->chan[i].expression = 127;
+        m->chan[i].pitch_bend = 0;
+        m->chan[i].program    = 0;
+        m->chan[i].is_drum    = (i == 9) ? 1 : 0;
+    }
+}
+
+/*
+ * Samples, at most 'n', to render before the sequencer next has events
+ * to play (or the song ends), rounded up to the synth's native step so
+ * a split never falls between two samples of the chip.
+ */
+static int midi_run_length(midi_state_t *m, int n)
+{
+    uint64_t unit, span, ticks, need;
+    int      step, run;
+
+    if (!m->playing || m->num_events == 0)
+        return n;
+
+    unit  = 1000000ull * m->ticks_per_beat;
+    span  = (uint64_t)n * unit + m->tick_accum;
+    ticks = (m->next_tick > m->current_tick) ?
+            m->next_tick - m->current_tick : 1;
+    if (ticks > span / m->tick_len)
+        return n;
+
+    need = ticks * m->tick_len - m->tick_accum;
+    run  = (int)((need + unit - 1) / unit);
+
+    step = (m->opl.mode == OPL_MODE_RESAMPLED) ? 1 : 1 << m->opl.rate_shift;
+    run  = (run + step - 1) & ~(step - 1);
+    return (run < n) ? run : n;
+}
+
+/*
+ * Render 'n' music samples, before music volume, playing each event at
+ * its own sample: the block is split at event boundaries instead of
+ * playing the whole block's events at its start. Returns the sample the
+ * song looped back at, where its next pass starts, or -1 if it didn't.
+ */
+static int midi_render(midi_state_t *m, int32_t *out, int n)
+{
+    int run, done = 0, wrap = -1;
+
+    while (done < n)
+    {
+        int loops = m->loops;
+
+        run = midi_run_length(m, n - done);
+        opl_gen_music(&m->opl, out + done, run);
+        midi_advance(m, run);
+        done += run;
+        if (m->loops != loops)
+            wrap = done;
+    }
+    return wrap;
+}
+
+/* ==================== Music Cache ==================== */
+
+/*
+ * MUS tracks loop endlessly, so after I_RegisterSong() a low-priority
+ * worker renders one loop of the song to PCM, block by block exactly as
+ * the audio thread would. Once the whole loop is in the cache, playback
+ * streams from it instead of running the synth: anywhere in the first
+ * loop (where both are identical), otherwise at the next loop start.
+ * The loop ends at the sample the song wrapped at (see midi_render()),
+ * not at the end of that block, so no sample of the next pass repeats.
+ * Songs that don't fit in MUSIC_CACHE_MAX_BYTES stay on live synthesis;
+ * 0 (or less than a chunk) turns the cache off.
+ */
+
+#ifndef MUSIC_CACHE_MAX_BYTES
+#define MUSIC_CACHE_MAX_BYTES   (8 * 1024 * 1024)
+#endif
+
+#define MUSIC_CACHE_CHUNK       65536   /* samples, a multiple of MIX_SAMPLES */
+#define MUSIC_CACHE_FIT_CHUNKS  (MUSIC_CACHE_MAX_BYTES / (MUSIC_CACHE_CHUNK * 2))
+#define MUSIC_CACHE_MAX_CHUNKS  (MUSIC_CACHE_FIT_CHUNKS > 0 ? MUSIC_CACHE_FIT_CHUNKS : 1)
+
+#define MCACHE_IDLE         0
+#define MCACHE_RENDERING    1
+#define MCACHE_COMPLETE     2
+#define MCACHE_FAILED       3   /* too long or out of memory */
+
+typedef struct {
+    int16_t            *chunk[MUSIC_CACHE_MAX_CHUNKS];
+    volatile uint32_t   rendered;   /* samples from the song start */
+    volatile uint32_t   loop_len;   /* samples per loop, once complete */
+    volatile int        state;
+    volatile int        abort;
+
+    midi_state_t        seq;        /* worker-owned sequencer */
+    int32_t             block[MIX_SAMPLES];
+} music_cache_t;
+
+static music_cache_t     mcache;
+
+/* The worker's sequencer plays notes on the thread that changes the
+ * note cache (see Note Cache) */
+static int note_is_worker(const opl_chip_t *chip)
+{
+    return chip == &mcache.seq.opl;
+}
+
+static int note_in_use(const note_entry_t *e)
+{
+    int ch;
+
+    if (e->refs)
+        return 1;
+    for (ch = 0; ch < OPL_NUM_CHANNELS; ch++)
+        if (mcache.seq.opl.note[ch].note == e)
+            return 1;
+    return 0;
+}
+
+/* Live playback position within the loop, and whether it streams
+ * (music job only, see Music Thread) */
+static uint32_t          music_pos       = 0;
+static int               music_streaming = 0;
+
+static void music_cache_free(void)
+{
+    int i;
+
+    for (i = 0; i < MUSIC_CACHE_MAX_CHUNKS; i++)
+    {
+        if (mcache.chunk[i])
+        {
+            free(mcache.chunk[i]);
+            mcache.chunk[i] = NULL;
+        }
+    }
+    mcache.rendered = 0;
+    mcache.loop_len = 0;
+}
+
+/* Render one loop of the registered song into the cache */
+static void music_cache_render(void)
+{
+    midi_state_t *seq = &mcache.seq;
+    int           i, n, wrap;
+
+    while (!mcache.abort)
+    {
+        uint32_t pos = mcache.rendered;
+        int      ci  = pos / MUSIC_CACHE_CHUNK;
+        int16_t *dst;
+
+        if (pos % MUSIC_CACHE_CHUNK == 0)
+        {
+            if (ci >= MUSIC_CACHE_MAX_CHUNKS ||
+                !(mcache.chunk[ci] = malloc(MUSIC_CACHE_CHUNK * sizeof(int16_t))))
+            {
+                /* Doesn't fit: keep playing it live */
+                mcache.state = MCACHE_FAILED;
+                music_cache_free();
+                return;
+            }
+        }
+        dst = mcache.chunk[ci] + pos % MUSIC_CACHE_CHUNK;
+
+        song_prep_run();
+        note_cache_fill();
+        wrap = midi_render(seq, mcache.block, MIX_SAMPLES);
+        n    = (wrap >= 0) ? wrap : MIX_SAMPLES;
+
+        for (i = 0; i < n; i++)
+            dst[i] = (int16_t)mcache.block[i];
+
+        mcache.rendered = pos + n;
+
+        /* The loop ends at the sample the song wrapped at */
+        if (wrap >= 0)
+        {
+            mcache.loop_len = mcache.rendered;
+            __sync_synchronize();
+            mcache.state = MCACHE_COMPLETE;
+            return;
+        }
+    }
+}
+
+/* Start caching the song just registered in 'midi' */
+static void music_cache_start(void)
+{
+    if (mcache_sema < 0 || MUSIC_CACHE_FIT_CHUNKS == 0)
+        return;
+
+    /* Give back the cached notes the last song left playing */
+    opl_reset(&mcache.seq.opl);
+    memset(&mcache.seq, 0, sizeof(mcache.seq));
+    mcache.seq.stream            = midi.stream;
+    mcache.seq.stream_len        = midi.stream_len;
+    mcache.seq.num_events        = midi.num_events;
+    mcache.seq.ticks_per_beat    = midi.ticks_per_beat;
+    mcache.seq.start_us_per_beat = midi.start_us_per_beat;
+    midi_start(&mcache.seq, 1);
+    mcache.seq.playing = 1;
+
+    mcache.rendered = 0;
+    mcache.loop_len = 0;
+    mcache.state    = MCACHE_RENDERING;
+    sceKernelSignalSema(mcache_sema, 1);
+}
+
+/* ==================== Baked Music ==================== */
+
+/*
+ * Songs pre-rendered on the host by tools/musbake are stored as IMA
+ * ADPCM (4 bits per sample) in MUSIC_BAKED_DIR, named after a hash of
+ * the MUS lump. When I_RegisterSong() finds one, playback streams it
+ * instead of synthesizing: the worker thread refills a ring of ADPCM
+ * blocks with large sequential reads and the audio thread only decodes.
+ *
+ * File layout: baked_header_t, then blocks of BAKED_BLOCK_SAMPLES
+ * samples, each a 4-byte decoder state followed by packed nibbles
+ * (low nibble first). The stream loops from loop_start to loop_end.
+ */
+
+#ifndef MUSIC_BAKED_DIR
+#define MUSIC_BAKED_DIR         "music"
+#endif
+
+#define BAKED_MAGIC             "BMUS"
+#define BAKED_VERSION           1
+#define BAKED_BLOCK_SAMPLES     1024
+#define BAKED_BLOCK_BYTES       (4 + BAKED_BLOCK_SAMPLES / 2)
+#define BAKED_RING_BLOCKS       128     /* ~3 s of music */
+#define BAKED_READ_BLOCKS       32      /* one read, ~16 KB */
+
+typedef struct {
+    char        magic[4];
+    uint16_t    version;
+    uint16_t    block_samples;
+    uint32_t    rate;
+    uint32_t    num_samples;
+    uint32_t    loop_start;
+    uint32_t    loop_end;
+} baked_header_t;
+
+typedef struct {
+    FILE               *f;
+    baked_header_t      hdr;
+    uint32_t            end_block;  /* blocks up to loop_end */
+    uint32_t            next_block; /* next file block to read */
+    uint8_t            *ring;
+    volatile uint32_t   head;       /* blocks read (worker) */
+    volatile uint32_t   tail;       /* blocks decoded (audio thread) */
+    volatile int        active;
+
+    /* Audio thread */
+    uint32_t            pos;        /* sample position in the track */
+    int                 pcm_pos, pcm_len;
+    int16_t             pcm[BAKED_BLOCK_SAMPLES];
+} baked_stream_t;
+
+static baked_stream_t baked;
+
+static const int8_t adpcm_index_table[16] = {
+    -1, -1, -1, -1, 2, 4, 6, 8,
+    -1, -1, -1, -1, 2, 4, 6, 8
+};
+
+static const int16_t adpcm_step_table[89] = {
+        7,     8,     9,    10,    11,    12,    13,    14,    16,    17,
+       19,    21,    23,    25,    28,    31,    34,    37,    41,    45,
+       50,    55,    60,    66,    73,    80,    88,    97,   107,   118,
+      130,   143,   157,   173,   190,   209,   230,   253,   279,   307,
+      337,   371,   408,   449,   494,   544,   598,   658,   724,   796,
+      876,   963,  1060,  1166,  1282,  1411,  1552,  1707,  1878,  2066,
+     2272,  2499,  2749,  3024,  3327,  3660,  4026,  4428,  4871,  5358,
+     5894,  6484,  7132,  7845,  8630,  9493, 10442, 11487, 12635, 13899,
+    15289, 16818, 18500, 20350, 22385, 24623, 27086, 29794, 32767
+};
+
+/* Decode one nibble, updating predictor and step index */
+static inline int16_t adpcm_decode_nibble(int code, int32_t *pred, int *index)
+{
+    int32_t step = adpcm_step_table[*index];
+    int32_t diff = step >> 3;
+
+    if (code & 4) diff += step;
+    if (code & 2) diff += step >> 1;
+    if (code & 1) diff += step >> 2;
+
+    *pred += (code & 8) ? -diff : diff;
+    if (*pred >  32767) *pred =  32767;
+    if (*pred < -32768) *pred = -32768;
+
+    *index += adpcm_index_table[code];
+    if (*index < 0)  *index = 0;
+    if (*index > 88) *index = 88;
+
+    return (int16_t)*pred;
+}
+
+/* A block of 'n' samples: a 4-byte decoder state, then n/2 bytes of
+ * packed nibbles (low nibble first) */
+static void adpcm_decode_block(const uint8_t *in, int16_t *out, int n)
+{
+    int32_t pred  = (int16_t)(in[0] | (in[1] << 8));
+    int     index = in[2] > 88 ? 88 : in[2];
+    int     i;
+
+    in += 4;
+    for (i = 0; i < n; i += 2, in++)
+    {
+        out[i]     = adpcm_decode_nibble(*in & 15, &pred, &index);
+        out[i + 1] = adpcm_decode_nibble(*in >> 4, &pred, &index);
+    }
+}
+
+static int adpcm_encode_nibble(int16_t sample, int32_t *pred, int *index)
+{
+    int32_t step = adpcm_step_table[*index];
+    int32_t diff = sample - *pred;
+    int     code = 0;
+
+    if (diff < 0)
+    {
+        code = 8;
+        diff = -diff;
+    }
+    if (diff >= step)        { code |= 4; diff -= step; }
+    if (diff >= step >> 1)   { code |= 2; diff -= step >> 1; }
+    if (diff >= step >> 2)   { code |= 1; }
+
+    /* Track the decoder's state, not the input */
+    adpcm_decode_nibble(code, pred, index);
+    return code;
+}
+
+/* Encode 'len' samples into a block of 'n', padded with the last one;
+ * the encoder state carries over from block to block */
+static void adpcm_encode_block(const int16_t *pcm, int len, uint8_t *out,
+                               int n, int32_t *pred, int *index)
+{
+    int i;
+
+    out[0] = *pred & 0xFF;
+    out[1] = (*pred >> 8) & 0xFF;
+    out[2] = *index;
+    out[3] = 0;
+
+    for (i = 0; i < n; i += 2)
+    {
+        int a  = i     < len ? i     : len - 1;
+        int b  = i + 1 < len ? i + 1 : len - 1;
+        int lo = adpcm_encode_nibble(pcm[a], pred, index);
+        int hi = adpcm_encode_nibble(pcm[b], pred, index);
+
+        out[4 + i / 2] = lo | (hi << 4);
+    }
+}
+
+/* FNV-1a of the lump as passed to I_RegisterSong(), names baked files */
+static uint32_t music_lump_hash(const void *data, int len)
+{
+    const uint8_t *p = data;
+    uint32_t       h = 2166136261u;
+    int            i;
+
+    for (i = 0; i < len; i++)
+    {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void baked_close(void)
+{
+    baked.active = 0;
+    if (baked.f)
+    {
+        fclose(baked.f);
+        baked.f = NULL;
+    }
+    if (baked.ring)
+    {
+        free(baked.ring);
+        baked.ring = NULL;
+    }
+}
+
+/* Look for a baked file for this lump; 1 if one was opened */
+static int baked_open(uint32_t hash)
+{
+    static const char *dirs[] = {
+        MUSIC_BAKED_DIR,
+        "ms0:/PSP/GAME/ChexQuest/" MUSIC_BAKED_DIR,
+    };
+    char            path[128];
+    baked_header_t *h = &baked.hdr;
+    int             i;
+
+    baked_close();
+
+    for (i = 0; i < (int)(sizeof(dirs) / sizeof(dirs[0])) && !baked.f; i++)
+    {
+        snprintf(path, sizeof(path), "%s/%08x.bmu", dirs[i], (unsigned)hash);
+        baked.f = fopen(path, "rb");
+    }
+    if (!baked.f)
+        return 0;
+
+    if (fread(h, sizeof(*h), 1, baked.f) != 1 ||
+        memcmp(h->magic, BAKED_MAGIC, 4) != 0 ||
+        h->version != BAKED_VERSION ||
+        h->block_samples != BAKED_BLOCK_SAMPLES ||
+        h->rate != OUTPUT_RATE ||
+        h->loop_start >= h->loop_end || h->loop_end > h->num_samples ||
+        !(baked.ring = malloc(BAKED_RING_BLOCKS * BAKED_BLOCK_BYTES)))
+    {
+        baked_close();
+        return 0;
+    }
+
+    /* Reads are already large, skip stdio's copy */
+    setvbuf(baked.f, NULL, _IONBF, 0);
+
+    baked.end_block = (h->loop_end + BAKED_BLOCK_SAMPLES - 1) / BAKED_BLOCK_SAMPLES;
+    return 1;
+}
+
+/* Top up the ring, wrapping the file at the loop; worker or idle stream only */
+static void baked_fill(void)
+{
+    for (;;)
+    {
+        uint32_t free_blocks = BAKED_RING_BLOCKS - (baked.head - baked.tail);
+        uint32_t slot        = baked.head % BAKED_RING_BLOCKS;
+        uint32_t count       = BAKED_READ_BLOCKS;
+
+        if (free_blocks < BAKED_READ_BLOCKS)
+            break;
+
+        if (count > baked.end_block - baked.next_block)
+            count = baked.end_block - baked.next_block;
+        if (count > BAKED_RING_BLOCKS - slot)
+            count = BAKED_RING_BLOCKS - slot;
+
+        if (fread(baked.ring + slot * BAKED_BLOCK_BYTES,
+                  BAKED_BLOCK_BYTES, count, baked.f) != count)
+        {
+            /* Truncated file: leave the ring to run dry */
+            break;
+        }
+
+        __sync_synchronize();
+        baked.head       += count;
+        baked.next_block += count;
+
+        if (baked.next_block >= baked.end_block)
+        {
+            baked.next_block = baked.hdr.loop_start / BAKED_BLOCK_SAMPLES;
+            fseek(baked.f, sizeof(baked_header_t) +
+                  (long)baked.next_block * BAKED_BLOCK_BYTES, SEEK_SET);
+        }
+    }
+}
+
+/* Restart the stream from the top; the worker must not be filling */
+static void baked_rewind(void)
+{
+    baked.head       = 0;
+    baked.tail       = 0;
+    baked.next_block = 0;
+    baked.pos        = 0;
+    baked.pcm_pos    = 0;
+    baked.pcm_len    = 0;
+
+    fseek(baked.f, sizeof(baked_header_t), SEEK_SET);
+    baked_fill();
+}
+
+/* Decode 'n' samples into 'out'; returns 0 at the end of a one-shot song */
+static int baked_render(int32_t *out, int n, int looping)
+{
+    while (n > 0)
+    {
+        int k;
+
+        if (baked.pcm_pos >= baked.pcm_len)
+        {
+            uint32_t start;
+
+            if (baked.head == baked.tail)
+            {
+                /* Reader fell behind: play silence, keep position */
+                memset(out, 0, n * sizeof(*out));
+                break;
+            }
+
+            adpcm_decode_block(baked.ring + (baked.tail % BAKED_RING_BLOCKS)
+                               * BAKED_BLOCK_BYTES, baked.pcm,
+                               BAKED_BLOCK_SAMPLES);
+            baked.tail++;
+            if (baked.tail % BAKED_READ_BLOCKS == 0 && mcache_sema >= 0)
+                sceKernelSignalSema(mcache_sema, 1);
+
+            start         = baked.pos - baked.pos % BAKED_BLOCK_SAMPLES;
+            baked.pcm_pos = baked.pos - start;
+            baked.pcm_len = BAKED_BLOCK_SAMPLES;
+            if (baked.hdr.loop_end - start < BAKED_BLOCK_SAMPLES)
+                baked.pcm_len = baked.hdr.loop_end - start;
+        }
+
+        k = baked.pcm_len - baked.pcm_pos;
+        if (k > n)
+            k = n;
+        n         -= k;
+        baked.pos += k;
+        while (k--)
+            *out++ = baked.pcm[baked.pcm_pos++];
+
+        if (baked.pos >= baked.hdr.loop_end)
+        {
+            if (!looping)
+            {
+                memset(out, 0, n * sizeof(*out));
+                return 0;
+            }
+            baked.pos     = baked.hdr.loop_start;
+            baked.pcm_pos = baked.pcm_len;
+        }
+    }
+
+    return 1;
+}
+
+/* ==================== Music Worker ==================== */
+
+/*
+ * The worker holds mcache_lock from the moment it wakes until it goes
+ * back to sleep, so whoever takes the lock knows the worker is idle and
+ * can free or rewind what it works on. mcache.abort makes a long render
+ * give the lock up early.
+ */
+
+static void mcache_acquire(void)
+{
+    if (mcache_lock >= 0)
+        sceKernelWaitSema(mcache_lock, 1, NULL);
+}
+
+static void mcache_release(void)
+{
+    if (mcache_lock >= 0)
+        sceKernelSignalSema(mcache_lock, 1);
+}
+
+static int music_cache_thread(SceSize args, void *argp)
+{
+    (void)args;
+    (void)argp;
+
+    for (;;)
+    {
+        sceKernelWaitSema(mcache_sema, 1, NULL);
+        if (!snd_running)
+            break;
+
+        mcache_acquire();
+        sfx_precache_run();
+        song_prep_run();
+        note_cache_fill();
+        if (!mcache.abort && mcache.state == MCACHE_RENDERING)
+            music_cache_render();
+        if (!mcache.abort && baked.active)
+            baked_fill();
+        mcache_release();
+    }
+
+    return 0;
+}
+
+/* Stop the worker and drop the cache and baked stream; the music job
+ * must already be stopped (music_stop()) so nothing streams from them */
+static void music_cache_stop(void)
+{
+    mcache.abort = 1;
+    mcache_acquire();
+
+    mcache.state = MCACHE_IDLE;
+    music_cache_free();
+    baked_close();
+    mcache.abort = 0;
+    mcache_release();
+}
+
+/* Rewind the stopped baked stream; MUSIC_CMD_PLAY makes it active */
+static void baked_start(void)
+{
+    mcache_acquire();
+    baked_rewind();
+    mcache_release();
+}
+
+/* Render one block of music into music_buffer; returns 0 when silent.
+ * Music job only. */
+static int music_render_block(void)
+{
+    uint32_t start;
+    int      i, wrap;
+
+    if (!midi.playing)
+        return 0;
+
+    if (baked.active)
+    {
+        if (!baked_render(music_buffer, MIX_SAMPLES, midi.looping))
+            midi.playing = 0;
+
+        for (i = 0; i < MIX_SAMPLES; i++)
+            music_buffer[i] = (music_buffer[i] * midi.volume) >> 7;
+        return 1;
+    }
+
+    /* Within the first pass, or in the block a later one started in */
+    if (!music_streaming && mcache.state == MCACHE_COMPLETE &&
+        (midi.loops == 0 || music_pos <= MIX_SAMPLES))
+        music_streaming = 1;
+
+    if (music_streaming)
+    {
+        /* In runs that stop at chunk ends and at the loop's last sample */
+        for (i = 0; i < MIX_SAMPLES; )
+        {
+            const int16_t *src = mcache.chunk[music_pos / MUSIC_CACHE_CHUNK]
+                               + music_pos % MUSIC_CACHE_CHUNK;
+            uint32_t       n   = MUSIC_CACHE_CHUNK - music_pos % MUSIC_CACHE_CHUNK;
+            uint32_t       k;
+
+            if (n > mcache.loop_len - music_pos)
+                n = mcache.loop_len - music_pos;
+            if (n > (uint32_t)(MIX_SAMPLES - i))
+                n = MIX_SAMPLES - i;
+
+            for (k = 0; k < n; k++)
+                music_buffer[i + k] = (src[k] * midi.volume) >> 7;
+            i         += n;
+            music_pos += n;
+
+            if (music_pos >= mcache.loop_len)
+            {
+                music_pos = 0;
+                if (!midi.looping)
+                {
+                    midi.playing = 0;
+                    memset(music_buffer + i, 0,
+                           (MIX_SAMPLES - i) * sizeof(*music_buffer));
+                    break;
+                }
+            }
+        }
+        return 1;
+    }
+
+    /* Live synthesis; the block the song ends in still plays out */
+    start = sceKernelGetSystemTimeLow();
+    wrap  = midi_render(&midi, music_buffer, MIX_SAMPLES);
+    shed_update(&midi, sceKernelGetSystemTimeLow() - start);
+
+    /* Apply music volume */
+    for (i = 0; i < MIX_SAMPLES; i++)
+        music_buffer[i] = (music_buffer[i] * midi.volume) >> 7;
+
+    /* Samples into the pass, counted from where the song wrapped */
+    music_pos = (wrap >= 0) ? MIX_SAMPLES - wrap : music_pos + MIX_SAMPLES;
+    return 1;
+}
+
+/* ==================== Music Thread ==================== */
+
+/*
+ * Sequencing and synthesis run as a job that owns 'midi', the OPL chip
+ * and the streaming state, and renders blocks ahead of the audio thread
+ * into a single-producer ring. The game thread never touches that state:
+ * I_PlaySong() and friends post commands to a single-producer mailbox,
+ * which the job drains before each block. STOP is waited for, so the
+ * caller can free or replace what the job was playing.
+ *
+ * The song data in 'midi' (the event list) is only replaced while the
+ * job is stopped.
+ *
+ * The job runs on its own thread, above the game, and polls the ring
+ * and the mailbox every MUSIC_POLL_US rather than being woken, so the
+ * audio thread makes no syscall for it. Without a thread (host tools,
+ * or if it can't be created) the audio thread runs it inline, a block
+ * at a time, and the output is the same as rendering in place.
+ */
+
+#define MUSIC_RING_BLOCKS   4       /* ~46 ms ahead */
+#define MUSIC_POLL_US       (BLOCK_US / 4)  /* job wake-ups */
+#define MUSIC_CMD_SLOTS     16
+
+#define MUSIC_CMD_STOP      0
+#define MUSIC_CMD_PLAY      1       /* arg: looping */
+#define MUSIC_CMD_PAUSE     2
+#define MUSIC_CMD_RESUME    3
+#define MUSIC_CMD_VOLUME    4       /* arg: 0-127 */
+
+typedef struct {
+    int16_t     pcm[MIX_SAMPLES];
+    int         on;         /* 0 for silence */
+    uint32_t    epoch;      /* music_epoch when rendered */
+} music_block_t;
+
+typedef struct {
+    int         cmd;
+    int         arg;
+} music_cmd_t;
+
+static music_block_t     music_ring[MUSIC_RING_BLOCKS];
+static volatile uint32_t music_head  = 0;   /* job */
+static volatile uint32_t music_tail  = 0;   /* audio thread */
+
+/* Bumped by commands that cut the song, so the audio thread drops the
+ * blocks already rendered instead of playing them out */
+static volatile uint32_t music_epoch = 0;
+
+static music_cmd_t       music_cmds[MUSIC_CMD_SLOTS];
+static volatile uint32_t music_cmd_head = 0;    /* game thread */
+static volatile uint32_t music_cmd_tail = 0;    /* job, once executed */
+
+/* midi.playing as the job left it, and as the commands posted will
+ * leave it (game thread), for I_MusicIsPlaying() */
+static volatile int      music_playing  = 0;
+static int               music_intent   = 0;
+
+/* True when no thread runs the job and the caller may run it itself */
+static int music_job_idle(void)
+{
+    return music_thread_id < 0 && snd_thread_id < 0;
+}
+
+static void music_run_cmd(const music_cmd_t *c)
+{
+    int i;
+
+    switch (c->cmd)
+    {
+    case MUSIC_CMD_STOP:
+        midi.playing       = 0;
+        midi.stream_pos    = 0;
+        midi.next_tick     = 0;
+        midi.current_tick  = 0;
+        midi.tick_accum    = 0;
+        music_streaming    = 0;
+        music_pos          = 0;
+        baked.active       = 0;
+
+        voice_stop_all(&midi);
+        opl_reset(&midi.opl);
+
+        for (i = 0; i < MIDI_CHANNELS; i++)
+        {
+            midi.chan[i].volume     = 100;
+            midi.chan[i].pan        = 64;
+            midi.chan[i].expression = 127;
+            midi.chan[i].program    = 0;
+            midi.chan[i].pitch_bend = 0;
+        }
+        music_epoch++;
+        break;
+
+    case MUSIC_CMD_PLAY:
+        music_streaming = 0;
+        music_pos       = 0;
+        midi_start(&midi, c->arg);
+        baked.active = (baked.f != NULL);
+        midi.playing = 1;
+        music_epoch++;
+        break;
+
+    case MUSIC_CMD_PAUSE:
+        midi.playing = 0;
+        music_epoch++;
+        break;
+
+    case MUSIC_CMD_RESUME:
+        midi.playing = 1;
+        break;
+
+    case MUSIC_CMD_VOLUME:
+        midi.volume = c->arg;
+        break;
+    }
+}
+
+/* Execute the posted commands; music job only */
+static void music_run_cmds(void)
+{
+    while (music_cmd_tail != music_cmd_head)
+    {
+        __sync_synchronize();
+        music_run_cmd(&music_cmds[music_cmd_tail % MUSIC_CMD_SLOTS]);
+        music_playing = midi.playing;
+        __sync_synchronize();
+        music_cmd_tail++;
+    }
+}
+
+/* Run commands, then render up to 'max' blocks into the ring. Nothing
+ * is queued while stopped or paused, so a new song starts at once. */
+static void music_produce(int max)
+{
+    int i;
+
+    music_run_cmds();
+
+    while (max-- > 0 && midi.playing &&
+           music_head - music_tail < MUSIC_RING_BLOCKS)
+    {
+        music_block_t *b = &music_ring[music_head % MUSIC_RING_BLOCKS];
+
+        b->on = music_render_block();
+        if (b->on)
+        {
+            for (i = 0; i < MIX_SAMPLES; i++)
+                b->pcm[i] = (int16_t)music_buffer[i];
+        }
+        b->epoch = music_epoch;
+
+        __sync_synchronize();
+        music_head++;
+    }
+
+    music_playing = midi.playing;
+
+    /* No lookup into the note cache is under way past here */
+    __sync_synchronize();
+    note_quiet++;
+}
+
+/* Take the next current block into music_mix; returns 0 when silent */
+static int music_pop(void)
+{
+    while (music_tail != music_head)
+    {
+        music_block_t *b = &music_ring[music_tail % MUSIC_RING_BLOCKS];
+        int            current, on;
+        int            i;
+
+        __sync_synchronize();
+        current = (b->epoch == music_epoch);
+        on      = current && b->on;
+        if (on)
+        {
+            for (i = 0; i < MIX_SAMPLES; i++)
+                music_mix[i] = b->pcm[i];
+        }
+
+        __sync_synchronize();
+        music_tail++;
+
+        if (current)
+            return on;
+    }
+
+    /* Stopped, stale blocks only, or an underrun */
+    return 0;
+}
+
+/* Post a command; game thread only */
+static void music_post(int cmd, int arg)
+{
+    music_cmd_t *c;
+
+    while (music_cmd_head - music_cmd_tail >= MUSIC_CMD_SLOTS)
+    {
+        if (music_job_idle())
+            music_run_cmds();
+        else
+            sceKernelDelayThread(1000);
+    }
+
+    c      = &music_cmds[music_cmd_head % MUSIC_CMD_SLOTS];
+    c->cmd = cmd;
+    c->arg = arg;
+    __sync_synchronize();
+    music_cmd_head++;
+
+    if (cmd == MUSIC_CMD_PLAY || cmd == MUSIC_CMD_RESUME)
+        music_intent = 1;
+    else if (cmd == MUSIC_CMD_STOP || cmd == MUSIC_CMD_PAUSE)
+        music_intent = 0;
+}
+
+/* Whether the song plays, without waiting for the job: as the commands
+ * still queued leave it, or else as the job last published */
+static int music_is_playing(void)
+{
+    if (music_job_idle())
+        music_run_cmds();
+    if (music_cmd_tail != music_cmd_head)
+        return music_intent;
+
+    __sync_synchronize();
+    return music_playing;
+}
+
+/* Wait until the job has executed everything posted so far */
+static void music_sync(void)
+{
+    while (music_cmd_tail != music_cmd_head)
+    {
+        if (music_job_idle())
+            music_run_cmds();
+        else
+            sceKernelDelayThread(1000);
+    }
+}
+
+/* Stop the song and wait for it, leaving the song data to the caller */
+static void music_stop(void)
+{
+    music_post(MUSIC_CMD_STOP, 0);
+    music_sync();
+}
+
+static int music_thread(SceSize args, void *argp)
+{
+    (void)args;
+    (void)argp;
+
+    while (snd_running)
+    {
+        music_produce(MUSIC_RING_BLOCKS);
+        sceKernelDelayThread(MUSIC_POLL_US);
+    }
+
+    return 0;
+}
+
+/* ==================== SFX Clips ==================== */
+
+/*
+ * Each sound lump is decoded once, on its first play: the DMX header is
+ * parsed and the unsigned 8-bit samples become signed 16-bit at the
+ * mixer's scale, so the mixer only steps through them. They stay at
+ * the lump's rate, stepped through at OUTPUT_RATE; resampling them up
+ * front would take four times the memory for the same output. Lumps
+ * that aren't DMX sounds are remembered as such, so they aren't read
+ * again.
+ *
+ * With sfx_adpcm set, clips are IMA ADPCM instead, in blocks of
+ * SFX_ADPCM_BLOCK samples that each channel decodes as it reaches them.
+ * That takes a quarter of the memory of 16-bit samples, and about half
+ * that of the lump, for a block decode every SFX_ADPCM_BLOCK samples.
+ */
+
+static sfx_clip_t sfx_clip_none;
+
+/* Set before clips are built; they keep their format */
+static int        sfx_adpcm = SFX_ADPCM;
+
+static uint32_t sfx_clip_bytes(int length, int adpcm)
+{
+    if (adpcm)
+        return sizeof(sfx_clip_t) +
+               (length + SFX_ADPCM_BLOCK - 1) / SFX_ADPCM_BLOCK * SFX_ADPCM_BYTES;
+    return sizeof(sfx_clip_t) + length * sizeof(int16_t);
+}
+
+/* Encode the lump's 8-bit samples into the clip's blocks */
+static void sfx_clip_pack(sfx_clip_t *clip, const uint8_t *data)
+{
+    int16_t  pcm[SFX_ADPCM_BLOCK];
+    uint8_t *out   = (uint8_t *)(clip + 1);
+    int32_t  pred  = 0;
+    int      index = 0;
+    int      pos, i, n;
+
+    clip->pcm   = NULL;
+    clip->adpcm = out;
+
+    for (pos = 0; pos < clip->length; pos += SFX_ADPCM_BLOCK)
+    {
+        n = clip->length - pos;
+        if (n > SFX_ADPCM_BLOCK)
+            n = SFX_ADPCM_BLOCK;
+
+        for (i = 0; i < n; i++)
+            pcm[i] = (int16_t)(((int32_t)data[pos + i] - 128) << 7);
+
+        adpcm_encode_block(pcm, n, out, SFX_ADPCM_BLOCK, &pred, &index);
+        out += SFX_ADPCM_BYTES;
+    }
+}
+
+/* Decode a cached lump; NULL if out of memory */
+static sfx_clip_t *sfx_clip_build(const uint8_t *data, int len)
+{
+    sfx_clip_t *clip = &sfx_clip_none;
+    int         rate, length, i;
+
+    if (len > 8 && (data[0] | (data[1] << 8)) == 3)
+    {
+        rate   = data[2] | (data[3] << 8);
+        length = data[4] | (data[5] << 8) | (data[6] << 16) | (data[7] << 24);
+
+        if (rate == 0)
+            rate = 11025;
+        if (length > len)
+            length = len;
+        length -= 8;
+
+        if (length > 0 &&
+            (clip = malloc(sfx_clip_bytes(length, sfx_adpcm))) != NULL)
+        {
+            clip->length = length;
+            clip->step   = ((uint32_t)rate << 16) / OUTPUT_RATE;
+
+            if (sfx_adpcm)
+            {
+                sfx_clip_pack(clip, data + 8);
+            }
+            else
+            {
+                clip->pcm   = (int16_t *)(clip + 1);
+                clip->adpcm = NULL;
+                for (i = 0; i < length; i++)
+                    clip->pcm[i] = (int16_t)(((int32_t)data[8 + i] - 128) << 7);
+            }
+        }
+    }
+
+    return clip;
+}
+
+/* ==================== SFX Precache ==================== */
+
+/*
+ * I_PrecacheSounds() reads the sound lumps that fit the cache budget
+ * while the game starts up, and hands them to the music worker, which
+ * decodes the clips while loading goes on; the reads stay on the game
+ * thread as the WAD and zone code aren't thread-safe. A lump is locked
+ * PU_STATIC only until the game thread caches its clip (see
+ * sfx_precache_poll()), then left to the zone as PU_CACHE. The rest,
+ * and clips the cache evicts, are queued to the worker again when
+ * played, their lumps read again unless the zone still has them. A
+ * sound started before its clip is in waits for it on its channel (see
+ * sfx_waits). One with no room in the queue is dropped and counted in
+ * sfx_stats.
+ */
+
+#define SFX_LOAD_SLOTS      128
+
+typedef struct {
+    int             lump;
+    const uint8_t  *data;
+    int             len;
+    sfx_clip_t     *clip;       /* worker, once decoded */
+} sfx_load_t;
+
+static sfx_load_t        sfx_loads[SFX_LOAD_SLOTS];
+static volatile uint32_t sfx_load_head  = 0;    /* game thread */
+static volatile uint32_t sfx_load_tail  = 0;    /* worker, once decoded */
+static uint32_t          sfx_load_freed = 0;    /* game thread */
+static uint8_t           sfx_queued[2048];      /* lump locked till cached */
+
+static void sfx_wait_done(int lump, const sfx_clip_t *clip);
+
+/* Worker: decode what's queued */
+static void sfx_precache_run(void)
+{
+    while (sfx_load_tail != sfx_load_head)
+    {
+        sfx_load_t *l;
+
+        __sync_synchronize();
+        l       = &sfx_loads[sfx_load_tail % SFX_LOAD_SLOTS];
+        l->clip = sfx_clip_build(l->data, l->len);
+
+        __sync_synchronize();
+        sfx_load_tail++;
+    }
+}
+
+/* Game thread: read a lump and hand it to the worker; 0 if the queue
+ * is full */
+static int sfx_load_queue(int lump)
+{
+    sfx_load_t *l;
+
+    if (sfx_load_head - sfx_load_freed >= SFX_LOAD_SLOTS)
+        return 0;
+
+    l       = &sfx_loads[sfx_load_head % SFX_LOAD_SLOTS];
+    l->lump = lump;
+    l->data = W_CacheLumpNum(lump, PU_STATIC);
+    l->len  = W_LumpLength(lump);
+    sfx_queued[lump] = 1;
+    sfx_stats.bytes += l->len;
+    __sync_synchronize();
+    sfx_load_head++;
+
+    /* Without the worker, decode here; it's cached on the next poll */
+    if (mcache_thread_id < 0)
+        sfx_precache_run();
+    else
+        sceKernelSignalSema(mcache_sema, 1);
+    return 1;
+}
+
+/* Game thread: whether the worker has 'lump' to decode */
+static int sfx_loading(int lump)
+{
+    return lump >= 0 && lump < 2048 && sfx_queued[lump];
+}
+
+/* Game thread: cache the clips decoded so far, unlock their lumps and
+ * start the sounds that waited for them; one that ran out of memory is
+ * decoded again when played */
+static void sfx_precache_poll(void)
+{
+    while (sfx_load_freed != sfx_load_tail)
+    {
+        const sfx_load_t *l;
+
+        __sync_synchronize();
+        l = &sfx_loads[sfx_load_freed % SFX_LOAD_SLOTS];
+        sfx_queued[l->lump] = 0;
+        sfx_stats.bytes    -= l->len;
+        W_ReleaseLumpNum(l->lump);
+        if (l->clip)
+            sfx_cache_store(l->lump, l->clip);
+        sfx_wait_done(l->lump, l->clip);
+        sfx_load_freed++;
+    }
+}
+
+/* Game thread: wait for the worker to finish the queue */
+static void sfx_precache_flush(void)
+{
+    while (sfx_load_tail != sfx_load_head)
+    {
+        if (mcache_thread_id < 0)
+            sfx_precache_run();
+        else
+            sceKernelDelayThread(1000);
+    }
+    sfx_precache_poll();
+}
+
+/* Game thread: the lump of a sound, without erroring on missing ones */
+static int sfx_lump_num(sfxinfo_t *sfx)
+{
+    char name[16];
+
+    if (sfx->link)
+        sfx = sfx->link;
+    snprintf(name, sizeof(name), "ds%s", sfx->name);
+    return W_CheckNumForName(name);
+}
+
+/* ==================== SFX Commands ==================== */
+
+/*
+ * The audio thread owns sfx_channels. I_StartSound() and friends post
+ * commands to a single-producer queue that it applies at the top of
+ * each block, and it publishes the handle each channel plays in
+ * sfx_playing for I_SoundIsPlaying(), and the clip it reads in
+ * sfx_mixing for the cache; neither side takes a lock. The
+ * game thread remembers what it started, so a sound counts as playing
+ * from I_StartSound() on, before the mixer has picked it up. Without an
+ * audio thread (host tools) a full queue is applied by the caller.
+ */
+
+#define SFX_CMD_SLOTS       64
+
+#define SFX_CMD_START       0
+#define SFX_CMD_STOP        1
+#define SFX_CMD_PARAMS      2
+
+typedef struct {
+    int                 cmd;
+    int                 slot;
+    int                 handle;
+    const sfx_clip_t   *clip;   /* START */
+    int                 vol;    /* START, PARAMS */
+    int                 sep;
+} sfx_cmd_t;
+
+static sfx_cmd_t         sfx_cmds[SFX_CMD_SLOTS];
+static volatile uint32_t sfx_cmd_head = 0;  /* game thread */
+static volatile uint32_t sfx_cmd_tail = 0;  /* audio thread, once applied */
+
+/* Handle playing on each channel, 0 for none (audio thread) */
+static volatile int      sfx_playing[SND_CHANNELS];
+
+/* Clip each channel reads, NULL for none (audio thread) */
+static const sfx_clip_t *volatile sfx_mixing[SND_CHANNELS];
+
+/* Last handle started on each channel, and its command (game thread) */
+static int               sfx_started[SND_CHANNELS];
+static uint32_t          sfx_started_cmd[SND_CHANNELS];
+
+/* A start waiting for the worker to decode its clip (game thread) */
+typedef struct {
+    int     handle;     /* 0 for none */
+    int     lump;
+    int     vol;
+    int     sep;
+} sfx_wait_t;
+
+static sfx_wait_t        sfx_waits[SND_CHANNELS];
+
+static void sfx_reset(void)
+{
+    memset(sfx_channels, 0, sizeof(sfx_channels));
+    memset((void *)sfx_playing, 0, sizeof(sfx_playing));
+    memset((void *)sfx_mixing, 0, sizeof(sfx_mixing));
+    memset(sfx_started, 0, sizeof(sfx_started));
+    memset(sfx_waits, 0, sizeof(sfx_waits));
+    sfx_cmd_head = sfx_cmd_tail = 0;
+}
+
+static void sfx_set_gains(sfx_channel_t *ch);
+
+/* Audio thread */
+static void sfx_run_cmds(void)
+{
+    while (sfx_cmd_tail != sfx_cmd_head)
+    {
+        const sfx_cmd_t *c;
+        sfx_channel_t   *ch;
+
+        __sync_synchronize();
+        c  = &sfx_cmds[sfx_cmd_tail % SFX_CMD_SLOTS];
+        ch = &sfx_channels[c->slot];
+
+        switch (c->cmd)
+        {
+        case SFX_CMD_START:
+            ch->data   = c->clip->pcm;
+            ch->adpcm  = c->clip->adpcm;
+            ch->block  = -1;
+            ch->length = c->clip->length;
+            ch->offset = 0;
+            ch->pos    = 0;
+            ch->step   = c->clip->step;
+            ch->vol    = c->vol;
+            ch->sep    = c->sep;
+            ch->handle = c->handle;
+            ch->active = 1;
+            sfx_set_gains(ch);
+            sfx_playing[c->slot] = c->handle;
+            sfx_mixing[c->slot]  = c->clip;
+            break;
+        case SFX_CMD_STOP:
+            if (ch->active && ch->handle == c->handle)
+            {
+                ch->active = 0;
+                sfx_playing[c->slot] = 0;
+                sfx_mixing[c->slot]  = NULL;
+            }
+            break;
+        case SFX_CMD_PARAMS:
+            if (ch->active)
+            {
+                ch->vol = c->vol;
+                ch->sep = c->sep;
+            }
+            break;
+        }
+
+        __sync_synchronize();
+        sfx_cmd_tail++;
+    }
+}
+
+/* Game thread: a free slot, filled in and queued by sfx_post() */
+static sfx_cmd_t *sfx_cmd_slot(void)
+{
+    while (sfx_cmd_head - sfx_cmd_tail >= SFX_CMD_SLOTS)
+    {
+        if (snd_thread_id < 0)
+            sfx_run_cmds();
+        else
+            sceKernelDelayThread(1000);
+    }
+    return &sfx_cmds[sfx_cmd_head % SFX_CMD_SLOTS];
+}
+
+static void sfx_post(void)
+{
+    __sync_synchronize();
+    sfx_cmd_head++;
+}
+
+/* Game thread: queue a sound to start on 'slot' */
+static void sfx_start(int slot, int handle, const sfx_clip_t *clip,
+                      int vol, int sep)
+{
+    sfx_cmd_t *c = sfx_cmd_slot();
+
+    c->cmd    = SFX_CMD_START;
+    c->slot   = slot;
+    c->handle = handle;
+    c->clip   = clip;
+    c->vol    = vol;
+    c->sep    = sep;
+
+    sfx_started[slot]     = handle;
+    sfx_started_cmd[slot] = sfx_cmd_head;
+    sfx_post();
+}
+
+/* Game thread: start what waited for 'lump', now its clip is in; NULL
+ * or an unplayable clip drops it */
+static void sfx_wait_done(int lump, const sfx_clip_t *clip)
+{
+    int i;
+
+    for (i = 0; i < SND_CHANNELS; i++)
+    {
+        sfx_wait_t *w = &sfx_waits[i];
+
+        if (!w->handle || w->lump != lump)
+            continue;
+        if (sfx_started[i] == w->handle && clip && clip->length > 0)
+            sfx_start(i, w->handle, clip, w->vol, w->sep);
+        w->handle = 0;
+    }
+}
+
+/* Game thread: whether the sound last started on 'slot' still plays */
+static int sfx_slot_busy(int slot)
+{
+    int handle = sfx_started[slot];
+
+    if (!handle)
+        return 0;
+
+    /* Waiting for its clip */
+    if (sfx_waits[slot].handle == handle)
+        return 1;
+
+    /* Not applied yet */
+    if ((int32_t)(sfx_cmd_tail - sfx_started_cmd[slot]) <= 0)
+        return 1;
+
+    __sync_synchronize();
+    return sfx_playing[slot] == handle;
+}
+
+/* ==================== SFX Cache ==================== */
+
+/*
+ * Decoded clips are malloc'd outside the zone. They stay resident in
+ * LRU order up to sfx_cache_budget bytes, counted with the lumps
+ * locked for the worker to decode (see SFX Precache); past it the
+ * least recently played ones go, except those the mixer reads or a
+ * queued command will (see sfx_clip_busy()). If every clip is busy the
+ * cache stays over budget until I_UpdateSound() can trim it. sfx_stats
+ * counts hits on playable clips, misses, drops, evictions and the bytes
+ * resident (see I_GetSoundStats()).
+ */
+
+#ifndef SFX_CACHE_MAX_BYTES
+#define SFX_CACHE_MAX_BYTES     (2 * 1024 * 1024)
+#endif
+
+/* 0 keeps only the sounds playing */
+static uint32_t      sfx_cache_budget = SFX_CACHE_MAX_BYTES;
+static sfx_clip_t   *sfx_oldest       = NULL;
+static sfx_clip_t   *sfx_newest       = NULL;
+
+static void sfx_clip_unlink(sfx_clip_t *clip)
+{
+    if (clip->older) clip->older->newer = clip->newer;
+    else             sfx_oldest         = clip->newer;
+    if (clip->newer) clip->newer->older = clip->older;
+    else             sfx_newest         = clip->older;
+}
+
+static void sfx_clip_link(sfx_clip_t *clip)
+{
+    clip->older = sfx_newest;
+    clip->newer = NULL;
+    if (sfx_newest) sfx_newest->newer = clip;
+    else            sfx_oldest        = clip;
+    sfx_newest = clip;
+}
+
+/* Game thread: whether the mixer reads 'clip' or a queued command
+ * will have it do so */
+static int sfx_clip_busy(const sfx_clip_t *clip)
+{
+    uint32_t i;
+    int      c;
+
+    /* A command not in this span was applied, and shows in sfx_mixing */
+    for (i = sfx_cmd_tail; i != sfx_cmd_head; i++)
+    {
+        const sfx_cmd_t *cmd = &sfx_cmds[i % SFX_CMD_SLOTS];
+
+        if (cmd->cmd == SFX_CMD_START && cmd->clip == clip)
+            return 1;
+    }
+
+    __sync_synchronize();
+    for (c = 0; c < SND_CHANNELS; c++)
+        if (sfx_mixing[c] == clip)
+            return 1;
+    return 0;
+}
+
+static void sfx_clip_free(sfx_clip_t *clip)
+{
+    sfx_clip_unlink(clip);
+    sfx_cache[clip->lump] = NULL;
+    sfx_stats.bytes      -= sfx_clip_bytes(clip->length, clip->adpcm != NULL);
+    free(clip);
+}
+
+/* Evict idle clips, oldest first, down to the budget; never 'keep' */
+static void sfx_cache_trim(const sfx_clip_t *keep)
+{
+    sfx_clip_t *clip = sfx_oldest;
+
+    while (clip && sfx_stats.bytes > sfx_cache_budget)
+    {
+        sfx_clip_t *newer = clip->newer;
+
+        if (clip != keep && !sfx_clip_busy(clip))
+        {
+            sfx_clip_free(clip);
+            sfx_stats.evictions++;
+        }
+        clip = newer;
     }
+}
+
+/* Game thread: make a freshly decoded clip resident */
+static void sfx_cache_store(int lump, sfx_clip_t *clip)
+{
+    sfx_cache[lump] = clip;
+    if (clip == &sfx_clip_none)
+        return;
+
+    clip->lump       = lump;
+    sfx_clip_link(clip);
+    sfx_stats.bytes += sfx_clip_bytes(clip->length, clip->adpcm != NULL);
+    sfx_cache_trim(clip);
+}
 
-    midi_calc_timing();
-    return midi.num_events;
+/* Drop every clip; the mixer must be stopped */
+static void sfx_cache_free(void)
+{
+    while (sfx_oldest)
+        sfx_clip_free(sfx_oldest);
 }
 
-/* Sort events by tick (insertion sort, stable) */
-static void sort_events(void)
+/* The clip of a sound lump; NULL if unplayable or not decoded yet, in
+ * which case its lump is queued to the worker */
+static sfx_clip_t *sfx_clip(int lumpnum)
 {
-    int          i, j;
-    midi_event_t tmp;
+    sfx_clip_t *clip;
+
+    if (lumpnum < 0 || lumpnum >= 2048)
+        return NULL;
 
-    for (i = 1; i < midi.num_events; i++)
+    clip = sfx_cache[lumpnum];
+    if (clip == &sfx_clip_none)
+        return NULL;
+    if (clip)
     {
-        tmp = midi.events[i];
-        j = i - 1;
-        while (j >= 0 && midi.events[j].tick > tmp.tick)
+        sfx_stats.hits++;
+        if (clip != sfx_newest)
         {
-            midi.events[j+1] = midi.events[j];
-            j--;
+            sfx_clip_unlink(clip);
+            sfx_clip_link(clip);
         }
-        midi.events[j+1] = tmp;
     }
+    else if (!sfx_queued[lumpnum])
+    {
+        if (sfx_load_queue(lumpnum))
+            sfx_stats.misses++;
+        else
+            sfx_stats.drops++;
+    }
+
+    return clip;
 }
 
-/* Process a single MIDI event */
-static void process_event(const midi_event_t *ev)
+/* ==================== SFX Mixer ==================== */
+
+/*
+ * Channel by channel into 32-bit stereo sums, then one saturating pass
+ * into mix_buffer. Each channel's left and right gains fold together
+ * its volume, separation and sfx_volume; they are worked out once per
+ * block and ramped to across it, so volume and panning changes don't
+ * click.
+ */
+
+/* 16.16 gain of 'vol' (0-127) on a side weighted 'side' (0-255) */
+static int32_t sfx_gain(int vol, int side)
 {
-    switch (ev->type)
-    {
-    case MIDI_EV_NOTEON:
-        midi_note_on(ev->channel, ev->data1, ev->data2);
-        break;
-    case MIDI_EV_NOTEOFF:
-        midi_note_off(ev->channel, ev->data1);
-        break;
-    case MIDI_EV_CONTROL:
-        midi_control_change(ev->channel, ev->data1, ev->data2);
-        break;
-    case MIDI_EV_PROGRAM:
-        midi_program_change(ev->channel, ev->data1);
-        break;
-    case MIDI_EV_PITCHBEND:
-        midi.chan[ev->channel].pitch_bend =
-            (int16_t)(((ev->data2 << 7) | ev->data1) - 8192);
-        break;
-    case MIDI_EV_TEMPO:
-        midi.us_per_beat = ev->tempo;
-        midi_calc_timing();
-        break;
-    }
+    return (int32_t)(((uint64_t)vol * sfx_volume * side << 16) /
+                     (127 * 127 * 256));
 }
 
-/* Advance MIDI sequencer by 'samples' output samples */
-static void midi_advance(int samples)
+/* Jump straight to the gains of the channel's settings */
+static void sfx_set_gains(sfx_channel_t *ch)
 {
-    int i;
+    ch->gain_l = sfx_gain(ch->vol, 255 - ch->sep);
+    ch->gain_r = sfx_gain(ch->vol, ch->sep);
+}
 
-    if (!midi.playing || midi.num_events == 0)
-        return;
+/* Output samples stepping from 'pos' takes to reach 'end', up to 'n' */
+static int sfx_run_length(uint32_t pos, uint32_t end, uint32_t step, int n)
+{
+    uint32_t run;
 
-    midi.tick_accum += (double)samples;
+    if (pos >= end)
+        return 0;
+    run = (end - pos - 1) / step + 1;
+    return run < (uint32_t)n ? (int)run : n;
+}
+
+/* Add 'n' stereo samples stepped through 'data' from 'pos' to 'acc',
+ * the gains ramping by 'dl' and 'dr' each; the position it got to */
+static uint32_t sfx_mix_run(const int16_t *data, uint32_t pos, uint32_t step,
+                            int32_t *acc, int n, int32_t *gain_l,
+                            int32_t *gain_r, int32_t dl, int32_t dr)
+{
+    int32_t gl = *gain_l;
+    int32_t gr = *gain_r;
+    int     i;
 
-    while (midi.tick_accum >= midi.samples_per_tick)
+    if (dl == 0 && dr == 0)
     {
-        midi.tick_accum -= midi.samples_per_tick;
-        midi.current_tick++;
+        for (i = 0; i < n; i++)
+        {
+            int32_t s = data[pos >> 16];
 
-        /* Process all events at this tick */
-        while (midi.current_event < midi.num_events &&
-               midi.events[midi.current_event].tick <= midi.current_tick)
+            acc[i*2]     += (s * gl) >> 16;
+            acc[i*2 + 1] += (s * gr) >> 16;
+            pos += step;
+        }
+    }
+    else
+    {
+        for (i = 0; i < n; i++)
         {
-            process_event(&midi.events[midi.current_event]);
-            midi.current_event++;
+            int32_t s = data[pos >> 16];
+
+            gl += dl;
+            gr += dr;
+            acc[i*2]     += (s * gl) >> 16;
+            acc[i*2 + 1] += (s * gr) >> 16;
+            pos += step;
         }
+    }
 
-        /* End of song? */
-        if (midi.current_event >= midi.num_events)
-        {
-            if (midi.looping)
-            {
-                midi.current_event = 0;
-                midi.current_tick  = 0;
-                midi.tick_accum    = 0.0;
+    *gain_l = gl;
+    *gain_r = gr;
+    return pos;
+}
 
-                /* Silence all voices */
-                for (i = 0; i < MAX_VOICES; i++)
-                {
-                    if (midi.voices[i].active)
-                        opl_key_off(midi.voices[i].opl_ch);
-                    midi.voices[i].active = 0;
-                }
+/* Samples a 16.16 position reaches past the channel's offset; far more
+ * than a block steps through, however high the lump's rate */
+#define SFX_POS_SPAN        0x8000
 
-                /* Reset channel state */
-                for (i = 0; i < MIDI_CHANNELS; i++)
-                {
-                    midi.chan[i].volume     = 100;
-                    midi.chan[i].expression = 127;
-                }
+/* Add channel 'c' to 'n' stereo samples of 'acc' */
+static void sfx_mix_channel(int c, int32_t *acc, int n)
+{
+    sfx_channel_t *ch     = &sfx_channels[c];
+    uint32_t       pos, end;
+    uint32_t       step   = ch->step;
+    int32_t        gl     = ch->gain_l;
+    int32_t        gr     = ch->gain_r;
+    int32_t        to_l   = sfx_gain(ch->vol, 255 - ch->sep);
+    int32_t        to_r   = sfx_gain(ch->vol, ch->sep);
+    int32_t        dl     = 0;
+    int32_t        dr     = 0;
+    int            i, run, left;
+
+    /* Count from the current sample, so that 16.16 positions hold for
+     * clips of any length */
+    ch->offset += ch->pos >> 16;
+    pos  = ch->pos & 0xFFFF;
+    left = ch->length - ch->offset;
+    end  = (uint32_t)(left < SFX_POS_SPAN ? left : SFX_POS_SPAN) << 16;
+
+    if (gl != to_l || gr != to_r)
+    {
+        dl = (to_l - gl) / n;
+        dr = (to_r - gr) / n;
+    }
 
-                /* Reset tempo */
-                midi.us_per_beat = 500000;
-                midi_calc_timing();
-            }
-            else
+    if (!ch->adpcm)
+    {
+        run = sfx_run_length(pos, end, step, n);
+        pos = sfx_mix_run(ch->data + ch->offset, pos, step, acc, run,
+                          &gl, &gr, dl, dr);
+    }
+    else
+    {
+        /* A block at a time, each decoded as the channel gets to it */
+        for (i = 0; i < n && pos < end; i += run)
+        {
+            int      block = (ch->offset + (pos >> 16)) / SFX_ADPCM_BLOCK;
+
+            /* Where the block starts and stops past the offset; it may
+             * start before it, 'base' wrapping below zero */
+            uint32_t base  = (uint32_t)(block * SFX_ADPCM_BLOCK - ch->offset) << 16;
+            uint32_t stop  = base + (SFX_ADPCM_BLOCK << 16);
+
+            if (block != ch->block)
             {
-                midi.playing = 0;
+                adpcm_decode_block(ch->adpcm + block * SFX_ADPCM_BYTES,
+                                   ch->dec, SFX_ADPCM_BLOCK);
+                ch->block = block;
             }
-            break;
+
+            run = sfx_run_length(pos, stop < end ? stop : end, step, n - i);
+            pos = base + sfx_mix_run(ch->dec, pos - base, step, acc + i*2,
+                                     run, &gl, &gr, dl, dr);
         }
     }
+
+    ch->pos    = pos;
+    ch->gain_l = to_l;
+    ch->gain_r = to_r;
+
+    if (pos >= end)
+    {
+        ch->active     = 0;
+        sfx_playing[c] = 0;
+        sfx_mixing[c]  = NULL;
+    }
+}
+
+/* Mix a block: music (if 'music') and every playing channel */
+static void sfx_mix(int music)
+{
+    int i, c;
+
+    if (music)
+    {
+        for (i = 0; i < MIX_SAMPLES; i++)
+            mix_acc[i*2] = mix_acc[i*2 + 1] = music_mix[i];
+    }
+    else
+    {
+        memset(mix_acc, 0, sizeof(mix_acc));
+    }
+
+    for (c = 0; c < SND_CHANNELS; c++)
+        if (sfx_channels[c].active)
+            sfx_mix_channel(c, mix_acc, MIX_SAMPLES);
+
+    for (i = 0; i < MIX_SAMPLES * 2; i++)
+    {
+        int32_t s = mix_acc[i];
+
+        if (s >  32767) s =  32767;
+        if (s < -32768) s = -32768;
+        mix_buffer[i] = (int16_t)s;
+    }
 }
 
 /* ==================== Audio Thread ==================== */
@@ -1504,71 +5143,112 @@ static int audio_thread(SceSize args, void *argp)
 
     while (snd_running)
     {
-        int s, c;
+        int music;
 
-        memset(mix_buffer, 0, sizeof(mix_buffer));
+        /* Music for the whole block, made here if there's no music thread */
+        if (music_thread_id < 0)
+            music_produce(1);
+        music = music_pop();
 
-        /* Advance MIDI timing */
-        if (midi.playing)
-            midi_advance(MIX_SAMPLES);
+        sfx_run_cmds();
+        sfx_mix(music);
 
-        /* Generate audio samples */
-        for (s = 0; s < MIX_SAMPLES; s++)
-        {
-            int32_t left = 0, right = 0;
+        sceAudioOutputBlocking(psp_audio_ch, PSP_AUDIO_VOLUME_MAX, mix_buffer);
+    }
 
-            /* OPL music */
-            if (midi.playing)
-            {
-                int32_t m = opl_gen_resampled();
-                left  += m;
-                right += m;
-            }
+    return 0;
+}
 
-            /* SFX mixing */
-            sfx_lock();
-            for (c = 0; c < SND_CHANNELS; c++)
-            {
-                sfx_channel_t *ch = &sfx_channels[c];
-                int idx;
-                int32_t samp, lv, rv;
+/* ==================== Song Registration ==================== */
 
-                if (!ch->active) continue;
+static int song_waiting      = 0;   /* registered song being prepared */
+static int song_play_pending = -1;  /* its I_PlaySong() looping flag */
 
-                idx = ch->pos >> 16;
-                if (idx >= ch->length)
-                {
-                    ch->active = 0;
-                    continue;
-                }
+static void song_start(int looping)
+{
+    music_stop();
+    if (baked.f)
+        baked_start();
+    music_post(MUSIC_CMD_PLAY, looping);
+}
 
-                samp = ((int32_t)ch->data[idx] - 128) << 7;
-                ch->pos += ch->step;
+/* The registered song is now in 'midi' */
+static void song_ready(uint32_t hash)
+{
+    /* A baked copy replaces synthesis, so there's nothing to cache.
+     * Streaming needs the worker to keep the ring full. */
+    if (mcache_thread_id < 0 || !baked_open(hash))
+        music_cache_start();
 
-                samp = (samp * ch->vol * sfx_volume) / (127 * 127);
+    if (song_play_pending >= 0)
+    {
+        song_start(song_play_pending);
+        song_play_pending = -1;
+    }
+}
 
-                lv = 255 - ch->sep;
-                rv = ch->sep;
+static void song_post(const void *data, int len, uint32_t hash, int lump)
+{
+    song_prep.data = data;
+    song_prep.len  = len;
+    song_prep.hash = hash;
+    song_prep.lump = lump;
+    __sync_synchronize();
+    song_prep.state = PREP_QUEUED;
+    sceKernelSignalSema(mcache_sema, 1);
+}
 
-                left  += (samp * lv) >> 8;
-                right += (samp * rv) >> 8;
-            }
-            sfx_unlock();
+/* Take over a finished job: cache the song, and load it if it's the
+ * registered one. Game thread only. */
+static void song_poll(void)
+{
+    song_t *e = NULL;
 
-            /* Clamp */
-            if (left  >  32767) left  =  32767;
-            if (left  < -32768) left  = -32768;
-            if (right >  32767) right =  32767;
-            if (right < -32768) right = -32768;
+    if (song_prep.state != PREP_DONE)
+        return;
+    __sync_synchronize();
 
-            mix_buffer[s*2]     = (int16_t)left;
-            mix_buffer[s*2 + 1] = (int16_t)right;
-        }
+    if (song_prep.lump >= 0)
+        W_ReleaseLumpNum(song_prep.lump);
 
-        sceAudioOutputBlocking(psp_audio_ch, PSP_AUDIO_VOLUME_MAX, mix_buffer);
+    if (song_prep.events > 0)
+    {
+        song_prep.song.hash     = song_prep.hash;
+        song_prep.song.lump_len = song_prep.len;
+        e = song_store(&song_prep.song);
     }
 
-    return 0;
+    if (song_waiting)
+    {
+        song_waiting = 0;
+        if (song_prep.events > 0)
+        {
+            song_load(e ? e : &song_prep.song);
+            song_ready(song_prep.hash);
+        }
+        else
+        {
+            song_play_pending = -1;
+        }
+    }
+    else if (!e)
+    {
+        free(song_prep.song.stream);
+    }
+
+    song_prep.song.stream = NULL;
+    song_prep.state       = PREP_IDLE;
+}
+
+/* Let the job finish, keeping its song in the cache only */
+static void song_prep_flush(void)
+{
+    while (song_prep.state == PREP_QUEUED)
+        sceKernelDelayThread(1000);
+
+    song_waiting      = 0;
+    song_play_pending = -1;
+    song_poll();
 }
 
 /* ==================== Sound Interface ==================== */
@@ -1578,7 +5258,7 @@ void I_InitSound(boolean use_sfx_prefix)
     int i;
     (void)use_sfx_prefix;
 
-    memset(sfx_channels, 0, sizeof(sfx_channels));
+    sfx_reset();
 
     if (!sfx_cache_init)
     {
@@ -1587,11 +5267,11 @@ void I_InitSound(boolean use_sfx_prefix)
     }
 
     sfx_volume = 127;
-    opl_reset();
 
     memset(&midi, 0, sizeof(midi));
     midi.volume      = 127;
     midi.us_per_beat = 500000;
+    opl_reset(&midi.opl);
 
     for (i = 0; i < MIDI_CHANNELS; i++)
     {
@@ -1601,7 +5281,8 @@ void I_InitSound(boolean use_sfx_prefix)
         midi.chan[i].is_drum    = (i == 9) ? 1 : 0;
     }
 
-    sfx_sema = sceKernelCreateSema("sfx_sema", 0, 1, 1, NULL);
+    music_head     = music_tail     = 0;
+    music_cmd_head = music_cmd_tail = 0;
 
     psp_audio_ch = sceAudioChReserve(PSP_AUDIO_NEXT_CHANNEL,
                                       MIX_SAMPLES,
@@ -1609,15 +5290,44 @@ void I_InitSound(boolean use_sfx_prefix)
     if (psp_audio_ch < 0) return;
 
     snd_running = 1;
+
+    /* Music job, between the audio thread and the game; it must be up
+     * before the audio thread decides whether to run the job itself */
+    music_thread_id = sceKernelCreateThread("music", music_thread,
+                                             0x14, 0x10000,
+                                             PSP_THREAD_ATTR_USER, NULL);
+    if (music_thread_id >= 0)
+        sceKernelStartThread(music_thread_id, 0, NULL);
+
     snd_thread_id = sceKernelCreateThread("snd", audio_thread,
                                            0x12, 0x10000,
                                            PSP_THREAD_ATTR_USER, NULL);
     if (snd_thread_id >= 0)
         sceKernelStartThread(snd_thread_id, 0, NULL);
+
+    /* Music cache worker, below the game thread */
+    mcache_sema = sceKernelCreateSema("mcache_sema", 0, 0, 1000, NULL);
+    mcache_lock = sceKernelCreateSema("mcache_lock", 0, 1, 1, NULL);
+    if (mcache_sema >= 0 && mcache_lock >= 0)
+    {
+        mcache_thread_id = sceKernelCreateThread("mcache", music_cache_thread,
+                                                  0x30, 0x10000,
+                                                  PSP_THREAD_ATTR_USER, NULL);
+        if (mcache_thread_id >= 0)
+            sceKernelStartThread(mcache_thread_id, 0, NULL);
+    }
+
+    /* The worker renders the note cache */
+    if (NOTE_CACHE_MAX_BYTES > 0 && mcache_thread_id >= 0)
+        note_cache_on = 1;
 }
 
 void I_ShutdownSound(void)
 {
+    song_prep_flush();
+    sfx_precache_flush();
+    music_stop();
+    music_cache_stop();
     snd_running = 0;
 
     if (snd_thread_id >= 0)
@@ -1627,29 +5337,49 @@ void I_ShutdownSound(void)
         snd_thread_id = -1;
     }
 
-    if (psp_audio_ch >= 0)
+    if (music_thread_id >= 0)
     {
-        sceAudioChRelease(psp_audio_ch);
-        psp_audio_ch = -1;
+        sceKernelWaitThreadEnd(music_thread_id, NULL);
+        sceKernelDeleteThread(music_thread_id);
+        music_thread_id = -1;
+    }
+
+    if (mcache_thread_id >= 0)
+    {
+        sceKernelSignalSema(mcache_sema, 1);
+        sceKernelWaitThreadEnd(mcache_thread_id, NULL);
+        sceKernelDeleteThread(mcache_thread_id);
+        mcache_thread_id = -1;
     }
 
-    if (sfx_sema >= 0)
+    if (mcache_sema >= 0)
     {
-        sceKernelDeleteSema(sfx_sema);
-        sfx_sema = -1;
+        sceKernelDeleteSema(mcache_sema);
+        mcache_sema = -1;
     }
 
-    if (midi.midi_data)
+    if (mcache_lock >= 0)
     {
-        free(midi.midi_data);
-        midi.midi_data = NULL;
+        sceKernelDeleteSema(mcache_lock);
+        mcache_lock = -1;
     }
 
-    if (midi.events)
+    if (note_cache_on)
+    {
+        opl_reset(&midi.opl);
+        opl_reset(&mcache.seq.opl);
+        note_cache_free();
+        note_cache_on = 0;
+    }
+
+    if (psp_audio_ch >= 0)
     {
-        free(midi.events);
-        midi.events = NULL;
+        sceAudioChRelease(psp_audio_ch);
+        psp_audio_ch = -1;
     }
+
+    song_cache_free();
+    sfx_cache_free();
 }
 
 int I_GetSfxLumpNum(sfxinfo_t *sfx)
@@ -1663,31 +5393,13 @@ int I_GetSfxLumpNum(sfxinfo_t *sfx)
 
 int I_StartSound(sfxinfo_t *sfxinfo, int channel, int vol, int sep)
 {
-    void          *lump;
-    unsigned char *data;
-    int            lumpnum, rate, length, slot, handle;
+    sfx_clip_t *clip;
+    int         slot, handle;
 
     if (!sfxinfo || !snd_running) return -1;
 
-    lumpnum = sfxinfo->lumpnum;
-    if (lumpnum < 0 || lumpnum >= 2048) return -1;
-
-    if (!sfx_cache[lumpnum])
-        sfx_cache[lumpnum] = W_CacheLumpNum(lumpnum, PU_STATIC);
-
-    lump = sfx_cache[lumpnum];
-    if (!lump) return -1;
-
-    data = (unsigned char *)lump;
-
-    if ((data[0] | (data[1] << 8)) != 3) return -1;
-
-    rate   = data[2] | (data[3] << 8);
-    length = data[4] | (data[5] << 8) | (data[6] << 16) | (data[7] << 24);
-
-    if (rate == 0)   rate = 11025;
-    if (length <= 8) return -1;
-    length -= 8;
+    clip = sfx_clip(sfxinfo->lumpnum);
+    if (!clip && !sfx_loading(sfxinfo->lumpnum)) return -1;
 
     if (channel >= 0 && channel < SND_CHANNELS)
         slot = channel;
@@ -1697,7 +5409,7 @@ int I_StartSound(sfxinfo_t *sfxinfo, int channel, int vol, int sep)
         slot = 0;
         for (i = 0; i < SND_CHANNELS; i++)
         {
-            if (!sfx_channels[i].active) { slot = i; break; }
+            if (!sfx_slot_busy(i)) { slot = i; break; }
         }
     }
 
@@ -1709,66 +5421,129 @@ int I_StartSound(sfxinfo_t *sfxinfo, int channel, int vol, int sep)
     handle = next_handle++;
     if (next_handle <= 0) next_handle = 1;
 
-    sfx_lock();
-    sfx_channels[slot].data   = data + 8;
-    sfx_channels[slot].length = length;
-    sfx_channels[slot].pos    = 0;
-    sfx_channels[slot].step   = ((uint32_t)rate << 16) / OUTPUT_RATE;
-    sfx_channels[slot].vol    = vol;
-    sfx_channels[slot].sep    = sep;
-    sfx_channels[slot].handle = handle;
-    sfx_channels[slot].active = 1;
-    sfx_unlock();
+    sfx_waits[slot].handle = 0;
+    if (clip)
+        sfx_start(slot, handle, clip, vol, sep);
+    else
+    {
+        /* Started by sfx_precache_poll() once the worker has decoded it */
+        sfx_waits[slot].handle = handle;
+        sfx_waits[slot].lump   = sfxinfo->lumpnum;
+        sfx_waits[slot].vol    = vol;
+        sfx_waits[slot].sep    = sep;
+        sfx_started[slot]      = handle;
+    }
 
     return handle;
 }
 
 void I_StopSound(int handle)
 {
-    int i;
-    sfx_lock();
+    sfx_cmd_t *c;
+    int        i;
+
     for (i = 0; i < SND_CHANNELS; i++)
     {
-        if (sfx_channels[i].active && sfx_channels[i].handle == handle)
+        if (handle > 0 && sfx_started[i] == handle)
         {
-            sfx_channels[i].active = 0;
+            c         = sfx_cmd_slot();
+            c->cmd    = SFX_CMD_STOP;
+            c->slot   = i;
+            c->handle = handle;
+            sfx_post();
+
+            sfx_started[i]       = 0;
+            sfx_waits[i].handle = 0;
             break;
         }
     }
-    sfx_unlock();
 }
 
 boolean I_SoundIsPlaying(int handle)
 {
     int i;
     for (i = 0; i < SND_CHANNELS; i++)
-        if (sfx_channels[i].active && sfx_channels[i].handle == handle)
-            return 1;
+        if (handle > 0 && sfx_started[i] == handle)
+            return sfx_slot_busy(i);
     return 0;
 }
 
-void I_UpdateSound(void) { }
+void I_UpdateSound(void)
+{
+    song_poll();
+    note_cache_poll();
+    sfx_precache_poll();
+    sfx_cache_trim(NULL);
+}
 
 void I_UpdateSoundParams(int channel, int vol, int sep)
 {
+    sfx_cmd_t *c;
+
     if (channel < 0 || channel >= SND_CHANNELS) return;
     if (vol < 0)   vol = 0;
     if (vol > 127) vol = 127;
     if (sep < 0)   sep = 0;
     if (sep > 255) sep = 255;
 
-    sfx_lock();
-    if (sfx_channels[channel].active)
+    sfx_waits[channel].vol = vol;
+    sfx_waits[channel].sep = sep;
+
+    c       = sfx_cmd_slot();
+    c->cmd  = SFX_CMD_PARAMS;
+    c->slot = channel;
+    c->vol  = vol;
+    c->sep  = sep;
+    sfx_post();
+}
+
+void I_PrecacheSounds(sfxinfo_t *sounds, int num_sounds)
+{
+    uint32_t want = 0, size;
+    int      i, lump, queued = 0;
+
+    printf("I_PrecacheSounds: Precaching all sound effects.");
+
+    for (i = 0; i < num_sounds; i++)
     {
-        sfx_channels[channel].vol = vol;
-        sfx_channels[channel].sep = sep;
+        if (i % 32 == 0)
+        {
+            printf(".");
+            fflush(stdout);
+        }
+
+        lump = sfx_lump_num(&sounds[i]);
+        sounds[i].lumpnum = lump;
+        if (lump < 0 || lump >= 2048 || sfx_cache[lump] || sfx_queued[lump])
+            continue;
+
+        /* The clip, and the lump while it's decoded; what doesn't fit
+         * once the queue is done is read when it's played */
+        size = sfx_clip_bytes(W_LumpLength(lump), sfx_adpcm);
+        if (sfx_stats.bytes + want + W_LumpLength(lump) + size >
+            sfx_cache_budget)
+        {
+            sfx_precache_flush();
+            want = 0;
+            if (sfx_stats.bytes + W_LumpLength(lump) + size > sfx_cache_budget)
+                continue;
+        }
+
+        while (!sfx_load_queue(lump))
+        {
+            sceKernelDelayThread(1000);
+            sfx_precache_poll();
+        }
+        queued++;
+        want += size;
     }
-    sfx_unlock();
+
+    printf(" %d queued\n", queued);
 }
 
-void I_PrecacheSounds(sfxinfo_t *sounds, int num_sounds)
+void I_GetSoundStats(sfx_stats_t *stats)
 {
-    (void)sounds; (void)num_sounds;
+    *stats = sfx_stats;
 }
 
 void I_BindSoundVariables(void) { }
@@ -1789,197 +5564,141 @@ void I_InitMusic(void)
 
 void I_ShutdownMusic(void)
 {
+    song_prep_flush();
     I_StopSong();
-    if (midi.midi_data) { free(midi.midi_data); midi.midi_data = NULL; }
-    if (midi.events)    { free(midi.events); midi.events = NULL; }
+    music_cache_stop();
+    song_cache_free();
 }
 
 void I_SetMusicVolume(int vol)
 {
     if (vol < 0)   vol = 0;
     if (vol > 127) vol = 127;
-    midi.volume = vol;
+    music_post(MUSIC_CMD_VOLUME, vol);
 }
 
 void I_PauseSong(void)
 {
-    midi.playing = 0;
+    music_post(MUSIC_CMD_PAUSE, 0);
 }
 
 void I_ResumeSong(void)
 {
     if (midi.num_events > 0)
-        midi.playing = 1;
+        music_post(MUSIC_CMD_RESUME, 0);
 }
 
 void I_StopSong(void)
 {
-    int i;
-
-    midi.playing       = 0;
-    midi.current_event = 0;
-    midi.current_tick  = 0;
-    midi.tick_accum    = 0.0;
-
-    for (i = 0; i < MAX_VOICES; i++)
-    {
-        if (midi.voices[i].active)
-            opl_key_off(midi.voices[i].opl_ch);
-        midi.voices[i].active = 0;
-    }
-
-    opl_reset();
-
-    for (i = 0; i < MIDI_CHANNELS; i++)
-    {
-        midi.chan[i].volume     = 100;
-        midi.chan[i].pan        = 64;
-        midi.chan[i].expression = 127;
-        midi.chan[i].program    = 0;
-        midi.chan[i].pitch_bend = 0;
-    }
+    song_play_pending = -1;
+    music_stop();
 }
 
 boolean I_MusicIsPlaying(void)
 {
-    return midi.playing ? 1 : 0;
+    song_poll();
+    return (music_is_playing() || song_play_pending >= 0) ? 1 : 0;
 }
 
 void *I_RegisterSong(void *data, int len)
 {
-    MEMFILE *in, *out;
-    void    *buf;
-    size_t   buflen;
+    song_t   song, *e;
+    uint32_t hash;
 
     if (!data || len <= 0) return NULL;
 
-    if (midi.midi_data)
-    {
-        free(midi.midi_data);
-        midi.midi_data = NULL;
-        midi.midi_data_len = 0;
-    }
+    /* The music job and the cache worker read the event list we are
+     * about to replace */
+    music_stop();
+    music_cache_stop();
+    song_prep_flush();
+    song_release();
 
     if (!genmidi_loaded)
         load_genmidi();
 
-    /* Already MIDI? */
-    if (len >= 4 && memcmp(data, "MThd", 4) == 0)
+    hash = music_lump_hash(data, len);
+
+    e = song_find(hash, len);
+    if (e)
     {
-        midi.midi_data = malloc(len);
-        if (!midi.midi_data) return NULL;
-        memcpy(midi.midi_data, data, len);
-        midi.midi_data_len = len;
+        song_load(e);
+        song_ready(hash);
+        return (void *)1;
     }
-    else
-    {
-        /* Convert MUS to MIDI */
-        in = mem_fopen_read(data, len);
-        if (!in) return NULL;
-
-        out = mem_fopen_write();
-        if (!out) { mem_fclose(in); return NULL; }
-
-        if (mus2mid(in, out) != 0)
-        {
-            mem_fclose(in);
-            mem_fclose(out);
-            return NULL;
-        }
-
-        buf = NULL;
-        buflen = 0;
-        mem_get_buf(out, &buf, &buflen);
-        if (!buf || buflen == 0)
-        {
-            mem_fclose(in);
-            mem_fclose(out);
-            return NULL;
-        }
-
-        midi.midi_data = malloc(buflen);
-        if (!midi.midi_data)
-        {
-            mem_fclose(in);
-            mem_fclose(out);
-            return NULL;
-        }
-
-        memcpy(midi.midi_data, buf, buflen);
-        midi.midi_data_len = (int)buflen;
 
-        mem_fclose(in);
-        mem_fclose(out);
+    /* The lump stays cached until I_UnRegisterSong() */
+    if (mcache_thread_id >= 0)
+    {
+        song_waiting = 1;
+        song_post(data, len, hash, -1);
+        return (void *)1;
     }
 
-    /* Parse MIDI data */
-    if (parse_midi((const uint8_t *)midi.midi_data, midi.midi_data_len) <= 0)
-    {
-        free(midi.midi_data);
-        midi.midi_data = NULL;
-        midi.midi_data_len = 0;
+    if (song_parse(&song, (const uint8_t *)data, len) <= 0)
         return NULL;
-    }
 
-    sort_events();
+    song.hash     = hash;
+    song.lump_len = len;
+    e = song_store(&song);
+    song_load(e ? e : &song);
+    song_ready(hash);
     return (void *)1;
 }
 
 void I_UnRegisterSong(void *handle)
 {
     (void)handle;
+
+    /* The caller releases the lump next */
+    song_prep_flush();
     I_StopSong();
+    music_cache_stop();
 
-    if (midi.midi_data)
-    {
-        free(midi.midi_data);
-        midi.midi_data = NULL;
-        midi.midi_data_len = 0;
-    }
-    midi.num_events = 0;
+    song_release();
 }
 
 void I_PlaySong(void *handle, boolean looping)
 {
-    int i;
     (void)handle;
 
+    song_poll();
+    if (song_waiting)
+    {
+        song_play_pending = looping ? 1 : 0;
+        return;
+    }
+
     if (midi.num_events == 0) return;
 
-    midi.current_event = 0;
-    midi.current_tick  = 0;
-    midi.tick_accum    = 0.0;
-    midi.looping       = looping ? 1 : 0;
-    midi.voice_age     = 0;
+    song_start(looping);
+}
 
-    /* Find initial tempo */
-    midi.us_per_beat = 500000;
-    for (i = 0; i < midi.num_events; i++)
-    {
-        if (midi.events[i].type == MIDI_EV_TEMPO && midi.events[i].tick == 0)
-        {
-            midi.us_per_beat = midi.events[i].tempo;
-            break;
-        }
-    }
-    midi_calc_timing();
+/* Hint: parse a song lump in the background so that registering it
+ * later is a cache hit, e.g. the next map's music at the intermission */
+void I_PrefetchSong(int lump)
+{
+    const void *data;
+    int         len;
+    uint32_t    hash;
 
-    /* Reset voices */
-    for (i = 0; i < MAX_VOICES; i++)
-        midi.voices[i].active = 0;
+    song_poll();
+    if (lump < 0 || mcache_thread_id < 0 || song_prep.state != PREP_IDLE)
+        return;
 
-    opl_reset();
+    data = W_CacheLumpNum(lump, PU_STATIC);
+    len  = W_LumpLength(lump);
+    hash = music_lump_hash(data, len);
 
-    /* Reset MIDI channels */
-    for (i = 0; i < MIDI_CHANNELS; i++)
+    if (len <= 0 || song_find(hash, len))
     {
-        midi.chan[i].volume     = 100;
-        midi.chan[i].pan        = 64;
-        midi.chan[i].expression = 127;
-        midi.chan[i].pitch_bend = 0;
-        midi.chan[i].program    = 0;
-        midi.chan[i].is_drum    = (i == 9) ? 1 : 0;
+        W_ReleaseLumpNum(lump);
+        return;
     }
+    song_post(data, len, hash, lump);
+}
 
-    midi.playing = 1;
+void I_GetMusicStats(music_stats_t *stats)
+{
+    *stats = music_stats;
 }
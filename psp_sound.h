@@ -0,0 +1,37 @@
+/*
+ * psp_sound.h - Estensioni PSP all'interfaccia audio di i_sound.h
+ * Implementate in psp_sound.c
+ */
+
+#ifndef PSP_SOUND_H
+#define PSP_SOUND_H
+
+#include <stdint.h>
+
+/* Live synth load and voice shedding, since startup */
+typedef struct {
+    uint32_t    late;           /* blocks over budget */
+    uint32_t    sheds;          /* times the cap went down */
+    uint32_t    restores;       /* times it went back up */
+    uint32_t    voices_cut;
+    uint32_t    worst_us;       /* slowest block rendered live */
+} music_stats_t;
+
+/* Sound effect cache, since startup */
+typedef struct {
+    uint32_t    hits;
+    uint32_t    misses;         /* queued to the worker when played */
+    uint32_t    drops;          /* not played: no room in the queue */
+    uint32_t    evictions;
+    uint32_t    bytes;          /* resident: clips, and lumps being decoded */
+} sfx_stats_t;
+
+/* Parse a song lump in the background so that registering it later is
+ * a cache hit, e.g. the next map's music at the intermission */
+void I_PrefetchSong(int lump);
+
+/* Snapshots of the counters, for debug output */
+void I_GetMusicStats(music_stats_t *stats);
+void I_GetSoundStats(sfx_stats_t *stats);
+
+#endif
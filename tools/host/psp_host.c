@@ -0,0 +1,199 @@
+/*
+ * psp_host.c - PSP kernel and audio calls for host builds of psp_sound.c
+ * Threads and semaphores map onto pthreads; audio output is discarded,
+ * or handed to host_audio_output when a tool sets it.
+ */
+
+#include "pspthreadman.h"
+#include "pspaudio.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#define HOST_MAX_THREADS    16
+#define HOST_MAX_SEMAS      16
+
+typedef struct {
+    SceKernelThreadEntry    entry;
+    pthread_t               thread;
+    SceSize                 args;
+    void                   *argp;
+    int                     used, started;
+} host_thread_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t  cond;
+    int             count, max;
+    int             used;
+} host_sema_t;
+
+static host_thread_t host_threads[HOST_MAX_THREADS];
+static host_sema_t   host_semas[HOST_MAX_SEMAS];
+
+/* ==================== Threads ==================== */
+
+static void *host_thread_main(void *arg)
+{
+    host_thread_t *t = arg;
+
+    t->entry(t->args, t->argp);
+    return NULL;
+}
+
+SceUID sceKernelCreateThread(const char *name, SceKernelThreadEntry entry,
+                             int prio, int stack, SceUInt attr, void *opt)
+{
+    int i;
+
+    (void)name; (void)prio; (void)stack; (void)attr; (void)opt;
+
+    for (i = 0; i < HOST_MAX_THREADS; i++)
+    {
+        if (!host_threads[i].used)
+        {
+            memset(&host_threads[i], 0, sizeof(host_threads[i]));
+            host_threads[i].entry = entry;
+            host_threads[i].used  = 1;
+            return i;
+        }
+    }
+    return -1;
+}
+
+int sceKernelStartThread(SceUID thid, SceSize args, void *argp)
+{
+    host_thread_t *t = &host_threads[thid];
+
+    t->args = args;
+    t->argp = argp;
+    if (pthread_create(&t->thread, NULL, host_thread_main, t) != 0)
+        return -1;
+    t->started = 1;
+    return 0;
+}
+
+int sceKernelWaitThreadEnd(SceUID thid, SceUInt *timeout)
+{
+    host_thread_t *t = &host_threads[thid];
+
+    (void)timeout;
+    if (t->started)
+    {
+        pthread_join(t->thread, NULL);
+        t->started = 0;
+    }
+    return 0;
+}
+
+int sceKernelDeleteThread(SceUID thid)
+{
+    host_threads[thid].used = 0;
+    return 0;
+}
+
+int sceKernelDelayThread(SceUInt delay)
+{
+    usleep(delay);
+    return 0;
+}
+
+/* Microseconds, wrapping like the PSP's */
+SceUInt sceKernelGetSystemTimeLow(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (SceUInt)((uint64_t)ts.tv_sec * 1000000u + ts.tv_nsec / 1000);
+}
+
+/* ==================== Semaphores ==================== */
+
+SceUID sceKernelCreateSema(const char *name, SceUInt attr, int init,
+                           int max, void *opt)
+{
+    int i;
+
+    (void)name; (void)attr; (void)opt;
+
+    for (i = 0; i < HOST_MAX_SEMAS; i++)
+    {
+        host_sema_t *s = &host_semas[i];
+
+        if (!s->used)
+        {
+            pthread_mutex_init(&s->lock, NULL);
+            pthread_cond_init(&s->cond, NULL);
+            s->count = init;
+            s->max   = max;
+            s->used  = 1;
+            return i;
+        }
+    }
+    return -1;
+}
+
+int sceKernelWaitSema(SceUID semaid, int signal, SceUInt *timeout)
+{
+    host_sema_t *s = &host_semas[semaid];
+
+    (void)timeout;
+    pthread_mutex_lock(&s->lock);
+    while (s->count < signal)
+        pthread_cond_wait(&s->cond, &s->lock);
+    s->count -= signal;
+    pthread_mutex_unlock(&s->lock);
+    return 0;
+}
+
+int sceKernelSignalSema(SceUID semaid, int signal)
+{
+    host_sema_t *s = &host_semas[semaid];
+    int          ret = 0;
+
+    pthread_mutex_lock(&s->lock);
+    if (s->count + signal > s->max)
+        ret = -1;
+    else
+        s->count += signal;
+    pthread_cond_broadcast(&s->cond);
+    pthread_mutex_unlock(&s->lock);
+    return ret;
+}
+
+int sceKernelDeleteSema(SceUID semaid)
+{
+    host_sema_t *s = &host_semas[semaid];
+
+    pthread_cond_destroy(&s->cond);
+    pthread_mutex_destroy(&s->lock);
+    s->used = 0;
+    return 0;
+}
+
+/* ==================== Audio ==================== */
+
+int sceAudioChReserve(int channel, int samplecount, int format)
+{
+    (void)samplecount; (void)format;
+    return channel < 0 ? 0 : channel;
+}
+
+int sceAudioChRelease(int channel)
+{
+    (void)channel;
+    return 0;
+}
+
+void (*host_audio_output)(const void *buf);
+
+int sceAudioOutputBlocking(int channel, int vol, void *buf)
+{
+    (void)channel; (void)vol;
+    if (host_audio_output)
+        host_audio_output(buf);
+    return 0;
+}
@@ -0,0 +1,19 @@
+/*
+ * pspaudio.h - Host stand-in for the PSP SDK header
+ */
+
+#ifndef HOST_PSPAUDIO_H
+#define HOST_PSPAUDIO_H
+
+#define PSP_AUDIO_VOLUME_MAX        0x8000
+#define PSP_AUDIO_NEXT_CHANNEL      (-1)
+#define PSP_AUDIO_FORMAT_STEREO     0x00
+
+int sceAudioChReserve(int channel, int samplecount, int format);
+int sceAudioChRelease(int channel);
+int sceAudioOutputBlocking(int channel, int vol, void *buf);
+
+/* Host only: sees every block passed to sceAudioOutputBlocking() */
+extern void (*host_audio_output)(const void *buf);
+
+#endif
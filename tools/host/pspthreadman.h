@@ -0,0 +1,31 @@
+/*
+ * pspthreadman.h - Host stand-in for the PSP SDK header
+ * Only what psp_sound.c uses, implemented on pthreads in psp_host.c
+ */
+
+#ifndef HOST_PSPTHREADMAN_H
+#define HOST_PSPTHREADMAN_H
+
+typedef int          SceUID;
+typedef unsigned int SceSize;
+typedef unsigned int SceUInt;
+
+#define PSP_THREAD_ATTR_USER    0x80000000
+
+typedef int (*SceKernelThreadEntry)(SceSize args, void *argp);
+
+SceUID sceKernelCreateThread(const char *name, SceKernelThreadEntry entry,
+                             int prio, int stack, SceUInt attr, void *opt);
+int    sceKernelStartThread(SceUID thid, SceSize args, void *argp);
+int    sceKernelWaitThreadEnd(SceUID thid, SceUInt *timeout);
+int    sceKernelDeleteThread(SceUID thid);
+int    sceKernelDelayThread(SceUInt delay);
+SceUInt sceKernelGetSystemTimeLow(void);
+
+SceUID sceKernelCreateSema(const char *name, SceUInt attr, int init,
+                           int max, void *opt);
+int    sceKernelWaitSema(SceUID semaid, int signal, SceUInt *timeout);
+int    sceKernelSignalSema(SceUID semaid, int signal);
+int    sceKernelDeleteSema(SceUID semaid);
+
+#endif
@@ -0,0 +1,356 @@
+/*
+ * testwad.c - A small generated WAD for the host tools
+ *
+ * Lets the tools run, and their golden hashes live in the repo, without
+ * shipping Chex Quest data. Everything comes from a fixed LCG, so the
+ * WAD is the same on every host:
+ *
+ *   GENMIDI   175 random but playable instruments, some using the LFOs
+ *   D_TEST    a three-track MIDI song with program, volume and tempo
+ *             changes over every channel, drums included
+ *   D_MUS     a MUS song with instrument, volume, pan and pitch wheel
+ *             changes, drums included
+ *   DSTEST    a DMX sound effect
+ */
+
+#include "w_host.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#define TEST_WAD_MAX        (64 * 1024)
+#define TEST_LUMPS          4
+#define TEST_SONG_EVENTS    700     /* per track */
+#define TEST_MUS_EVENTS     1500
+
+static uint8_t  test_wad[TEST_WAD_MAX];
+static int      test_len;
+static uint32_t test_seed;
+
+static uint32_t test_rand(int n)
+{
+    test_seed = test_seed * 1103515245u + 12345u;
+    return (test_seed >> 8) % n;
+}
+
+static void put8(int v)
+{
+    test_wad[test_len++] = (uint8_t)v;
+}
+
+static void put16(int v)
+{
+    put8(v & 0xFF);
+    put8((v >> 8) & 0xFF);
+}
+
+static void put32(uint32_t v)
+{
+    put16(v & 0xFFFF);
+    put16(v >> 16);
+}
+
+static void put32_be(uint32_t v)
+{
+    put8(v >> 24);
+    put8((v >> 16) & 0xFF);
+    put8((v >> 8) & 0xFF);
+    put8(v & 0xFF);
+}
+
+/* ==================== GENMIDI ==================== */
+
+static void test_op(int carrier)
+{
+    int am_vib = test_rand(4) == 0 ? (test_rand(3) + 1) << 6 : 0;
+
+    put8(am_vib | (test_rand(2) << 5) | (test_rand(4) == 0) << 4 |
+         test_rand(16));                                /* tremolo */
+    put8(((1 + test_rand(15)) << 4) | test_rand(16));   /* AR / DR */
+    put8((test_rand(16) << 4) | (1 + test_rand(15)));   /* SL / RR */
+    put8(test_rand(4));                                 /* waveform */
+    put8((test_rand(4) << 6) |
+         (carrier ? test_rand(20) : test_rand(50)));    /* KSL / TL */
+    put8(0);                                            /* level */
+}
+
+static void test_genmidi(void)
+{
+    int i, v;
+
+    memcpy(test_wad + test_len, "#OPL_II#", 8);
+    test_len += 8;
+
+    for (i = 0; i < 175; i++)
+    {
+        int drum = i >= 128;
+
+        put16(drum ? 0x0001 : 0);                       /* flags */
+        put8(test_rand(4) == 0 ? 96 + test_rand(64) : 128);
+        put8(drum ? 36 + test_rand(48) : 0);            /* fixed note */
+
+        for (v = 0; v < 2; v++)
+        {
+            test_op(0);
+            put8((test_rand(8) << 1) | (test_rand(4) == 0));
+            test_op(1);
+            put8(0);
+            put16(drum ? 0 : (int)test_rand(25) - 12);  /* note offset */
+        }
+    }
+
+    for (i = 0; i < 175; i++)
+    {
+        memset(test_wad + test_len, 0, 32);
+        memcpy(test_wad + test_len, "TEST", 4);
+        test_wad[test_len + 4] = '0' + i / 100;
+        test_wad[test_len + 5] = '0' + i / 10 % 10;
+        test_wad[test_len + 6] = '0' + i % 10;
+        test_len += 32;
+    }
+}
+
+/* ==================== Song ==================== */
+
+static void put_var(uint32_t v)
+{
+    uint8_t b[5];
+    int     n = 0;
+
+    b[n++] = v & 0x7F;
+    while ((v >>= 7))
+        b[n++] = 0x80 | (v & 0x7F);
+    while (n)
+        put8(b[--n]);
+}
+
+static void test_track(int track)
+{
+    int start, i;
+
+    put32_be(0x4D54726B);   /* MTrk */
+    put32_be(0);
+    start = test_len;
+
+    if (track == 0)
+    {
+        /* 125 BPM */
+        put_var(0);
+        put8(0xFF); put8(0x51); put8(3);
+        put8(0x07); put8(0xA1); put8(0x20);
+    }
+
+    for (i = 0; i < TEST_SONG_EVENTS; i++)
+    {
+        int ch   = track == 2 ? 9 : test_rand(8) + track * 8;
+        int note = 36 + test_rand(48);
+        int r    = test_rand(20);
+
+        if (ch == 9 && track != 2)
+            ch = 8;
+
+        put_var(test_rand(40));
+        if (r == 0)
+        {
+            put8(0xC0 | ch);
+            put8(test_rand(128));
+        }
+        else if (r == 1)
+        {
+            put8(0xB0 | ch);
+            put8(test_rand(2) ? 7 : 11);
+            put8(test_rand(128));
+        }
+        else if (r == 2 && track == 0)
+        {
+            put8(0xFF); put8(0x51); put8(3);
+            put8(0x05 + test_rand(4)); put8(test_rand(256)); put8(0);
+        }
+        else
+        {
+            put8(0x90 | ch);
+            put8(note);
+            put8(1 + test_rand(127));
+
+            /* Most notes end, some are left to the next note on */
+            if (test_rand(4) != 0)
+            {
+                put_var(test_rand(60));
+                put8(0x80 | ch);
+                put8(note);
+                put8(64);
+            }
+        }
+    }
+
+    put_var(0);
+    put8(0xFF); put8(0x2F); put8(0);
+
+    /* Patch the track length */
+    {
+        uint32_t len = test_len - start;
+        int      end = test_len;
+
+        test_len = start - 4;
+        put32_be(len);
+        test_len = end;
+    }
+}
+
+static void test_song(void)
+{
+    int track;
+
+    put32_be(0x4D546864);   /* MThd */
+    put32_be(6);
+    put8(0); put8(1);       /* format 1 */
+    put8(0); put8(3);       /* tracks */
+    put8(0); put8(70);      /* ticks per beat, as mus2mid writes */
+
+    for (track = 0; track < 3; track++)
+        test_track(track);
+}
+
+static void test_mus(void)
+{
+    int start, i;
+
+    memcpy(test_wad + test_len, "MUS\x1A", 4);
+    test_len += 4;
+    put16(0);               /* score length, patched below */
+    put16(16);              /* score start */
+    put16(9);               /* primary channels */
+    put16(0);               /* secondary channels */
+    put16(0);               /* instruments */
+    put16(0);
+    start = test_len;
+
+    for (i = 0; i < TEST_MUS_EVENTS; i++)
+    {
+        int ch    = test_rand(10) == 0 ? 15 : test_rand(9);
+        int r     = test_rand(24);
+        int delay = test_rand(3) == 0 ? 0 : 1 + test_rand(30);
+        int last  = delay ? 0x80 : 0;
+
+        if (r == 0)
+        {
+            put8(last | 0x40 | ch);         /* instrument */
+            put8(0);
+            put8(test_rand(128));
+        }
+        else if (r == 1)
+        {
+            put8(last | 0x40 | ch);         /* volume, pan or expression */
+            put8(3 + test_rand(3));
+            put8(test_rand(128));
+        }
+        else if (r == 2)
+        {
+            put8(last | 0x20 | ch);         /* pitch wheel */
+            put8(test_rand(256));
+        }
+        else if (r == 3)
+        {
+            put8(last | 0x30 | ch);         /* all sounds or notes off */
+            put8(10 + test_rand(2));
+        }
+        else if (r < 14)
+        {
+            put8(last | 0x10 | ch);         /* play, sometimes at a new volume */
+            if (test_rand(3) == 0)
+            {
+                put8(0x80 | (36 + test_rand(48)));
+                put8(test_rand(128));
+            }
+            else
+            {
+                put8(36 + test_rand(48));
+            }
+        }
+        else
+        {
+            put8(last | 0x00 | ch);         /* release */
+            put8(36 + test_rand(48));
+        }
+
+        if (delay)
+            put_var(delay);
+    }
+
+    put8(0x60);             /* score end */
+
+    /* Patch the score length */
+    {
+        int end = test_len;
+
+        test_len = start - 12;
+        put16(end - start);
+        test_len = end;
+    }
+}
+
+/* ==================== Sound ==================== */
+
+static void test_sound(void)
+{
+    int i, n = 6000;
+
+    put16(3);
+    put16(11025);
+    put32(n + 8);
+    for (i = 0; i < n; i++)
+    {
+        int amp = 100 * (n - i) / n;
+        int s   = (i / 23) % 2 ? amp : -amp;
+
+        put8(128 + s + (int)test_rand(9) - 4);
+    }
+}
+
+/* ==================== WAD ==================== */
+
+int wad_load_test(void)
+{
+    static const char *names[TEST_LUMPS] = {
+        "GENMIDI", "D_TEST", "DSTEST", "D_MUS"
+    };
+    static void      (*build[TEST_LUMPS])(void) = {
+        test_genmidi, test_song, test_sound, test_mus
+    };
+    int32_t            pos[TEST_LUMPS], size[TEST_LUMPS];
+    int                i;
+
+    test_seed = 12345;
+    test_len  = 12;
+
+    for (i = 0; i < TEST_LUMPS; i++)
+    {
+        pos[i] = test_len;
+        build[i]();
+        size[i] = test_len - pos[i];
+    }
+
+    /* Directory */
+    {
+        int dir = test_len;
+
+        for (i = 0; i < TEST_LUMPS; i++)
+        {
+            put32(pos[i]);
+            put32(size[i]);
+            memset(test_wad + test_len, 0, 8);
+            memcpy(test_wad + test_len, names[i], strlen(names[i]));
+            test_len += 8;
+        }
+
+        memcpy(test_wad, "IWAD", 4);
+        i = test_len;
+        test_len = 4;
+        put32(TEST_LUMPS);
+        put32(dir);
+        test_len = i;
+    }
+
+    return wad_load_mem(test_wad, test_len);
+}
@@ -0,0 +1,132 @@
+/*
+ * w_host.c - WAD access for the host tools
+ */
+
+#include "doomtype.h"
+#include "w_wad.h"
+#include "z_zone.h"
+#include "w_host.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+
+typedef struct {
+    int32_t filepos;
+    int32_t size;
+    char    name[8];
+} wad_lump_t;
+
+static uint8_t    *wad_data;
+static long        wad_len;
+static wad_lump_t *wad_dir;
+static int         wad_numlumps;
+static uint8_t    *wad_locked;      /* cached with a tag the zone keeps */
+
+int wad_load_mem(void *data, long len)
+{
+    int32_t dirofs;
+
+    wad_data = data;
+    wad_len  = len;
+
+    if (wad_len < 12 || (memcmp(wad_data, "IWAD", 4) != 0 &&
+                         memcmp(wad_data, "PWAD", 4) != 0))
+        return 0;
+
+    /* WADs are little-endian, like every host we build on */
+    memcpy(&wad_numlumps, wad_data + 4, 4);
+    memcpy(&dirofs, wad_data + 8, 4);
+    if (wad_numlumps < 0 || dirofs < 0 ||
+        dirofs + (long)wad_numlumps * 16 > wad_len)
+        return 0;
+
+    wad_dir    = (wad_lump_t *)(wad_data + dirofs);
+    free(wad_locked);
+    wad_locked = calloc(wad_numlumps ? wad_numlumps : 1, 1);
+    return wad_locked != NULL;
+}
+
+int wad_load(const char *path)
+{
+    FILE    *f = fopen(path, "rb");
+    uint8_t *data;
+    long     len;
+
+    if (!f)
+        return 0;
+
+    fseek(f, 0, SEEK_END);
+    len = ftell(f);
+    fseek(f, 0, SEEK_SET);
+
+    data = malloc(len);
+    if (!data || fread(data, 1, len, f) != (size_t)len)
+    {
+        fclose(f);
+        return 0;
+    }
+    fclose(f);
+
+    return wad_load_mem(data, len);
+}
+
+int wad_num_lumps(void)
+{
+    return wad_numlumps;
+}
+
+void wad_lump_name(int lump, char *out)
+{
+    memcpy(out, wad_dir[lump].name, 8);
+    out[8] = '\0';
+}
+
+int W_CheckNumForName(char *name)
+{
+    int i;
+
+    /* Last one wins, as with PWADs loaded over the IWAD */
+    for (i = wad_numlumps - 1; i >= 0; i--)
+    {
+        if (strncasecmp(wad_dir[i].name, name, 8) == 0)
+            return i;
+    }
+    return -1;
+}
+
+int W_GetNumForName(char *name)
+{
+    int i = W_CheckNumForName(name);
+
+    if (i < 0)
+    {
+        fprintf(stderr, "lump %s not found\n", name);
+        exit(1);
+    }
+    return i;
+}
+
+int W_LumpLength(unsigned int lump)
+{
+    return wad_dir[lump].size;
+}
+
+int wad_lump_locked(int lump)
+{
+    return wad_locked[lump];
+}
+
+void *W_CacheLumpNum(int lump, int tag)
+{
+    /* The zone retags a lump it already holds */
+    wad_locked[lump] = tag != PU_CACHE;
+    return wad_data + wad_dir[lump].filepos;
+}
+
+void W_ReleaseLumpNum(int lump)
+{
+    wad_locked[lump] = 0;
+}
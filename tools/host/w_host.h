@@ -0,0 +1,17 @@
+/*
+ * w_host.h - WAD access for the host tools
+ * Reads one WAD into memory and serves the W_* calls that psp_sound.c
+ * makes
+ */
+
+#ifndef W_HOST_H
+#define W_HOST_H
+
+int  wad_load(const char *path);
+int  wad_load_mem(void *data, long len);    /* 'data' must outlive the WAD */
+int  wad_load_test(void);                   /* generated WAD, see testwad.c */
+int  wad_num_lumps(void);
+void wad_lump_name(int lump, char *out);    /* 'out' holds 9 bytes */
+int  wad_lump_locked(int lump);             /* not purgeable if in a zone */
+
+#endif
@@ -0,0 +1,189 @@
+/*
+ * musbake.c - Pre-render Chex Quest music for psp_sound.c
+ *
+ * Host tool built from the same psp_sound.c as the EBOOT. Every D_*
+ * lump of a WAD is played once through the sequencer and OPL synth
+ * (reference resampled path) and written as an IMA ADPCM file that
+ * I_RegisterSong() streams instead of synthesizing.
+ *
+ *   musbake [-o outdir] chex.wad [D_LUMP ...]
+ *
+ * Copy the output directory (default "music") next to the EBOOT.
+ */
+
+#include "psp_sound.c"
+#include "w_host.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+
+#define BAKE_MAX_SECONDS    (20 * 60)   /* give up on runaway songs */
+
+/* ==================== Rendering ==================== */
+
+/* One loop of the registered song as 16-bit mono at OUTPUT_RATE */
+static int16_t *bake_render(uint32_t *num_samples)
+{
+    static int32_t block[MIX_SAMPLES];
+    int16_t       *pcm = NULL;
+    uint32_t       len = 0, cap = 0;
+    int            i;
+
+    midi_start(&midi, 1);
+    midi.playing = 1;
+
+    while (!midi.loops && len < (uint32_t)BAKE_MAX_SECONDS * OUTPUT_RATE)
+    {
+        if (len + MIX_SAMPLES > cap)
+        {
+            cap = cap ? cap * 2 : OUTPUT_RATE * 60;
+            pcm = realloc(pcm, cap * sizeof(int16_t));
+            if (!pcm)
+                return NULL;
+        }
+
+        midi_render(&midi, block, MIX_SAMPLES);
+
+        for (i = 0; i < MIX_SAMPLES; i++)
+            pcm[len + i] = (int16_t)block[i];
+        len += MIX_SAMPLES;
+    }
+
+    *num_samples = len;
+    return pcm;
+}
+
+/* ==================== Baked File ==================== */
+
+static int bake_write(const char *path, const int16_t *pcm, uint32_t len)
+{
+    baked_header_t h;
+    uint8_t        blk[BAKED_BLOCK_BYTES];
+    int32_t        pred  = 0;
+    int            index = 0;
+    uint32_t       pos;
+    FILE          *f = fopen(path, "wb");
+
+    if (!f)
+        return 0;
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, BAKED_MAGIC, 4);
+    h.version       = BAKED_VERSION;
+    h.block_samples = BAKED_BLOCK_SAMPLES;
+    h.rate          = OUTPUT_RATE;
+    h.num_samples   = len;
+    h.loop_start    = 0;
+    h.loop_end      = len;
+    fwrite(&h, sizeof(h), 1, f);
+
+    for (pos = 0; pos < len; pos += BAKED_BLOCK_SAMPLES)
+    {
+        adpcm_encode_block(pcm + pos, len - pos, blk, BAKED_BLOCK_SAMPLES,
+                           &pred, &index);
+        fwrite(blk, sizeof(blk), 1, f);
+    }
+
+    return fclose(f) == 0;
+}
+
+/* ==================== Main ==================== */
+
+static int bake_lump(int lump, const char *outdir)
+{
+    char      name[9], path[512];
+    void     *data = W_CacheLumpNum(lump, PU_STATIC);
+    int       len  = W_LumpLength(lump);
+    int16_t  *pcm;
+    uint32_t  samples;
+
+    wad_lump_name(lump, name);
+
+    if (!I_RegisterSong(data, len))
+    {
+        fprintf(stderr, "%-8s  not a MUS/MIDI lump, skipped\n", name);
+        return 1;
+    }
+
+    pcm = bake_render(&samples);
+    I_UnRegisterSong(NULL);
+    if (!pcm)
+    {
+        fprintf(stderr, "%-8s  out of memory\n", name);
+        return 0;
+    }
+
+    snprintf(path, sizeof(path), "%s/%08x.bmu", outdir,
+             (unsigned)music_lump_hash(data, len));
+    if (!bake_write(path, pcm, samples))
+    {
+        fprintf(stderr, "%-8s  can't write %s\n", name, path);
+        free(pcm);
+        return 0;
+    }
+
+    printf("%-8s  %s  %u:%02u  %u KB\n", name, path,
+           samples / OUTPUT_RATE / 60, samples / OUTPUT_RATE % 60,
+           (unsigned)((sizeof(baked_header_t) + (samples + BAKED_BLOCK_SAMPLES - 1)
+                       / BAKED_BLOCK_SAMPLES * BAKED_BLOCK_BYTES) / 1024));
+    free(pcm);
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    const char *outdir = "music";
+    int         argi = 1, ok = 1, i;
+
+    if (argc > 2 && strcmp(argv[1], "-o") == 0)
+    {
+        outdir = argv[2];
+        argi   = 3;
+    }
+    if (argi >= argc)
+    {
+        fprintf(stderr, "usage: musbake [-o outdir] file.wad [D_LUMP ...]\n");
+        return 1;
+    }
+
+    if (!wad_load(argv[argi]))
+    {
+        fprintf(stderr, "musbake: can't read WAD %s\n", argv[argi]);
+        return 1;
+    }
+    argi++;
+
+    load_genmidi();
+    if (genmidi_loaded != 1)
+    {
+        fprintf(stderr, "musbake: no GENMIDI lump\n");
+        return 1;
+    }
+
+    if (mkdir(outdir, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "musbake: can't create %s\n", outdir);
+        return 1;
+    }
+
+    if (argi < argc)
+    {
+        for (i = argi; i < argc; i++)
+            ok &= bake_lump(W_GetNumForName(argv[i]), outdir);
+    }
+    else
+    {
+        for (i = 0; i < wad_num_lumps(); i++)
+        {
+            char name[9];
+
+            wad_lump_name(i, name);
+            if (toupper((unsigned char)name[0]) == 'D' && name[1] == '_' &&
+                W_LumpLength(i) > 0)
+                ok &= bake_lump(i, outdir);
+        }
+    }
+
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,148 @@
+/*
+ * oplcmp.c - Check the vector OPL kernel against the scalar one
+ *
+ * Plays every GENMIDI instrument on all nine channels at once, through
+ * opl_gen_block_scalar() and opl_gen_block_vector() on twin chips, in
+ * each synthesis mode. Output and channel state must match after every
+ * slice. Built once per lane count by the Makefile ("make check").
+ *
+ *   oplcmp [chex.wad]
+ *
+ * Without a WAD, the generated test WAD's instruments are used.
+ */
+
+#include "psp_sound.c"
+#include "w_host.h"
+
+#include <time.h>
+
+#if !OPL_VECTOR_LANES
+#error "oplcmp needs OPL_VECTOR_LANES set to 4 or 8"
+#endif
+
+#define CMP_SLICE       97      /* odd, so slices straddle LFO steps */
+#define CMP_SLICES      80
+#define CMP_KEY_OFF     30      /* first slice with a key off */
+
+static clock_t time_scalar, time_vector;
+
+/* Program channel 'ch' of 'chip' like midi_note_on() would */
+static void cmp_note(opl_chip_t *chip, int ch, int instr, int voice, int note)
+{
+    opl_patch_t patch;
+    int         block = note / 12;
+
+    if (block > 7)
+        block = 7;
+
+    opl_patch_voice(&patch, &genmidi_instrs[instr].voices[voice]);
+    opl_prog_patch(chip, ch, &patch);
+    chip->chan[ch].vol_atten = (ch * 5) % 48;
+    opl_set_freq(chip, ch, fnumber_table[note % 12], block);
+}
+
+/* Run one instrument set through both kernels; 0 on a mismatch */
+static int cmp_run(int mode, int instr, int voice)
+{
+    static opl_chip_t a, b;
+    static int32_t    out_a[CMP_SLICE], out_b[CMP_SLICE];
+    int               slice, ch;
+    clock_t           t;
+
+    opl_synth_mode = mode;
+    opl_reset(&a);
+    a.trem_depth = instr & 1;
+    a.vib_depth  = (instr >> 1) & 1;
+
+    /* Different instruments per channel so lanes disagree on waveform,
+     * feedback and connection */
+    for (ch = 0; ch < OPL_NUM_CHANNELS; ch++)
+        cmp_note(&a, ch, (instr + ch * 19) % GENMIDI_NUM_INSTRS, voice,
+                 24 + (instr + ch * 7) % 72);
+    b = a;
+
+    for (slice = 0; slice < CMP_SLICES; slice++)
+    {
+        /* Staggered key on and key off */
+        for (ch = 0; ch < OPL_NUM_CHANNELS; ch++)
+        {
+            if (slice == ch)
+            {
+                opl_key_on(&a, ch);
+                opl_key_on(&b, ch);
+            }
+            if (slice == CMP_KEY_OFF + ch * 3)
+            {
+                opl_key_off(&a, ch);
+                opl_key_off(&b, ch);
+            }
+        }
+
+        t = clock();
+        opl_gen_block_scalar(&a, out_a, CMP_SLICE);
+        time_scalar += clock() - t;
+
+        t = clock();
+        opl_gen_block_vector(&b, out_b, CMP_SLICE);
+        time_vector += clock() - t;
+
+        if (memcmp(out_a, out_b, sizeof(out_a)) != 0 ||
+            memcmp(a.chan, b.chan, sizeof(a.chan)) != 0 ||
+            a.trem_counter != b.trem_counter || a.vib_counter != b.vib_counter)
+        {
+            int i;
+
+            for (i = 0; i < CMP_SLICE && out_a[i] == out_b[i]; i++)
+                ;
+            fprintf(stderr, "mode %d instrument %d voice %d: mismatch in "
+                    "slice %d, sample %d (%d vs %d)\n", mode, instr, voice,
+                    slice, i, i < CMP_SLICE ? (int)out_a[i] : 0,
+                    i < CMP_SLICE ? (int)out_b[i] : 0);
+            return 0;
+        }
+    }
+
+    return 1;
+}
+
+int main(int argc, char **argv)
+{
+    int mode, instr, voice, runs = 0;
+
+    if (argc > 2)
+    {
+        fprintf(stderr, "usage: oplcmp [file.wad]\n");
+        return 1;
+    }
+    if (argc == 2 ? !wad_load(argv[1]) : !wad_load_test())
+    {
+        fprintf(stderr, "oplcmp: can't read WAD %s\n", argv[1]);
+        return 1;
+    }
+
+    load_genmidi();
+    if (genmidi_loaded != 1)
+    {
+        fprintf(stderr, "oplcmp: no GENMIDI lump\n");
+        return 1;
+    }
+    opl_init_tables();
+
+    for (mode = OPL_MODE_RESAMPLED; mode <= OPL_MODE_LOWPOWER; mode++)
+    {
+        for (instr = 0; instr < GENMIDI_NUM_INSTRS; instr++)
+        {
+            for (voice = 0; voice < 2; voice++, runs++)
+            {
+                if (!cmp_run(mode, instr, voice))
+                    return 1;
+            }
+        }
+    }
+
+    printf("oplcmp: %d lanes, %d runs identical, scalar %.2fs, vector %.2fs\n",
+           OPL_VECTOR_LANES, runs,
+           (double)time_scalar / CLOCKS_PER_SEC,
+           (double)time_vector / CLOCKS_PER_SEC);
+    return 0;
+}
@@ -0,0 +1,1478 @@
+/*
+ * sndtest.c - Regression and throughput harness for psp_sound.c
+ *
+ * Renders every GENMIDI instrument and every D_* music lump of a WAD
+ * (the generated test WAD when none is given) in each synthesis mode,
+ * then runs the audio thread's mix loop over a song with sound effects.
+ * Every render is hashed and checked against a golden file, and the
+ * time spent in the synth, the sequencer and the mix loop is reported.
+ * Each song's event timing, to the sample, is also checked against
+ * exact arithmetic, and voice shedding against made-up render times.
+ * Sound effects are sized and mixed both as 16-bit and ADPCM clips,
+ * and the mixer timed with each.
+ *
+ *   sndtest [-g golden] [-u] [-m mode] [-o outdir] [-r] [-v] [file.wad]
+ *
+ *   -g   golden hash file to check against (with -u: to write)
+ *   -m   only synthesis mode 0 (resampled), 1 (native) or 2 (lowpower)
+ *   -o   write every render to outdir as WAV, or raw with -r
+ *   -v   list every render
+ */
+
+#include "psp_sound.c"
+#include "w_host.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#define TEST_NOTE_BLOCKS    26      /* ~0.3 s held per note */
+#define TEST_GAP_BLOCKS     17      /* ~0.2 s of release */
+#define TEST_SONG_SECONDS   600     /* give up on runaway songs */
+#define TEST_MIX_BLOCKS     2000    /* ~23 s of the mix loop */
+#define TEST_MAX_GOLDEN     2048
+
+static const char *mode_names[3] = { "resampled", "native", "lowpower" };
+
+typedef struct {
+    char        name[16];
+    int         mode;
+    uint64_t    hash;
+} golden_t;
+
+static golden_t     golden[TEST_MAX_GOLDEN];
+static int          num_golden;
+static int          update, verbose, raw;
+static const char  *outdir;
+static int          renders, failures, missing;
+
+/* Samples and CPU time per mode */
+typedef struct {
+    uint64_t    samples;
+    clock_t     time;
+} test_timer_t;
+
+static test_timer_t time_synth[3], time_seq[3], time_mix[3];
+
+/* The same for the sound effect mixer, with 16-bit and ADPCM clips */
+static test_timer_t time_sfx[2];
+
+/* ==================== Renders ==================== */
+
+typedef struct {
+    uint64_t    hash;
+    int16_t    *pcm;
+    uint32_t    len, cap;
+    int         channels;
+} render_t;
+
+static void render_begin(render_t *r, int channels)
+{
+    r->hash     = 1469598103934665603ull;   /* FNV-1a */
+    r->len      = 0;
+    r->channels = channels;
+}
+
+static void render_add(render_t *r, const int16_t *s, int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++)
+    {
+        r->hash = (r->hash ^ (uint8_t)(s[i] & 0xFF)) * 1099511628211ull;
+        r->hash = (r->hash ^ (uint8_t)(s[i] >> 8)) * 1099511628211ull;
+    }
+
+    if (!outdir)
+        return;
+
+    if (r->len + n > r->cap)
+    {
+        r->cap = (r->len + n) * 2;
+        r->pcm = realloc(r->pcm, r->cap * sizeof(int16_t));
+        if (!r->pcm)
+        {
+            fprintf(stderr, "sndtest: out of memory\n");
+            exit(1);
+        }
+    }
+    memcpy(r->pcm + r->len, s, n * sizeof(int16_t));
+    r->len += n;
+}
+
+static void put_le(FILE *f, uint32_t v, int bytes)
+{
+    while (bytes--)
+    {
+        fputc(v & 0xFF, f);
+        v >>= 8;
+    }
+}
+
+static void render_write(const render_t *r, const char *path)
+{
+    FILE    *f = fopen(path, "wb");
+    uint32_t bytes = r->len * sizeof(int16_t);
+    uint32_t i;
+
+    if (!f)
+    {
+        fprintf(stderr, "sndtest: can't write %s\n", path);
+        failures++;
+        return;
+    }
+
+    if (!raw)
+    {
+        fwrite("RIFF", 1, 4, f);
+        put_le(f, 36 + bytes, 4);
+        fwrite("WAVEfmt ", 1, 8, f);
+        put_le(f, 16, 4);
+        put_le(f, 1, 2);                            /* PCM */
+        put_le(f, r->channels, 2);
+        put_le(f, OUTPUT_RATE, 4);
+        put_le(f, OUTPUT_RATE * r->channels * 2, 4);
+        put_le(f, r->channels * 2, 2);
+        put_le(f, 16, 2);
+        fwrite("data", 1, 4, f);
+        put_le(f, bytes, 4);
+    }
+
+    for (i = 0; i < r->len; i++)
+        put_le(f, (uint16_t)r->pcm[i], 2);
+    fclose(f);
+}
+
+/* Check a finished render against its golden hash, and write it out */
+static void render_end(const render_t *r, const char *name, int mode)
+{
+    int  i;
+    char path[512];
+
+    renders++;
+
+    for (i = 0; i < num_golden; i++)
+        if (golden[i].mode == mode && strcmp(golden[i].name, name) == 0)
+            break;
+
+    if (update)
+    {
+        if (i == num_golden && num_golden < TEST_MAX_GOLDEN)
+        {
+            snprintf(golden[i].name, sizeof(golden[i].name), "%s", name);
+            golden[i].mode = mode;
+            num_golden++;
+        }
+        golden[i].hash = r->hash;
+    }
+    else if (i == num_golden)
+    {
+        missing++;
+        if (num_golden)
+            printf("%-10s %-9s %016llx  no golden hash\n", name,
+                   mode_names[mode], (unsigned long long)r->hash);
+    }
+    else if (golden[i].hash != r->hash)
+    {
+        failures++;
+        printf("%-10s %-9s %016llx  FAILED, expected %016llx\n", name,
+               mode_names[mode], (unsigned long long)r->hash,
+               (unsigned long long)golden[i].hash);
+    }
+
+    if (verbose)
+        printf("%-10s %-9s %016llx\n", name, mode_names[mode],
+               (unsigned long long)r->hash);
+
+    if (outdir)
+    {
+        snprintf(path, sizeof(path), "%s/%s-%s.%s", outdir, name,
+                 mode_names[mode], raw ? "raw" : "wav");
+        render_write(r, path);
+    }
+}
+
+/* ==================== Golden File ==================== */
+
+static int golden_load(const char *path)
+{
+    FILE              *f = fopen(path, "r");
+    char               line[128], name[64], mode[16];
+    unsigned long long hash;
+    int                m;
+
+    if (!f)
+        return update;  /* -u creates it */
+
+    while (fgets(line, sizeof(line), f) && num_golden < TEST_MAX_GOLDEN)
+    {
+        if (line[0] == '#' || sscanf(line, "%63s %15s %llx", name, mode, &hash) != 3)
+            continue;
+
+        for (m = 0; m < 3 && strcmp(mode, mode_names[m]) != 0; m++)
+            ;
+        if (m == 3 || strlen(name) >= sizeof(golden[0].name))
+            continue;
+
+        strcpy(golden[num_golden].name, name);
+        golden[num_golden].mode = m;
+        golden[num_golden].hash = hash;
+        num_golden++;
+    }
+
+    fclose(f);
+    return 1;
+}
+
+static int golden_save(const char *path)
+{
+    FILE *f = fopen(path, "w");
+    int   i;
+
+    if (!f)
+        return 0;
+
+    fprintf(f, "# sndtest golden hashes: render, synthesis mode, FNV-1a of the samples\n");
+    for (i = 0; i < num_golden; i++)
+        fprintf(f, "%s %s %016llx\n", golden[i].name, mode_names[golden[i].mode],
+                (unsigned long long)golden[i].hash);
+
+    return fclose(f) == 0;
+}
+
+/* ==================== Instruments ==================== */
+
+/* Synthesize 'blocks' mix blocks of 'seq' */
+static void test_synth(midi_state_t *seq, render_t *r, int blocks, int mode)
+{
+    static int32_t block[MIX_SAMPLES];
+    static int16_t pcm[MIX_SAMPLES];
+    clock_t        t;
+    int            i;
+
+    while (blocks--)
+    {
+        t = clock();
+        opl_gen_music(&seq->opl, block, MIX_SAMPLES);
+        time_synth[mode].time    += clock() - t;
+        time_synth[mode].samples += MIX_SAMPLES;
+
+        for (i = 0; i < MIX_SAMPLES; i++)
+            pcm[i] = (int16_t)block[i];
+        render_add(r, pcm, MIX_SAMPLES);
+    }
+}
+
+/* A few notes of one instrument, each held and then released */
+static void test_instrument(int instr, int mode)
+{
+    static const int melody[3] = { 48, 60, 72 };
+    static midi_state_t seq;
+    static render_t     r;
+    char                name[16];
+    int                 i, ch, note;
+
+    memset(&seq, 0, sizeof(seq));
+    midi_start(&seq, 0);
+    render_begin(&r, 1);
+
+    ch = (instr >= 128) ? 9 : 0;
+    if (ch == 0)
+        midi_program_change(&seq, ch, instr);
+
+    for (i = 0; i < 3; i++)
+    {
+        note = (ch == 9) ? 35 + instr - 128 : melody[i];
+
+        midi_note_on(&seq, ch, note, 127 - i * 30);
+        test_synth(&seq, &r, TEST_NOTE_BLOCKS, mode);
+        midi_note_off(&seq, ch, note);
+        test_synth(&seq, &r, TEST_GAP_BLOCKS, mode);
+    }
+
+    snprintf(name, sizeof(name), "i%03d", instr);
+    render_end(&r, name, mode);
+}
+
+/* ==================== Songs ==================== */
+
+static int is_music_lump(int lump)
+{
+    char name[9];
+
+    wad_lump_name(lump, name);
+    return toupper((unsigned char)name[0]) == 'D' && name[1] == '_' &&
+           W_LumpLength(lump) > 0;
+}
+
+static int is_sfx_lump(int lump)
+{
+    char name[9];
+
+    wad_lump_name(lump, name);
+    return toupper((unsigned char)name[0]) == 'D' &&
+           toupper((unsigned char)name[1]) == 'S';
+}
+
+/* One pass through a song, without looping */
+static void test_song(int lump, int mode)
+{
+    static int32_t  block[MIX_SAMPLES];
+    static int16_t  pcm[MIX_SAMPLES];
+    static render_t r;
+    char            name[9];
+    uint32_t        len = 0;
+    clock_t         t;
+    int             i, n, run;
+
+    wad_lump_name(lump, name);
+    if (!I_RegisterSong(W_CacheLumpNum(lump, PU_STATIC), W_LumpLength(lump)))
+    {
+        printf("%-10s not a MUS/MIDI lump, skipped\n", name);
+        return;
+    }
+
+    midi_start(&midi, 0);
+    midi.playing = 1;
+    render_begin(&r, 1);
+
+    while (midi.playing && len < (uint32_t)TEST_SONG_SECONDS * OUTPUT_RATE)
+    {
+        /* midi_render(), timing the synth and the sequencer apart */
+        for (n = 0; n < MIX_SAMPLES; n += run)
+        {
+            run = midi_run_length(&midi, MIX_SAMPLES - n);
+
+            t = clock();
+            opl_gen_music(&midi.opl, block + n, run);
+            time_synth[mode].time += clock() - t;
+
+            t = clock();
+            midi_advance(&midi, run);
+            time_seq[mode].time += clock() - t;
+        }
+        time_synth[mode].samples += MIX_SAMPLES;
+        time_seq[mode].samples   += MIX_SAMPLES;
+
+        for (i = 0; i < MIX_SAMPLES; i++)
+            pcm[i] = (int16_t)block[i];
+        render_add(&r, pcm, MIX_SAMPLES);
+        len += MIX_SAMPLES;
+    }
+
+    I_UnRegisterSong(NULL);
+    render_end(&r, name, mode);
+}
+
+/* ==================== Timing ==================== */
+
+/*
+ * Works out when each event of a song should play from its tempo map,
+ * independently of midi_advance(): the sequencer plays the events of
+ * tick T (T >= 1) once T ticks have elapsed, and a tick lasts
+ * us_per_beat / ticks_per_beat microseconds, at least one sample. Then
+ * plays the song the way midi_render() splits its blocks and checks
+ * that every split consumed exactly the events due by then, none of
+ * them later than the synth's native step after its time.
+ */
+
+/*
+ * Waits too long for one var-len are packed as several records that add
+ * up to the whole wait, within the room merge_tracks() allows for them.
+ */
+static void test_long_wait(void)
+{
+    static const uint32_t waits[] = {
+        1, 0x7F, 0x80, MIDI_WAIT_MAX, MIDI_WAIT_MAX + 1, 0xFFFFFFFF
+    };
+    uint8_t  buf[(MIDI_WAIT_SPLITS + 1) * 5];
+    uint32_t sum;
+    int      i, pos, len;
+
+    for (i = 0; i < (int)(sizeof(waits) / sizeof(waits[0])); i++)
+    {
+        len = (int)(write_wait(buf, waits[i]) - buf);
+        for (pos = 0, sum = 0; pos < len && buf[pos] == MIDI_PK_WAIT; )
+        {
+            pos++;
+            sum += read_var_len(buf, &pos, len);
+        }
+
+        if (pos != len || sum != waits[i])
+        {
+            failures++;
+            printf("long wait %u FAILED, packed as %u\n", waits[i], sum);
+        }
+    }
+}
+
+typedef struct {
+    int         end;        /* stream offset just past the event */
+    uint64_t    due;        /* in 1/(1000000 * ticks_per_beat) samples */
+} test_due_t;
+
+static void test_timing(int lump, int mode)
+{
+    static test_due_t *ev;
+    static int         ev_cap;
+    char               name[9];
+    uint64_t           unit, late, now = 0, elapsed = 0;
+    uint32_t           tempo, tick = 0, ticks = 0;
+    int                n = 0, pos = 0, played = 0, due = 0, blocks = 0;
+    int                run, left;
+
+    wad_lump_name(lump, name);
+    if (!I_RegisterSong(W_CacheLumpNum(lump, PU_STATIC), W_LumpLength(lump)))
+        return;
+
+    unit  = 1000000ull * midi.ticks_per_beat;
+    tempo = midi.start_us_per_beat ? midi.start_us_per_beat : 500000;
+
+    while (pos < midi.stream_len)
+    {
+        const uint8_t *p = midi.stream + pos;
+        uint64_t       len;
+
+        if (p[0] == MIDI_PK_WAIT)
+        {
+            pos++;
+            tick += read_var_len(midi.stream, &pos, midi.stream_len);
+            continue;
+        }
+
+        while (ticks < (tick ? tick : 1))
+        {
+            len = (uint64_t)tempo * OUTPUT_RATE;
+            elapsed += len > unit ? len : unit;
+            ticks++;
+        }
+
+        if (p[0] == MIDI_PK_TEMPO)
+            tempo = (p[1] << 16) | (p[2] << 8) | p[3];
+        pos += (p[0] == MIDI_PK_TEMPO) ? 4 :
+               ((p[0] & 0xF0) == MIDI_EV_NOTEOFF ||
+                (p[0] & 0xF0) == MIDI_EV_PROGRAM) ? 2 : 3;
+
+        if (n == ev_cap)
+        {
+            ev_cap = ev_cap ? ev_cap * 2 : 4096;
+            ev = realloc(ev, ev_cap * sizeof(*ev));
+            if (!ev)
+            {
+                fprintf(stderr, "sndtest: out of memory\n");
+                exit(1);
+            }
+        }
+        ev[n].end = pos;
+        ev[n].due = elapsed;
+        n++;
+    }
+
+    midi_start(&midi, 0);
+    midi.playing = 1;
+
+    late = (midi.opl.mode == OPL_MODE_RESAMPLED) ? unit :
+           unit << midi.opl.rate_shift;
+
+    while (played < n && played == due)
+    {
+        for (left = MIX_SAMPLES; left > 0 && played == due; left -= run)
+        {
+            run = midi_run_length(&midi, left);
+            midi_advance(&midi, run);
+            now += run * unit;
+
+            while (played < n && ev[played].end <= midi.stream_pos)
+            {
+                if (ev[played].due + late <= now)
+                    break;
+                played++;
+            }
+            while (due < n && ev[due].due <= now)
+                due++;
+        }
+        blocks++;
+    }
+
+    if (played != due)
+    {
+        failures++;
+        printf("%-10s timing    %s FAILED, event %d played at sample %llu, "
+               "due at %llu\n", name, mode_names[mode], played,
+               (unsigned long long)(now / unit),
+               (unsigned long long)(ev[played].due / unit));
+    }
+    else if (verbose)
+    {
+        printf("%-10s timing    %s, %d events in %d blocks\n", name,
+               mode_names[mode], n, blocks);
+    }
+
+    midi.playing = 0;
+    I_UnRegisterSong(NULL);
+}
+
+/* ==================== Voice Shedding ==================== */
+
+static int shed_check(int ok, const char *what)
+{
+    if (!ok)
+    {
+        failures++;
+        printf("shedding   FAILED, %s\n", what);
+    }
+    return ok;
+}
+
+/*
+ * Plays a song until enough voices sound, then reports every block as
+ * late until the cap bottoms out, and on time until it is lifted.
+ * Renders stay off the clock: main() turns shedding off.
+ */
+static void test_shed(int lump)
+{
+    static int32_t block[MIX_SAMPLES];
+    unsigned       before;
+    int            i, active, cap, quietest = -1;
+
+    if (!I_RegisterSong(W_CacheLumpNum(lump, PU_STATIC), W_LumpLength(lump)))
+        return;
+
+    midi_start(&midi, 1);
+    midi.playing   = 1;
+    shed_budget_us = BLOCK_US / 2;
+    memset(&music_stats, 0, sizeof(music_stats));
+
+    for (i = 0; i < 4000 && __builtin_popcount(midi.voices_used) < MAX_VOICES; i++)
+        midi_render(&midi, block, MIX_SAMPLES);
+    active = __builtin_popcount(midi.voices_used);
+    if (active <= SHED_MIN_VOICES)
+    {
+        printf("shedding   skipped, only %d voices\n", active);
+        goto done;
+    }
+
+    /* One late block drops the quietest voice */
+    before = midi.voices_used;
+    for (i = 0; i < MAX_VOICES; i++)
+    {
+        if ((before & (1u << i)) &&
+            (quietest < 0 || voice_atten(&midi, i) > voice_atten(&midi, quietest)))
+            quietest = i;
+    }
+    shed_update(&midi, BLOCK_US);
+    if (!shed_check(midi.voice_cap == active - 1 &&
+                    midi.voices_used == (before & ~(1u << quietest)) &&
+                    music_stats.sheds == 1 && music_stats.voices_cut == 1,
+                    "a late block didn't cut the quietest voice"))
+        goto done;
+
+    /* Then one channel per late block, down to the floor */
+    for (i = 0; i < 2 * MAX_VOICES; i++)
+    {
+        midi_render(&midi, block, MIX_SAMPLES);
+        shed_update(&midi, BLOCK_US);
+        if (!shed_check(__builtin_popcount(midi.voices_used) <= voice_limit(&midi),
+                        "more voices playing than the cap"))
+            goto done;
+    }
+    cap = midi.voice_cap;
+    if (!shed_check(cap == SHED_MIN_VOICES && music_stats.late == 2 * MAX_VOICES + 1,
+                    "the cap didn't stop at SHED_MIN_VOICES"))
+        goto done;
+
+    /* Blocks on time restore a channel per SHED_RESTORE_BLOCKS */
+    for (i = 1; i <= SHED_RESTORE_BLOCKS * (MAX_VOICES - cap); i++)
+    {
+        midi_render(&midi, block, MIX_SAMPLES);
+        shed_update(&midi, 0);
+        if (!shed_check(voice_limit(&midi) == cap + i / SHED_RESTORE_BLOCKS,
+                        "channels restored early or late"))
+            goto done;
+    }
+    shed_check(midi.voice_cap == 0 &&
+               music_stats.restores == (uint32_t)(MAX_VOICES - cap),
+               "the cap wasn't lifted");
+
+    if (verbose)
+        printf("shedding   %d voices, %u cut, %u sheds, %u restores\n", active,
+               music_stats.voices_cut, music_stats.sheds, music_stats.restores);
+
+done:
+    shed_budget_us  = 0;
+    midi.voice_cap  = 0;
+    midi.playing    = 0;
+    I_UnRegisterSong(NULL);
+}
+
+/* ==================== Music Cache ==================== */
+
+/*
+ * Caches one loop of the start of a song, standing in for the worker:
+ * the cache must hold the live render up to the exact sample the song
+ * wrapped at, and streaming across the loop's end must go straight on
+ * to its start.
+ */
+#define LOOP_SAMPLES    (200 * MIX_SAMPLES)
+
+static void test_music_loop(int lump)
+{
+    static int32_t block[MIX_SAMPLES];
+    uint32_t       len = 0, pos, at;
+    int            i, wrap = -1, ok = 1;
+
+    if (!I_RegisterSong(W_CacheLumpNum(lump, PU_STATIC), W_LumpLength(lump)))
+        return;
+
+    /* Cut the song to what plays in LOOP_SAMPLES, so a loop fits the cache */
+    midi_start(&midi, 1);
+    midi.playing = 1;
+    for (i = 0; i < LOOP_SAMPLES / MIX_SAMPLES; i++)
+        midi_render(&midi, block, MIX_SAMPLES);
+    midi.stream_len = midi.stream_pos;
+
+    mcache_sema = sceKernelCreateSema("mcache_sema", 0, 0, 1000, NULL);
+    music_cache_start();
+    music_cache_render();
+
+    midi_start(&midi, 1);
+    midi.playing = 1;
+    while (ok && wrap < 0 && mcache.state == MCACHE_COMPLETE)
+    {
+        wrap = midi_render(&midi, block, MIX_SAMPLES);
+        for (i = 0; i < (wrap >= 0 ? wrap : MIX_SAMPLES) && ok; i++, len++)
+            ok = len < mcache.loop_len &&
+                 mcache.chunk[len / MUSIC_CACHE_CHUNK][len % MUSIC_CACHE_CHUNK] ==
+                 (int16_t)block[i];
+    }
+    ok = ok && mcache.state == MCACHE_COMPLETE && len == mcache.loop_len;
+
+    /* Stream the last 100 samples of the loop and on past its start */
+    music_streaming = 1;
+    music_pos       = pos = len - 100;
+    if (ok)
+        music_render_block();
+    for (i = 0; i < MIX_SAMPLES && ok; i++)
+    {
+        at = (pos + i) % len;
+        ok = music_buffer[i] ==
+             (mcache.chunk[at / MUSIC_CACHE_CHUNK][at % MUSIC_CACHE_CHUNK] *
+              midi.volume) >> 7;
+    }
+    ok = ok && music_pos == (pos + MIX_SAMPLES) % len;
+
+    if (!ok)
+    {
+        failures++;
+        printf("music loop FAILED at sample %u of %u\n", len, mcache.loop_len);
+    }
+    else if (verbose)
+        printf("music loop %u samples\n", len);
+
+    music_streaming = 0;
+    music_pos       = 0;
+    midi.playing    = 0;
+    music_cache_free();
+    mcache.state = MCACHE_IDLE;
+    sceKernelDeleteSema(mcache_sema);
+    mcache_sema = -1;
+    I_UnRegisterSong(NULL);
+}
+
+/* ==================== Mix Loop ==================== */
+
+static render_t   mix_render;
+static sfxinfo_t  mix_sfx;
+static int        mix_blocks;
+static clock_t    mix_hook_time;
+static int        mix_handles[SND_CHANNELS], mix_starts, mix_status_bad;
+
+/* Whether the mixer plays 'handle', to check I_SoundIsPlaying() by */
+static int mix_playing(int handle)
+{
+    int c;
+
+    for (c = 0; c < SND_CHANNELS; c++)
+        if (sfx_channels[c].active && sfx_channels[c].handle == handle)
+            return 1;
+    return 0;
+}
+
+/* Called by audio_thread() for every block it mixes */
+static void test_mix_output(const void *buf)
+{
+    clock_t t = clock();
+    int     i, h;
+
+    render_add(&mix_render, buf, MIX_SAMPLES * 2);
+    mix_blocks++;
+
+    /* Everything posted before this block has been applied; a sound
+     * just started plays before the mixer sees it */
+    for (i = 0; i < SND_CHANNELS; i++)
+        if (mix_handles[i] > 0 &&
+            I_SoundIsPlaying(mix_handles[i]) != mix_playing(mix_handles[i]))
+            mix_status_bad++;
+    if (mix_sfx.lumpnum >= 0 && mix_blocks % 23 == 0)
+    {
+        h = I_StartSound(&mix_sfx, -1, 40 + mix_blocks % 80,
+                         (mix_blocks * 37) % 256);
+        if (h > 0 && !I_SoundIsPlaying(h))
+            mix_status_bad++;
+        mix_handles[mix_starts++ % SND_CHANNELS] = h;
+    }
+    if (mix_blocks % 11 == 0)
+        I_UpdateSoundParams(mix_blocks % SND_CHANNELS, 30 + mix_blocks % 90,
+                            (mix_blocks * 7) % 256);
+
+    if (mix_blocks >= TEST_MIX_BLOCKS)
+        snd_running = 0;
+
+    mix_hook_time += clock() - t;
+}
+
+/*
+ * Precaches the sound effect for the mix loop through the worker's
+ * queue, standing in for the worker, and checks it plays only once
+ * decoded, as it would have been on first play, and that its lump is
+ * locked only until then. Then again over the cache budget, and once
+ * evicted: a start waits on its channel until the worker has decoded
+ * the lump again, and sfx_stats counts the lump while it's held.
+ */
+static void test_precache(int lump)
+{
+    sfx_clip_t *clip, *want;
+    char        name[9];
+    int         ok, h;
+
+    memset(&mix_sfx, 0, sizeof(mix_sfx));
+    mix_sfx.lumpnum = -1;
+    if (lump < 0)
+        return;
+
+    wad_lump_name(lump, name);
+    snprintf(mix_sfx.name, sizeof(mix_sfx.name), "%s", name + 2);
+
+    mcache_sema      = sceKernelCreateSema("mcache_sema", 0, 0, 1000, NULL);
+    mcache_thread_id = 0;
+
+    I_PrecacheSounds(&mix_sfx, 1);
+    ok = mix_sfx.lumpnum == lump && sfx_queued[lump] && !sfx_clip(lump) &&
+         wad_lump_locked(lump);
+
+    sfx_precache_run();
+    sfx_precache_poll();
+    clip = sfx_clip(lump);
+    want = sfx_clip_build(W_CacheLumpNum(lump, PU_CACHE), W_LumpLength(lump));
+
+    ok = ok && clip && want && !sfx_queued[lump] && !wad_lump_locked(lump) &&
+         sfx_stats.bytes == sfx_clip_bytes(clip->length, clip->adpcm != NULL) &&
+         clip->length == want->length && clip->step == want->step &&
+         memcmp(clip + 1, want + 1,
+                sfx_clip_bytes(clip->length, clip->adpcm != NULL) -
+                sizeof(*clip)) == 0;
+    if (!ok)
+    {
+        failures++;
+        printf("precache   %s FAILED\n", name);
+    }
+
+    sfx_reset();
+    sfx_cache_free();
+    sfx_cache_budget = 0;
+    snd_running      = 1;
+    I_PrecacheSounds(&mix_sfx, 1);
+    h  = I_StartSound(&mix_sfx, 0, 100, 128);
+    ok = h > 0 && sfx_queued[lump] && wad_lump_locked(lump) &&
+         I_SoundIsPlaying(h) && sfx_cmd_head == sfx_cmd_tail &&
+         sfx_stats.misses == 1 && sfx_stats.bytes == (uint32_t)W_LumpLength(lump);
+
+    sfx_precache_run();
+    sfx_precache_poll();
+    sfx_run_cmds();
+    ok = ok && sfx_cache[lump] && !wad_lump_locked(lump) &&
+         sfx_mixing[0] == sfx_cache[lump] &&
+         sfx_playing[0] == h && I_SoundIsPlaying(h);
+
+    I_StopSound(h);
+    sfx_run_cmds();
+    sfx_cache_trim(NULL);
+    h  = I_StartSound(&mix_sfx, 1, 100, 128);
+    ok = ok && !sfx_cache[lump] && h > 0 && I_SoundIsPlaying(h) &&
+         sfx_cmd_head == sfx_cmd_tail && sfx_stats.misses == 2;
+    sfx_precache_run();
+    sfx_precache_poll();
+    sfx_run_cmds();
+    ok = ok && sfx_cache[lump] && sfx_playing[1] == h;
+    if (!ok)
+    {
+        failures++;
+        printf("precache   %s over the budget FAILED\n", name);
+    }
+
+    sfx_reset();
+    snd_running      = 0;
+    sfx_cache_budget = SFX_CACHE_MAX_BYTES;
+    if (want != &sfx_clip_none)
+        free(want);
+    sceKernelDeleteSema(mcache_sema);
+    mcache_sema      = -1;
+    mcache_thread_id = -1;
+}
+
+/* The audio thread's loop over the first song, with sound effects */
+static void test_mix(int song, int sfx, int mode)
+{
+    void   *handle = NULL;
+    clock_t t;
+
+    if (song >= 0)
+        handle = I_RegisterSong(W_CacheLumpNum(song, PU_STATIC), W_LumpLength(song));
+
+    sfx_reset();
+    mix_blocks      = 0;
+    mix_hook_time   = 0;
+    mix_starts      = 0;
+    memset(mix_handles, 0, sizeof(mix_handles));
+    mix_status_bad  = 0;
+    render_begin(&mix_render, 2);
+
+    if (handle)
+    {
+        I_SetMusicVolume(100);
+        I_PlaySong(handle, 1);
+    }
+
+    snd_running       = 1;
+    host_audio_output = test_mix_output;
+
+    t = clock();
+    audio_thread(0, NULL);
+    time_mix[mode].time    += clock() - t - mix_hook_time;
+    time_mix[mode].samples += (uint64_t)mix_blocks * MIX_SAMPLES;
+
+    host_audio_output = NULL;
+    if (handle)
+        I_UnRegisterSong(handle);
+
+    if (mix_status_bad)
+    {
+        failures++;
+        printf("mix        %-9s I_SoundIsPlaying() FAILED %d times\n",
+               mode_names[mode], mix_status_bad);
+    }
+
+    render_end(&mix_render, "mix", mode);
+}
+
+/*
+ * A sound past what a 16.16 position holds (65536 samples) plays to its
+ * end, as 16-bit and as ADPCM: every output sample of one channel panned
+ * hard left is checked against 64-bit stepping through the samples.
+ */
+#define LONG_SAMPLES    100000
+
+static void test_long_sound(void)
+{
+    static uint8_t  lump[8 + LONG_SAMPLES];
+    static int16_t  ref[LONG_SAMPLES + SFX_ADPCM_BLOCK];
+    sfx_clip_t     *clip;
+    sfx_cmd_t      *cmd;
+    uint64_t        outs, j = 0;
+    int32_t         gain;
+    int             adpcm, i, bad;
+
+    lump[0] = 3;
+    lump[2] = 11025 & 0xFF;
+    lump[3] = 11025 >> 8;
+    lump[4] = (8 + LONG_SAMPLES) & 0xFF;
+    lump[5] = ((8 + LONG_SAMPLES) >> 8) & 0xFF;
+    lump[6] = (8 + LONG_SAMPLES) >> 16;
+    for (i = 0; i < LONG_SAMPLES; i++)
+        lump[8 + i] = 128 + (i * 37 + (i >> 10)) % 200 - 100;
+
+    for (adpcm = 0; adpcm < 2; adpcm++)
+    {
+        sfx_adpcm = adpcm;
+        clip = sfx_clip_build(lump, sizeof(lump));
+        sfx_adpcm = SFX_ADPCM;
+        if (!clip || clip == &sfx_clip_none)
+            continue;
+
+        if (adpcm)
+            for (i = 0; i < LONG_SAMPLES; i += SFX_ADPCM_BLOCK)
+                adpcm_decode_block(clip->adpcm + i / SFX_ADPCM_BLOCK * SFX_ADPCM_BYTES,
+                                   ref + i, SFX_ADPCM_BLOCK);
+        else
+            memcpy(ref, clip->pcm, LONG_SAMPLES * sizeof(int16_t));
+
+        sfx_reset();
+        cmd         = sfx_cmd_slot();
+        cmd->cmd    = SFX_CMD_START;
+        cmd->slot   = 0;
+        cmd->handle = 1;
+        cmd->clip   = clip;
+        cmd->vol    = 127;
+        cmd->sep    = 0;
+        sfx_post();
+        sfx_run_cmds();
+
+        gain = sfx_gain(127, 255);
+        outs = (((uint64_t)LONG_SAMPLES << 16) - 1) / clip->step + 1;
+        for (j = 0, bad = 0; sfx_channels[0].active && !bad; )
+        {
+            sfx_mix(0);
+            for (i = 0; i < MIX_SAMPLES && j < outs; i++, j++)
+            {
+                int32_t want = (ref[(j * clip->step) >> 16] * gain) >> 16;
+
+                bad |= mix_buffer[i*2] != want;
+            }
+        }
+
+        if (bad || j != outs || sfx_channels[0].active)
+        {
+            failures++;
+            printf("long sound %s FAILED at output sample %llu of %llu\n",
+                   adpcm ? "ADPCM" : "16-bit", (unsigned long long)j,
+                   (unsigned long long)outs);
+        }
+        free(clip);
+    }
+
+    sfx_reset();
+}
+
+/* ==================== SFX Cache ==================== */
+
+#define CACHE_LUMP  1000    /* past the WAD's lumps */
+
+static int cache_check(int ok, const char *what)
+{
+    if (!ok)
+    {
+        failures++;
+        printf("sfx cache  FAILED, %s\n", what);
+    }
+    return ok;
+}
+
+/* A copy of 'src' made resident as lump CACHE_LUMP + i */
+static void cache_copy(const sfx_clip_t *src, int i)
+{
+    uint32_t    size = sfx_clip_bytes(src->length, src->adpcm != NULL);
+    sfx_clip_t *clip = malloc(size);
+
+    memcpy(clip, src, size);
+    if (src->adpcm)
+        clip->adpcm = (uint8_t *)(clip + 1);
+    else
+        clip->pcm = (int16_t *)(clip + 1);
+    sfx_cache_store(CACHE_LUMP + i, clip);
+}
+
+/*
+ * Runs the cache on copies of one sound under made-up lump numbers:
+ * over budget the least recently played copy goes, and a copy isn't
+ * evicted while a start is queued or the mixer plays it.
+ */
+static void test_sfx_cache(int lump)
+{
+    static sfxinfo_t sfx;
+    sfx_clip_t      *src;
+    uint32_t         size;
+    int              h, blocks;
+
+    if (lump < 0)
+        return;
+    src = sfx_clip_build(W_CacheLumpNum(lump, PU_STATIC), W_LumpLength(lump));
+    if (!src || src == &sfx_clip_none)
+        return;
+    size = sfx_clip_bytes(src->length, src->adpcm != NULL);
+
+    sfx_reset();
+    sfx_cache_free();
+    memset(&sfx_stats, 0, sizeof(sfx_stats));
+    memset(&sfx, 0, sizeof(sfx));
+    sfx_cache_budget = 2 * size;
+    snd_running      = 1;
+
+    cache_copy(src, 0);
+    cache_copy(src, 1);
+    sfx_clip(CACHE_LUMP);
+    cache_copy(src, 2);
+    if (!cache_check(sfx_cache[CACHE_LUMP] && !sfx_cache[CACHE_LUMP + 1] &&
+                     sfx_cache[CACHE_LUMP + 2] && sfx_stats.bytes == 2 * size,
+                     "the least recently played sound wasn't evicted"))
+        goto done;
+
+    /* Nothing kept but what plays */
+    sfx_cache_budget = 0;
+    sfx.lumpnum      = CACHE_LUMP;
+    h = I_StartSound(&sfx, 0, 100, 128);
+    sfx_cache_trim(NULL);
+    if (!cache_check(sfx_cache[CACHE_LUMP] && !sfx_cache[CACHE_LUMP + 2],
+                     "a sound about to start was evicted"))
+        goto done;
+
+    sfx_run_cmds();
+    I_StopSound(h);
+    sfx_cache_trim(NULL);
+    if (!cache_check(sfx_cache[CACHE_LUMP] != NULL,
+                     "a sound was evicted before its stop was applied"))
+        goto done;
+    sfx_run_cmds();
+    sfx_cache_trim(NULL);
+    if (!cache_check(!sfx_cache[CACHE_LUMP], "a stopped sound wasn't evicted"))
+        goto done;
+
+    /* One that plays out */
+    cache_copy(src, 1);
+    sfx.lumpnum = CACHE_LUMP + 1;
+    I_StartSound(&sfx, 0, 100, 128);
+    sfx_run_cmds();
+    for (blocks = 0; sfx_channels[0].active && blocks < 1000; blocks++)
+    {
+        sfx_cache_trim(NULL);
+        if (!cache_check(sfx_cache[CACHE_LUMP + 1] != NULL,
+                         "a playing sound was evicted"))
+            goto done;
+        sfx_mix(0);
+    }
+    sfx_cache_trim(NULL);
+    if (!cache_check(!sfx_cache[CACHE_LUMP + 1] && sfx_stats.bytes == 0,
+                     "a sound that played out wasn't evicted"))
+        goto done;
+
+    /* An unplayable lump isn't a hit */
+    sfx_cache[CACHE_LUMP + 3] = &sfx_clip_none;
+    sfx.lumpnum = CACHE_LUMP + 3;
+    I_StartSound(&sfx, 0, 100, 128);
+    sfx_cache[CACHE_LUMP + 3] = NULL;
+
+    cache_check(sfx_stats.hits == 3 && sfx_stats.misses == 0 &&
+                sfx_stats.evictions == 4, "the counters are off");
+
+    if (verbose)
+        printf("sfx cache  %u hits, %u misses, %u evictions\n",
+               sfx_stats.hits, sfx_stats.misses, sfx_stats.evictions);
+
+done:
+    free(src);
+    snd_running      = 0;
+    sfx_cache_budget = SFX_CACHE_MAX_BYTES;
+    sfx_reset();
+    sfx_cache_free();
+}
+
+/* ==================== SFX ADPCM ==================== */
+
+#define ADPCM_PASSES    50      /* timed mixes of each clip */
+#define ADPCM_MIN_SNR   20.0    /* dB, on adpcm_signal() */
+#define ADPCM_SAMPLES   11025
+
+static uint32_t bank_sounds, bank_lumps, bank_bytes[2];
+static double   bank_snr;       /* of the timed sound */
+static double   signal_snr[2];  /* of adpcm_signal()'s tone and noise */
+
+/* A clip of 'lump' built as 16-bit samples or as ADPCM */
+static sfx_clip_t *adpcm_clip(int lump, int adpcm)
+{
+    sfx_clip_t *clip;
+
+    sfx_adpcm = adpcm;
+    clip = sfx_clip_build(W_CacheLumpNum(lump, PU_STATIC), W_LumpLength(lump));
+    sfx_adpcm = SFX_ADPCM;
+    return clip == &sfx_clip_none ? NULL : clip;
+}
+
+/*
+ * A second of sound effect as a DMX lump: a tone gliding from 200 Hz to
+ * 2 kHz as it fades, then a rumble of low-passed noise dying away, as
+ * in an explosion
+ */
+static void adpcm_signal(uint8_t *lump)
+{
+    uint32_t seed = 1;
+    double   phase = 0, noise = 0, t, s;
+    int      i, half = ADPCM_SAMPLES / 2;
+
+    lump[0] = 3;
+    lump[1] = 0;
+    lump[2] = 11025 & 0xFF;
+    lump[3] = 11025 >> 8;
+    lump[4] = (8 + ADPCM_SAMPLES) & 0xFF;
+    lump[5] = (8 + ADPCM_SAMPLES) >> 8;
+    lump[6] = lump[7] = 0;
+
+    for (i = 0; i < ADPCM_SAMPLES; i++)
+    {
+        if (i < half)
+        {
+            t      = (double)i / half;
+            phase += 2 * M_PI * 200 * pow(10, t) / 11025;
+            s      = sin(phase) * (1 - 0.5 * t);
+        }
+        else
+        {
+            t     = (double)(i - half) / half;
+            seed  = seed * 1103515245 + 12345;
+            noise = 0.9 * noise + 0.2 * (((int)(seed >> 16 & 0xFF) - 128) / 128.0);
+            s     = noise * (1 - t) * (1 - t);
+        }
+        s = s < -1 ? -1 : s > 1 ? 1 : s;
+        lump[8 + i] = (uint8_t)(128 + lrint(s * 127));
+    }
+}
+
+/* How far samples 'from' to 'to' of 'adpcm' stray from 'pcm', the same
+ * sound as 16-bit samples */
+static double adpcm_snr(const sfx_clip_t *pcm, const sfx_clip_t *adpcm,
+                        int from, int to)
+{
+    int16_t dec[SFX_ADPCM_BLOCK];
+    double  sig = 0, err = 0, d;
+    int     i;
+
+    for (i = from; i < to; i++)
+    {
+        if (i == from || i % SFX_ADPCM_BLOCK == 0)
+            adpcm_decode_block(adpcm->adpcm + i / SFX_ADPCM_BLOCK * SFX_ADPCM_BYTES,
+                               dec, SFX_ADPCM_BLOCK);
+        d    = dec[i % SFX_ADPCM_BLOCK] - pcm->pcm[i];
+        sig += (double)pcm->pcm[i] * pcm->pcm[i];
+        err += d * d;
+    }
+    return err > 0 ? 10 * log10(sig / err) : 99;
+}
+
+/*
+ * The bytes the WAD's sounds keep resident once precached as 16-bit or
+ * ADPCM clips, through the worker's queue and the cache as the game
+ * does it; their lumps must be unlocked by then
+ */
+static uint32_t adpcm_bank(int adpcm)
+{
+    uint32_t budget = sfx_cache_budget, bytes;
+    int      lump, n = wad_num_lumps() < 2048 ? wad_num_lumps() : 2048;
+
+    sfx_adpcm        = adpcm;
+    sfx_cache_budget = 0xFFFFFFFF;
+    bank_sounds      = bank_lumps = 0;
+    for (lump = 0; lump < n; lump++)
+    {
+        if (is_sfx_lump(lump) && !sfx_cache[lump] && sfx_load_queue(lump))
+        {
+            sfx_precache_run();
+            sfx_precache_poll();
+        }
+    }
+
+    bytes = sfx_stats.bytes;
+    for (lump = 0; lump < n; lump++)
+    {
+        if (!is_sfx_lump(lump))
+            continue;
+        if (wad_lump_locked(lump))
+        {
+            failures++;
+            printf("adpcm      FAILED, lump %d still locked\n", lump);
+        }
+        if (sfx_cache[lump] && sfx_cache[lump] != &sfx_clip_none)
+        {
+            bank_sounds++;
+            bank_lumps += W_LumpLength(lump);
+        }
+        else
+            sfx_cache[lump] = NULL;
+    }
+
+    sfx_cache_free();
+    sfx_cache_budget = budget;
+    sfx_adpcm        = SFX_ADPCM;
+    return bytes - sfx_stats.bytes;
+}
+
+/* An ADPCM clip decoded whole into a 16-bit one */
+static sfx_clip_t *adpcm_expand(const sfx_clip_t *src)
+{
+    int         blocks = (src->length + SFX_ADPCM_BLOCK - 1) / SFX_ADPCM_BLOCK;
+    sfx_clip_t *clip   = malloc(sizeof(*clip) +
+                                blocks * SFX_ADPCM_BLOCK * sizeof(int16_t));
+    int         b;
+
+    *clip       = *src;
+    clip->pcm   = (int16_t *)(clip + 1);
+    clip->adpcm = NULL;
+    for (b = 0; b < blocks; b++)
+        adpcm_decode_block(src->adpcm + b * SFX_ADPCM_BYTES,
+                           clip->pcm + b * SFX_ADPCM_BLOCK, SFX_ADPCM_BLOCK);
+    return clip;
+}
+
+/* Every channel plays 'clip', started a block apart and panned apart,
+ * with a fade partway; the blocks mixed until all are done */
+static int adpcm_mix(const sfx_clip_t *clip, render_t *r)
+{
+    sfx_cmd_t *cmd;
+    int        blocks, c, playing;
+
+    sfx_reset();
+    for (blocks = 0; ; blocks++)
+    {
+        if (blocks < SND_CHANNELS)
+        {
+            cmd         = sfx_cmd_slot();
+            cmd->cmd    = SFX_CMD_START;
+            cmd->slot   = blocks;
+            cmd->handle = blocks + 1;
+            cmd->clip   = clip;
+            cmd->vol    = 127;
+            cmd->sep    = blocks * 255 / (SND_CHANNELS - 1);
+            sfx_post();
+        }
+        else if (blocks == SND_CHANNELS * 2)
+        {
+            for (c = 0; c < SND_CHANNELS; c++)
+                I_UpdateSoundParams(c, 60, 128);
+        }
+
+        sfx_run_cmds();
+        sfx_mix(0);
+        if (r)
+            render_add(r, mix_buffer, MIX_SAMPLES * 2);
+
+        for (c = playing = 0; c < SND_CHANNELS; c++)
+            playing |= sfx_channels[c].active;
+        if (!playing && blocks >= SND_CHANNELS)
+            return blocks + 1;
+    }
+}
+
+/*
+ * Sizes every sound in the WAD resident both ways, and checks ADPCM
+ * keeps ADPCM_MIN_SNR on adpcm_signal(). Then checks on the first sound
+ * that mixing its ADPCM clip block by block sounds exactly like mixing
+ * it decoded whole, and times the mixer with each.
+ */
+static void test_adpcm(int sfx)
+{
+    static render_t r[2];
+    static uint8_t  signal[8 + ADPCM_SAMPLES];
+    sfx_clip_t     *clip[2], *whole;
+    clock_t         t;
+    int             f, pass, blocks;
+
+    for (f = 0; f < 2; f++)
+        bank_bytes[f] = adpcm_bank(f);
+
+    adpcm_signal(signal);
+    sfx_adpcm = 0;
+    clip[0]   = sfx_clip_build(signal, sizeof(signal));
+    sfx_adpcm = 1;
+    clip[1]   = sfx_clip_build(signal, sizeof(signal));
+    sfx_adpcm = SFX_ADPCM;
+    for (f = 0; f < 2; f++)
+    {
+        signal_snr[f] = adpcm_snr(clip[0], clip[1], f * ADPCM_SAMPLES / 2,
+                                  (f + 1) * ADPCM_SAMPLES / 2);
+        if (signal_snr[f] < ADPCM_MIN_SNR)
+        {
+            failures++;
+            printf("adpcm      FAILED, %.1f dB SNR on the %s\n",
+                   signal_snr[f], f ? "noise" : "tone");
+        }
+    }
+    free(clip[0]);
+    free(clip[1]);
+
+    if (sfx < 0)
+        return;
+    clip[0] = adpcm_clip(sfx, 0);
+    clip[1] = adpcm_clip(sfx, 1);
+    if (!clip[0] || !clip[1])
+        goto done;
+    whole = adpcm_expand(clip[1]);
+
+    render_begin(&r[0], 2);
+    adpcm_mix(clip[1], &r[0]);
+    render_begin(&r[1], 2);
+    adpcm_mix(whole, &r[1]);
+    if (r[0].hash != r[1].hash)
+    {
+        failures++;
+        printf("adpcm      FAILED, mixing by blocks differs from the decoded clip\n");
+    }
+
+    bank_snr = adpcm_snr(clip[0], clip[1], 0, clip[0]->length);
+    free(whole);
+
+    for (f = 0; f < 2; f++)
+    {
+        t = clock();
+        for (pass = blocks = 0; pass < ADPCM_PASSES; pass++)
+            blocks += adpcm_mix(clip[f], NULL);
+        time_sfx[f].time    += clock() - t;
+        time_sfx[f].samples += (uint64_t)blocks * MIX_SAMPLES;
+    }
+
+done:
+    free(clip[0]);
+    free(clip[1]);
+    sfx_reset();
+}
+
+/* ==================== Main ==================== */
+
+static void report(const char *what, const test_timer_t *tm)
+{
+    double secs = (double)tm->time / CLOCKS_PER_SEC;
+    double rate = secs > 0 ? tm->samples / secs : 0;
+
+    printf("  %-24s %8.2f Msamples/s  %7.0fx realtime\n", what,
+           rate / 1e6, rate / OUTPUT_RATE);
+}
+
+int main(int argc, char **argv)
+{
+    const char *golden_path = NULL, *wad = NULL;
+    int         mode, first = 0, last = 2, instr, lump, song = -1, sfx = -1;
+    int         argi;
+
+    for (argi = 1; argi < argc; argi++)
+    {
+        if (strcmp(argv[argi], "-g") == 0 && argi + 1 < argc)
+            golden_path = argv[++argi];
+        else if (strcmp(argv[argi], "-m") == 0 && argi + 1 < argc)
+            first = last = atoi(argv[++argi]);
+        else if (strcmp(argv[argi], "-o") == 0 && argi + 1 < argc)
+            outdir = argv[++argi];
+        else if (strcmp(argv[argi], "-u") == 0)
+            update = 1;
+        else if (strcmp(argv[argi], "-r") == 0)
+            raw = 1;
+        else if (strcmp(argv[argi], "-v") == 0)
+            verbose = 1;
+        else if (argv[argi][0] != '-' && !wad)
+            wad = argv[argi];
+        else
+        {
+            fprintf(stderr, "usage: sndtest [-g golden] [-u] [-m mode] "
+                            "[-o outdir] [-r] [-v] [file.wad]\n");
+            return 1;
+        }
+    }
+
+    if (first < 0 || last > 2 || (update && !golden_path))
+    {
+        fprintf(stderr, "sndtest: bad mode, or -u without -g\n");
+        return 1;
+    }
+
+    if (wad ? !wad_load(wad) : !wad_load_test())
+    {
+        fprintf(stderr, "sndtest: can't read WAD %s\n", wad);
+        return 1;
+    }
+
+    load_genmidi();
+    if (genmidi_loaded != 1)
+    {
+        fprintf(stderr, "sndtest: no GENMIDI lump\n");
+        return 1;
+    }
+
+    /* Keep renders independent of how fast this machine is */
+    shed_budget_us = 0;
+
+    if (golden_path && !golden_load(golden_path))
+    {
+        fprintf(stderr, "sndtest: can't read %s\n", golden_path);
+        return 1;
+    }
+
+    if (outdir && mkdir(outdir, 0755) != 0 && errno != EEXIST)
+    {
+        fprintf(stderr, "sndtest: can't create %s\n", outdir);
+        return 1;
+    }
+
+    for (lump = 0; lump < wad_num_lumps(); lump++)
+    {
+        char name[9];
+
+        wad_lump_name(lump, name);
+        if (song < 0 && is_music_lump(lump))
+            song = lump;
+        if (sfx < 0 && is_sfx_lump(lump))
+            sfx = lump;
+    }
+
+    /* What I_InitSound() sets up, minus the threads */
+    midi.volume = 127;
+    test_precache(sfx);
+
+    for (mode = first; mode <= last; mode++)
+    {
+        opl_synth_mode = mode;
+
+        for (instr = 0; instr < GENMIDI_NUM_INSTRS; instr++)
+            test_instrument(instr, mode);
+
+        for (lump = 0; lump < wad_num_lumps(); lump++)
+            if (is_music_lump(lump))
+                test_song(lump, mode);
+
+        for (lump = 0; lump < wad_num_lumps(); lump++)
+            if (is_music_lump(lump))
+                test_timing(lump, mode);
+
+        test_mix(song, sfx, mode);
+    }
+
+    if (song >= 0)
+    {
+        test_shed(song);
+        test_music_loop(song);
+    }
+
+    test_long_wait();
+    test_long_sound();
+    test_sfx_cache(sfx);
+    test_adpcm(sfx);
+
+    for (mode = first; mode <= last; mode++)
+    {
+        printf("%s:\n", mode_names[mode]);
+        report("synth (opl_gen_music)", &time_synth[mode]);
+        report("sequencer (midi_advance)", &time_seq[mode]);
+        report("mix loop (audio_thread)", &time_mix[mode]);
+    }
+
+    printf("sound effects, %d channels:\n", SND_CHANNELS);
+    report("16-bit clips (sfx_mix)", &time_sfx[0]);
+    report("ADPCM clips (sfx_mix)", &time_sfx[1]);
+    if (bank_sounds)
+        printf("  %u sounds: %u KB of lumps, resident as %u KB of 16-bit "
+               "clips or %u KB of ADPCM\n", bank_sounds, bank_lumps / 1024,
+               bank_bytes[0] / 1024, bank_bytes[1] / 1024);
+    printf("  ADPCM: %.1f dB SNR on the timed sound, %.1f dB on a tone, "
+           "%.1f dB on noise\n", bank_snr, signal_snr[0], signal_snr[1]);
+
+    if (update)
+    {
+        if (!golden_save(golden_path))
+        {
+            fprintf(stderr, "sndtest: can't write %s\n", golden_path);
+            return 1;
+        }
+        printf("%d renders, golden hashes written to %s\n", renders, golden_path);
+        return 0;
+    }
+
+    if (golden_path)
+        printf("%d renders, %d failed, %d without a golden hash\n",
+               renders, failures, missing);
+    return failures ? 1 : 0;
+}